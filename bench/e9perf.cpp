@@ -0,0 +1,246 @@
+/*
+ * e9perf.cpp
+ * Copyright (C) 2021 National University of Singapore
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Run a command and measure its cost (see bench/overhead.sh).
+ *
+ * The cost is measured with perf_event_open() hardware counters (cycles &
+ * instructions) where available, and otherwise falls back to the wall
+ * time.  The measurement is written as "METRIC VALUE" lines, with the
+ * primary metric (cycles or wall-ns) first.
+ */
+
+#include <cerrno>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+#include <getopt.h>
+#include <unistd.h>
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#define NO_RETURN               __attribute__((__noreturn__))
+
+/*
+ * Report an error and exit.
+ */
+static void NO_RETURN error(const char *msg, ...)
+{
+    fputs("error: ", stderr);
+
+    va_list ap;
+    va_start(ap, msg);
+    vfprintf(stderr, msg, ap);
+    va_end(ap);
+
+    putc('\n', stderr);
+
+    exit(EXIT_FAILURE);
+}
+
+/*
+ * Open a counter for the (stopped) child process.  The counter is enabled
+ * when the child calls execve().  Kernel events are excluded if the
+ * perf_event_paranoid setting does not allow them.
+ */
+static int openCounter(pid_t pid, uint64_t config)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size           = sizeof(attr);
+    attr.type           = PERF_TYPE_HARDWARE;
+    attr.config         = config;
+    attr.disabled       = 1;
+    attr.inherit        = 1;
+    attr.enable_on_exec = 1;
+    int fd = (int)syscall(SYS_perf_event_open, &attr, pid, -1, -1, 0);
+    if (fd < 0 && errno == EACCES)
+    {
+        attr.exclude_kernel = 1;
+        attr.exclude_hv     = 1;
+        fd = (int)syscall(SYS_perf_event_open, &attr, pid, -1, -1, 0);
+    }
+    return fd;
+}
+
+/*
+ * Read a counter.
+ */
+static uint64_t readCounter(int fd)
+{
+    uint64_t value = 0;
+    if (read(fd, &value, sizeof(value)) != sizeof(value))
+        error("failed to read performance counter: %s", strerror(errno));
+    close(fd);
+    return value;
+}
+
+/*
+ * Get the wall time in nanoseconds.
+ */
+static uint64_t getWallTime()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/*
+ * Usage.
+ */
+static void usage(FILE *stream, const char *progname)
+{
+    fprintf(stream, "usage: %s [OPTIONS] COMMAND [ARG...]\n\n"
+        "Run COMMAND and print its cost (cycles & instructions, or the wall\n"
+        "time if performance counters are not available).\n"
+        "\n"
+        "OPTIONS:\n"
+        "\n"
+        "\t--help, -h\n"
+        "\t\tPrint this message and exit.\n"
+        "\n"
+        "\t--output FILE, -o FILE\n"
+        "\t\tWrite the measurement to FILE.  The default is stderr.\n"
+        "\n"
+        "\t--wall\n"
+        "\t\tAlways measure the wall time.\n"
+        "\n"
+        "The exit status is the exit status of COMMAND.\n"
+        "\n", progname);
+}
+
+/*
+ * Options.
+ */
+enum Option
+{
+    OPTION_HELP,
+    OPTION_OUTPUT,
+    OPTION_WALL,
+};
+
+/*
+ * Entry.
+ */
+int main(int argc, char **argv)
+{
+    const char *output = nullptr;
+    bool wall = false;
+
+    const int req_arg = required_argument, no_arg = no_argument;
+    static const struct option long_options[] =
+    {
+        {"help",   no_arg,  nullptr, OPTION_HELP},
+        {"output", req_arg, nullptr, OPTION_OUTPUT},
+        {"wall",   no_arg,  nullptr, OPTION_WALL},
+        {nullptr, 0, nullptr, 0}
+    };
+    while (true)
+    {
+        int idx;
+        int opt = getopt_long_only(argc, argv, "+ho:", long_options, &idx);
+        if (opt < 0)
+            break;
+        switch (opt)
+        {
+            case OPTION_HELP: case 'h':
+                usage(stdout, argv[0]);
+                exit(EXIT_SUCCESS);
+            case OPTION_OUTPUT: case 'o':
+                output = optarg;
+                break;
+            case OPTION_WALL:
+                wall = true;
+                break;
+            default:
+                error("failed to parse command-line options; try `--help' "
+                    "for more information");
+        }
+    }
+    if (optind >= argc)
+        error("missing COMMAND argument; try `--help' for more "
+            "information");
+
+    // The child blocks on a pipe until the counters are attached:
+    int fds[2];
+    if (pipe(fds) < 0)
+        error("failed to create pipe: %s", strerror(errno));
+    pid_t pid = fork();
+    if (pid < 0)
+        error("failed to fork process: %s", strerror(errno));
+    if (pid == 0)
+    {
+        close(fds[1]);
+        char c;
+        if (read(fds[0], &c, sizeof(c)) != sizeof(c))
+            _exit(EXIT_FAILURE);
+        close(fds[0]);
+        execvp(argv[optind], argv + optind);
+        fprintf(stderr, "error: failed to execute \"%s\": %s\n",
+            argv[optind], strerror(errno));
+        _exit(127);
+    }
+    close(fds[0]);
+    int cycles = -1, instrs = -1;
+    if (!wall)
+    {
+        cycles = openCounter(pid, PERF_COUNT_HW_CPU_CYCLES);
+        instrs = (cycles < 0? -1:
+            openCounter(pid, PERF_COUNT_HW_INSTRUCTIONS));
+    }
+
+    uint64_t t0 = getWallTime();
+    if (write(fds[1], "x", 1) != 1)
+        error("failed to start process: %s", strerror(errno));
+    close(fds[1]);
+    int status;
+    while (waitpid(pid, &status, 0) < 0)
+    {
+        if (errno != EINTR)
+            error("failed to wait for process: %s", strerror(errno));
+    }
+    uint64_t t1 = getWallTime();
+
+    FILE *stream = stderr;
+    if (output != nullptr)
+    {
+        stream = fopen(output, "w");
+        if (stream == nullptr)
+            error("failed to open file \"%s\" for writing: %s", output,
+                strerror(errno));
+    }
+    if (cycles >= 0)
+        fprintf(stream, "cycles %llu\n",
+            (unsigned long long)readCounter(cycles));
+    fprintf(stream, "wall-ns %llu\n", (unsigned long long)(t1 - t0));
+    if (instrs >= 0)
+        fprintf(stream, "instructions %llu\n",
+            (unsigned long long)readCounter(instrs));
+    if (stream != stderr)
+        fclose(stream);
+
+    if (WIFSIGNALED(status))
+        return 128 + WTERMSIG(status);
+    return WEXITSTATUS(status);
+}
@@ -0,0 +1,490 @@
+/*
+ * e9synth.cpp
+ * Copyright (C) 2021 National University of Singapore
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Generate a synthetic x86_64 ELF executable, and a matching e9patch
+ * JSON-RPC patch stream (see bench/synth.sh).
+ *
+ * The code is a straight-line sequence of register-only instructions
+ * (on %rax/%rcx/%rdx/%rsi) drawn from a configurable instruction-length
+ * mix, followed by exit(0).  The binary is therefore runnable, so the
+ * patched output can be checked.  Since the generator knows all of the
+ * instruction boundaries, no frontend (e9tool) or disassembler is needed.
+ */
+
+#include <cerrno>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <string>
+#include <vector>
+
+#include <elf.h>
+#include <getopt.h>
+#include <sys/stat.h>
+
+#define NO_RETURN               __attribute__((__noreturn__))
+
+#define PAGE_SIZE               4096
+#define MAX_LENGTH              10
+#define SHORT_LENGTH            5       // sizeof(jmpq rel32)
+
+/*
+ * Report an error and exit.
+ */
+static void NO_RETURN error(const char *msg, ...)
+{
+    fputs("error: ", stderr);
+
+    va_list ap;
+    va_start(ap, msg);
+    vfprintf(stderr, msg, ap);
+    va_end(ap);
+
+    putc('\n', stderr);
+
+    exit(EXIT_FAILURE);
+}
+
+/*
+ * Pseudo-random numbers (xorshift64*), so the output only depends on the
+ * seed.
+ */
+static uint64_t state = 0x9e3779b97f4a7c15ull;
+static uint64_t rand64()
+{
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 0x2545f4914f6cdd1dull;
+}
+static unsigned randN(unsigned n)
+{
+    return (unsigned)(rand64() % n);
+}
+
+/*
+ * Emit a random (safe) instruction of the given length.
+ */
+static void emitInstr(std::vector<uint8_t> &code, unsigned len)
+{
+    static const uint8_t regs[] = {0, 1, 2, 6};     // eax,ecx,edx,esi
+    static const uint8_t alu[]  =                   // add,or,and,sub,...
+        {0x01, 0x09, 0x21, 0x29, 0x31, 0x39, 0x85, 0x89};
+    static const uint8_t one[]  =                   // nop,cltq,cltd,...
+        {0x90, 0x98, 0x99, 0xf5, 0xf8, 0xf9, 0xfc};
+    uint8_t r = regs[randN(sizeof(regs))], s = regs[randN(sizeof(regs))];
+    uint8_t modrm = 0xc0 | (s << 3) | r;
+    uint64_t imm = rand64();
+    switch (len)
+    {
+        case 1:                         // e.g., nop
+            code.push_back(one[randN(sizeof(one))]);
+            return;
+        case 2:                         // e.g., add %ecx,%eax
+            code.push_back(alu[randN(sizeof(alu))]);
+            code.push_back(modrm);
+            return;
+        case 3:
+            if (randN(2) == 0)
+            {
+                code.push_back(0x48);   // e.g., add %rcx,%rax
+                code.push_back(alu[randN(sizeof(alu))]);
+                code.push_back(modrm);
+            }
+            else
+            {
+                code.push_back(0x83);   // add $imm8,%eax
+                code.push_back(0xc0 | r);
+                code.push_back((uint8_t)imm);
+            }
+            return;
+        case 4:                         // add $imm8,%rax
+            code.push_back(0x48);
+            code.push_back(0x83);
+            code.push_back(0xc0 | r);
+            code.push_back((uint8_t)imm);
+            return;
+        case 5:                         // mov $imm32,%eax
+            code.push_back(0xb8 | r);
+            break;
+        case 6:                         // add $imm32,%eax
+            code.push_back(0x81);
+            code.push_back(0xc0 | r);
+            break;
+        case 7:                         // mov $imm32,%rax
+            code.push_back(0x48);
+            code.push_back(0xc7);
+            code.push_back(0xc0 | r);
+            break;
+        case 8:                         // lea disp32(%rsp),%rax
+            code.push_back(0x48);
+            code.push_back(0x8d);
+            code.push_back(0x84 | (r << 3));
+            code.push_back(0x24);
+            break;
+        case 9:                         // nopw disp32(%rax,%rax,1)
+            code.push_back(0x66);
+            code.push_back(0x0f);
+            code.push_back(0x1f);
+            code.push_back(0x84);
+            code.push_back(0x00);
+            break;
+        case 10:                        // movabs $imm64,%rax
+            code.push_back(0x48);
+            code.push_back(0xb8 | r);
+            for (unsigned i = 0; i < sizeof(uint64_t); i++)
+                code.push_back((uint8_t)(imm >> (8 * i)));
+            return;
+        default:
+            error("invalid instruction length (%u)", len);
+    }
+    for (unsigned i = 0; i < sizeof(uint32_t); i++)
+        code.push_back((uint8_t)(imm >> (8 * i)));
+}
+
+/*
+ * Parse a size (with an optional K/M/G suffix).
+ */
+static size_t parseSize(const char *str)
+{
+    char *end = nullptr;
+    errno = 0;
+    size_t size = (size_t)strtoull(str, &end, 0);
+    if (errno != 0 || end == str)
+        error("failed to parse size \"%s\"", str);
+    switch (*end)
+    {
+        case 'G': size *= 1024;         // Fallthrough
+        case 'M': size *= 1024;         // Fallthrough
+        case 'K': size *= 1024; end++;  // Fallthrough
+        case '\0':
+            break;
+        default:
+            error("failed to parse size \"%s\"; invalid suffix", str);
+    }
+    if (*end != '\0')
+        error("failed to parse size \"%s\"; invalid suffix", str);
+    return size;
+}
+
+/*
+ * Parse an instruction-length mix, e.g., "1:5,2:15,5:20", into a weight for
+ * each length.
+ */
+static void parseMix(const char *str, unsigned *weights)
+{
+    memset(weights, 0, (MAX_LENGTH+1) * sizeof(unsigned));
+    const char *s = str;
+    while (*s != '\0')
+    {
+        char *end = nullptr;
+        unsigned long len = strtoul(s, &end, 10);
+        if (end == s || *end != ':' || len < 1 || len > MAX_LENGTH)
+            error("failed to parse mix \"%s\"; expected LEN:WEIGHT,... "
+                "with LEN in 1..%u", str, MAX_LENGTH);
+        s = end + 1;
+        unsigned long weight = strtoul(s, &end, 10);
+        if (end == s || (*end != ',' && *end != '\0'))
+            error("failed to parse mix \"%s\"; invalid weight", str);
+        weights[len] = (unsigned)weight;
+        s = (*end == ','? end + 1: end);
+    }
+}
+
+/*
+ * Pick an instruction length.  If 0 <= short_pct <= 100, then a length
+ * < SHORT_LENGTH is picked with probability short_pct%, and otherwise
+ * the mix weights decide.
+ */
+static unsigned pickLength(const unsigned *weights, int short_pct)
+{
+    unsigned lo = 1, hi = MAX_LENGTH;
+    if (short_pct >= 0)
+    {
+        bool is_short = (randN(100) < (unsigned)short_pct);
+        lo = (is_short? 1: SHORT_LENGTH);
+        hi = (is_short? SHORT_LENGTH-1: MAX_LENGTH);
+    }
+    unsigned total = 0;
+    for (unsigned len = lo; len <= hi; len++)
+        total += weights[len];
+    if (total == 0)
+        error("failed to pick instruction length in %u..%u; all weights "
+            "are zero", lo, hi);
+    unsigned x = randN(total);
+    for (unsigned len = lo; len <= hi; len++)
+    {
+        if (x < weights[len])
+            return len;
+        x -= weights[len];
+    }
+    return hi;
+}
+
+/*
+ * Usage.
+ */
+static void usage(FILE *stream, const char *progname)
+{
+    fprintf(stream, "usage: %s [OPTIONS] OUTPUT\n\n"
+        "Generate a synthetic x86_64 ELF executable OUTPUT, and the e9patch\n"
+        "JSON-RPC patch stream OUTPUT.json that patches it (with an empty\n"
+        "trampoline) into OUTPUT.out.\n"
+        "\n"
+        "OPTIONS:\n"
+        "\n"
+        "\t--help, -h\n"
+        "\t\tPrint this message and exit.\n"
+        "\n"
+        "\t--mix=LEN:WEIGHT,...\n"
+        "\t\tThe relative weight of each instruction length (1..%u).\n"
+        "\t\tDefault: 1:5,2:15,3:20,4:15,5:15,6:5,7:15,8:5,9:1,10:4\n"
+        "\n"
+        "\t--patch=PERCENT\n"
+        "\t\tPatch (roughly) PERCENT%% of the instructions.\n"
+        "\t\tDefault: 100\n"
+        "\n"
+        "\t--pic\n"
+        "\t\tGenerate a position-independent executable.\n"
+        "\n"
+        "\t--seed=N\n"
+        "\t\tThe pseudo-random number generator seed.\n"
+        "\t\tDefault: 1\n"
+        "\n"
+        "\t--short=PERCENT\n"
+        "\t\tMake PERCENT%% of the instructions short (< %u bytes), i.e.,\n"
+        "\t\ttoo short for a jmpq.  This overrides the mix ratio between\n"
+        "\t\tshort and long instructions.\n"
+        "\n"
+        "\t--size=SIZE\n"
+        "\t\tThe (approximate) code size, with an optional K/M/G suffix.\n"
+        "\t\tDefault: 1M\n"
+        "\n", progname, MAX_LENGTH, SHORT_LENGTH);
+}
+
+/*
+ * Options.
+ */
+enum Option
+{
+    OPTION_HELP,
+    OPTION_MIX,
+    OPTION_PATCH,
+    OPTION_PIC,
+    OPTION_SEED,
+    OPTION_SHORT,
+    OPTION_SIZE,
+};
+
+/*
+ * Entry.
+ */
+int main(int argc, char **argv)
+{
+    const char *mix = "1:5,2:15,3:20,4:15,5:15,6:5,7:15,8:5,9:1,10:4";
+    unsigned patch_pct = 100;
+    bool pic = false;
+    int short_pct = -1;
+    size_t size = 1024 * 1024;
+
+    const int req_arg = required_argument, no_arg = no_argument;
+    static const struct option long_options[] =
+    {
+        {"help",  no_arg,  nullptr, OPTION_HELP},
+        {"mix",   req_arg, nullptr, OPTION_MIX},
+        {"patch", req_arg, nullptr, OPTION_PATCH},
+        {"pic",   no_arg,  nullptr, OPTION_PIC},
+        {"seed",  req_arg, nullptr, OPTION_SEED},
+        {"short", req_arg, nullptr, OPTION_SHORT},
+        {"size",  req_arg, nullptr, OPTION_SIZE},
+        {nullptr, 0, nullptr, 0}
+    };
+    while (true)
+    {
+        int idx;
+        int opt = getopt_long_only(argc, argv, "h", long_options, &idx);
+        if (opt < 0)
+            break;
+        switch (opt)
+        {
+            case OPTION_HELP: case 'h':
+                usage(stdout, argv[0]);
+                exit(EXIT_SUCCESS);
+            case OPTION_MIX:
+                mix = optarg;
+                break;
+            case OPTION_PATCH:
+                patch_pct = (unsigned)atoi(optarg);
+                if (patch_pct > 100)
+                    error("failed to parse argument \"%s\" for the "
+                        "`--patch' option; expected a percentage", optarg);
+                break;
+            case OPTION_PIC:
+                pic = true;
+                break;
+            case OPTION_SEED:
+                state ^= (uint64_t)strtoull(optarg, nullptr, 0) *
+                    0xbf58476d1ce4e5b9ull;
+                break;
+            case OPTION_SHORT:
+                short_pct = atoi(optarg);
+                if (short_pct < 0 || short_pct > 100)
+                    error("failed to parse argument \"%s\" for the "
+                        "`--short' option; expected a percentage", optarg);
+                break;
+            case OPTION_SIZE:
+                size = parseSize(optarg);
+                break;
+            default:
+                error("failed to parse command-line options; try `--help' "
+                    "for more information");
+        }
+    }
+    if (argc - optind != 1)
+        error("expected 1 argument (OUTPUT), got %d; try `--help' for more "
+            "information", argc - optind);
+    std::string output(argv[optind]);
+    unsigned weights[MAX_LENGTH+1];
+    parseMix(mix, weights);
+
+    // Step (1): Generate the code:
+    const uint64_t base = (pic? 0x0: 0x400000);
+    const size_t text_offset = PAGE_SIZE;
+    std::vector<uint8_t> code;
+    std::vector<uint32_t> instrs;       // Instruction offsets.
+    while (code.size() < size)
+    {
+        instrs.push_back((uint32_t)code.size());
+        emitInstr(code, pickLength(weights, short_pct));
+    }
+    size_t num_patchable = instrs.size();
+    const uint8_t exit0[] =
+    {
+        0xb8, 0x3c, 0x00, 0x00, 0x00,   // mov $SYS_exit,%eax
+        0x31, 0xff,                     // xor %edi,%edi
+        0x0f, 0x05                      // syscall
+    };
+    const unsigned exit0_lengths[] = {5, 2, 2};
+    size_t exit0_offset = code.size();
+    code.insert(code.end(), exit0, exit0 + sizeof(exit0));
+    for (unsigned len: exit0_lengths)
+    {
+        instrs.push_back((uint32_t)exit0_offset);
+        exit0_offset += len;
+    }
+    instrs.push_back((uint32_t)exit0_offset);
+
+    // Step (2): Write the ELF file.  The headers, a (dummy) note, and the
+    //           code are all loaded by a single PT_LOAD segment:
+    const unsigned NUM_PHDRS = 3;
+    const Elf64_Nhdr nhdr = {/*namesz=*/4, /*descsz=*/0, NT_GNU_ABI_TAG};
+    const size_t note_offset = sizeof(Elf64_Ehdr) +
+        NUM_PHDRS * sizeof(Elf64_Phdr);
+    const size_t note_size = sizeof(nhdr) + /*"GNU\0"=*/4;
+    std::vector<uint8_t> elf(text_offset + code.size());
+    Elf64_Ehdr *ehdr = (Elf64_Ehdr *)elf.data();
+    memcpy(ehdr->e_ident, ELFMAG, SELFMAG);
+    ehdr->e_ident[EI_CLASS]   = ELFCLASS64;
+    ehdr->e_ident[EI_DATA]    = ELFDATA2LSB;
+    ehdr->e_ident[EI_VERSION] = EV_CURRENT;
+    ehdr->e_ident[EI_OSABI]   = ELFOSABI_SYSV;
+    ehdr->e_type      = (pic? ET_DYN: ET_EXEC);
+    ehdr->e_machine   = EM_X86_64;
+    ehdr->e_version   = EV_CURRENT;
+    ehdr->e_entry     = base + text_offset;
+    ehdr->e_phoff     = sizeof(Elf64_Ehdr);
+    ehdr->e_ehsize    = sizeof(Elf64_Ehdr);
+    ehdr->e_phentsize = sizeof(Elf64_Phdr);
+    ehdr->e_phnum     = NUM_PHDRS;
+    Elf64_Phdr *phdrs = (Elf64_Phdr *)(elf.data() + ehdr->e_phoff);
+    phdrs[0].p_type   = PT_LOAD;
+    phdrs[0].p_flags  = PF_R | PF_X;
+    phdrs[0].p_offset = 0;
+    phdrs[0].p_vaddr  = base;
+    phdrs[0].p_paddr  = base;
+    phdrs[0].p_filesz = elf.size();
+    phdrs[0].p_memsz  = elf.size();
+    phdrs[0].p_align  = PAGE_SIZE;
+    phdrs[1].p_type   = PT_NOTE;
+    phdrs[1].p_flags  = PF_R;
+    phdrs[1].p_offset = note_offset;
+    phdrs[1].p_vaddr  = base + note_offset;
+    phdrs[1].p_paddr  = base + note_offset;
+    phdrs[1].p_filesz = note_size;
+    phdrs[1].p_memsz  = note_size;
+    phdrs[1].p_align  = sizeof(uint32_t);
+    phdrs[2].p_type   = PT_GNU_STACK;
+    phdrs[2].p_flags  = PF_R | PF_W;
+    memcpy(elf.data() + note_offset, &nhdr, sizeof(nhdr));
+    memcpy(elf.data() + note_offset + sizeof(nhdr), "GNU", 4);
+    memcpy(elf.data() + text_offset, code.data(), code.size());
+
+    FILE *stream = fopen(output.c_str(), "w");
+    if (stream == nullptr)
+        error("failed to open file \"%s\" for writing: %s", output.c_str(),
+            strerror(errno));
+    if (fwrite(elf.data(), sizeof(uint8_t), elf.size(), stream) !=
+            elf.size() || fclose(stream) != 0)
+        error("failed to write file \"%s\": %s", output.c_str(),
+            strerror(errno));
+    if (chmod(output.c_str(), 0755) < 0)
+        error("failed to set execute permission for file \"%s\": %s",
+            output.c_str(), strerror(errno));
+
+    // Step (3): Write the patch stream.  Instructions are sent & patched
+    //           in reverse order (as per e9tool).  The exit code is not
+    //           patched, but is still sent, since e9patch may need to
+    //           modify it:
+    std::string json(output + ".json");
+    stream = fopen(json.c_str(), "w");
+    if (stream == nullptr)
+        error("failed to open file \"%s\" for writing: %s", json.c_str(),
+            strerror(errno));
+    unsigned id = 0;
+    fprintf(stream, "{\"jsonrpc\":\"2.0\",\"method\":\"binary\",\"params\":"
+        "{\"filename\":\"%s\",\"mode\":\"exe\"},\"id\":%u}\n",
+        output.c_str(), id++);
+    fprintf(stream, "{\"jsonrpc\":\"2.0\",\"method\":\"trampoline\","
+        "\"params\":{\"name\":\"passthru\",\"template\":[\"$instruction\","
+        "\"$continue\"]},\"id\":%u}\n", id++);
+    for (size_t i = instrs.size() - 1; i-- > 0; )
+    {
+        size_t offset = text_offset + instrs[i];
+        fprintf(stream, "{\"jsonrpc\":\"2.0\",\"method\":\"instruction\","
+            "\"params\":{\"address\":%zu,\"length\":%u,\"offset\":%zu},"
+            "\"id\":%u}\n", (size_t)base + offset,
+            instrs[i+1] - instrs[i], offset, id++);
+        if (i >= num_patchable || randN(100) >= patch_pct)
+            continue;
+        fprintf(stream, "{\"jsonrpc\":\"2.0\",\"method\":\"patch\","
+            "\"params\":{\"trampoline\":\"passthru\",\"offset\":%zu},"
+            "\"id\":%u}\n", offset, id++);
+    }
+    fprintf(stream, "{\"jsonrpc\":\"2.0\",\"method\":\"emit\",\"params\":"
+        "{\"filename\":\"%s.out\",\"format\":\"binary\"},\"id\":%u}\n",
+        output.c_str(), id++);
+    if (fclose(stream) != 0)
+        error("failed to write file \"%s\": %s", json.c_str(),
+            strerror(errno));
+
+    return 0;
+}
@@ -0,0 +1,180 @@
+/*
+ * e9work.c
+ * Copyright (C) 2021 National University of Singapore
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Small workloads for measuring the runtime overhead of patched binaries
+ * (see bench/overhead.sh).
+ *
+ * usage: e9work WORKLOAD [SCALE]
+ *
+ * The amount of work is SCALE% (default 100) of the default.  Each
+ * workload prints a checksum, so that the output of the patched and
+ * original binaries can be compared.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NOINLINE    __attribute__((__noinline__))
+
+/*
+ * Tight loop (mostly short instructions).
+ */
+static uint64_t loop(unsigned long n)
+{
+    uint64_t x = 0x12345678;
+    for (unsigned long i = 0; i < n * 100000; i++)
+    {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+    }
+    return x;
+}
+
+/*
+ * Call-heavy code.
+ */
+static NOINLINE uint64_t leaf(uint64_t x, uint64_t i)
+{
+    return x * 31 + i;
+}
+static NOINLINE uint64_t node(uint64_t x, uint64_t i)
+{
+    return leaf(leaf(x, i), i + 1);
+}
+static uint64_t call(unsigned long n)
+{
+    uint64_t x = 0;
+    for (unsigned long i = 0; i < n * 100000; i++)
+        x = node(x, i);
+    return x;
+}
+
+/*
+ * Branchy bytecode interpreter.
+ */
+enum Opcode
+{
+    OP_PUSH, OP_ADD, OP_SUB, OP_DUP, OP_SWAP, OP_JNZ, OP_DEC, OP_HALT
+};
+static const uint8_t program[] =
+{
+    OP_PUSH, 0, OP_PUSH, 100,           // acc = 0, count = 100
+    OP_SWAP, OP_PUSH, 3, OP_ADD,        // do { acc += 3;
+    OP_DUP, OP_PUSH, 1, OP_SUB,         //      acc += acc - 1;
+    OP_SWAP, OP_ADD, OP_SWAP,
+    OP_DEC, OP_DUP, OP_JNZ, 4,          // } while (--count);
+    OP_HALT
+};
+static NOINLINE uint64_t run(const uint8_t *code)
+{
+    uint64_t stack[16], *sp = stack;
+    for (const uint8_t *pc = code; ; )
+    {
+        switch (*pc++)
+        {
+            case OP_PUSH:
+                *sp++ = *pc++;
+                break;
+            case OP_ADD:
+                sp--; sp[-1] += sp[0];
+                break;
+            case OP_SUB:
+                sp--; sp[-1] -= sp[0];
+                break;
+            case OP_DUP:
+                sp[0] = sp[-1]; sp++;
+                break;
+            case OP_SWAP:
+            {
+                uint64_t tmp = sp[-1];
+                sp[-1] = sp[-2]; sp[-2] = tmp;
+                break;
+            }
+            case OP_JNZ:
+                sp--;
+                pc = (sp[0] != 0? code + *pc: pc + 1);
+                break;
+            case OP_DEC:
+                sp[-1]--;
+                break;
+            case OP_HALT:
+                return sp[-1] + sp[-2];
+            default:
+                abort();
+        }
+    }
+}
+static uint64_t interp(unsigned long n)
+{
+    uint64_t x = 0;
+    for (unsigned long i = 0; i < n * 200; i++)
+        x += run(program);
+    return x;
+}
+
+/*
+ * memcpy()-heavy loop.
+ */
+static uint64_t copy(unsigned long n)
+{
+    static uint8_t buf[2][4096];
+    memset(buf[0], 0x5a, sizeof(buf[0]));
+    uint64_t x = 0;
+    for (unsigned long i = 0; i < n * 5000; i++)
+    {
+        size_t len = 64 + (i * 97) % (sizeof(buf[0]) - 64);
+        memcpy(buf[(i+1) % 2], buf[i % 2], len);
+        buf[(i+1) % 2][i % len]++;
+        x += buf[(i+1) % 2][len-1];
+    }
+    return x;
+}
+
+/*
+ * Entry.
+ */
+int main(int argc, char **argv)
+{
+    if (argc < 2 || argc > 3)
+    {
+        fprintf(stderr, "usage: %s (loop|call|interp|memcpy) [SCALE]\n",
+            argv[0]);
+        return EXIT_FAILURE;
+    }
+    unsigned long n = (argc == 3? strtoul(argv[2], NULL, 0): 100);
+    uint64_t x;
+    if (strcmp(argv[1], "loop") == 0)
+        x = loop(n);
+    else if (strcmp(argv[1], "call") == 0)
+        x = call(n);
+    else if (strcmp(argv[1], "interp") == 0)
+        x = interp(n);
+    else if (strcmp(argv[1], "memcpy") == 0)
+        x = copy(n);
+    else
+    {
+        fprintf(stderr, "error: unknown workload \"%s\"\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+    printf("%s: %llu\n", argv[1], (unsigned long long)x);
+    return 0;
+}
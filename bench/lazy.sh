@@ -0,0 +1,68 @@
+#!/bin/bash
+#
+# Compare the startup latency of eager and lazy (`--lazy-loader') loading.
+#
+# usage: bench/lazy.sh [BINARY [RUNS [ARGS...]]]
+#
+# Every instruction of BINARY (default /bin/ls) is patched with an empty
+# (passthru) trampoline, once with the default eager loader and once with
+# the lazy loader.  Each binary (and the original) is then run RUNS times
+# with ARGS (default --version), and the best time is reported.  Since ARGS
+# only execute a small fraction of the code, most trampoline pages are cold.
+#
+# Note: eager loading of large binaries may exceed the mapping limit (see
+# /proc/sys/vm/max_map_count).
+#
+
+if [ -t 1 ]
+then
+    GREEN="\033[32m"
+    YELLOW="\033[33m"
+    OFF="\033[0m"
+else
+    GREEN=
+    YELLOW=
+    OFF=
+fi
+
+set -e
+
+BINARY=${1:-/bin/ls}
+RUNS=${2:-100}
+shift 2 || shift $#
+ARGS=${@:---version}
+
+mkdir -p tmp
+
+now()
+{
+    date +%s%N
+}
+
+./e9tool "$BINARY" --match true --action=passthru -o tmp/lazy.eager \
+    >/dev/null 2>&1
+./e9tool "$BINARY" --match true --action=passthru -o tmp/lazy.lazy \
+    --option --lazy-loader >/dev/null 2>&1
+
+for MODE in original eager lazy
+do
+    case $MODE in
+        original)
+            PROGRAM=$BINARY;;
+        *)
+            PROGRAM=tmp/lazy.$MODE;;
+    esac
+    BEST=
+    for RUN in $(seq $RUNS)
+    do
+        T0=$(now)
+        $PROGRAM $ARGS >/dev/null 2>&1
+        T1=$(now)
+        T=$(( (T1 - T0) / 1000 ))
+        if [ -z "$BEST" ] || [ $T -lt $BEST ]
+        then
+            BEST=$T
+        fi
+    done
+    echo -e "${YELLOW}$MODE${OFF}: best=${GREEN}${BEST}us${OFF} ($RUNS runs)"
+done
@@ -0,0 +1,143 @@
+#!/bin/bash
+#
+# Measure the runtime overhead of patched binaries.
+#
+# usage: bench/overhead.sh [RUNS [SCALE]]
+#
+# Each workload from bench/e9work.c (a tight loop, call-heavy code, a branchy
+# interpreter, and a memcpy()-heavy loop) is patched with each ACTION at each
+# optimization LEVEL, and run RUNS times (default 3) at SCALE% (default 100)
+# of the default amount of work.  The `print' action runs at 1% of SCALE,
+# since it writes every executed instruction.  The `trap' action (and
+# --trap-all) is not measured, since it stops the program.
+#
+# The cost is measured by e9perf, which uses perf_event_open() cycle counters
+# where available, and falls back to the wall time.  The best run is
+# reported as the slowdown relative to the original binary (at the same
+# scale).  The output of each patched binary must match the original, else
+# FAILED is reported and the script exits with a non-zero status.
+#
+# The LEVELS (default "0 1 2 3 s") and WORKLOADS (default "loop call interp
+# memcpy") can be overridden, as can the ACTIONS (one per line).
+#
+
+if [ -t 1 ]
+then
+    GREEN="\033[32m"
+    RED="\033[31m"
+    YELLOW="\033[33m"
+    OFF="\033[0m"
+else
+    GREEN=
+    RED=
+    YELLOW=
+    OFF=
+fi
+
+set -e
+
+RUNS=${1:-3}
+SCALE=${2:-100}
+LEVELS=${LEVELS:-0 1 2 3 s}
+WORKLOADS=${WORKLOADS:-loop call interp memcpy}
+if [ -n "$ACTIONS" ]
+then
+    mapfile -t ACTIONS <<< "$ACTIONS"
+else
+    ACTIONS=(
+        'passthru'
+        'print'
+        'call entry@nop'
+        'call[naked] entry@nop'
+        'call[after] entry(addr)@nop'
+        'call entry(addr,instr,size,next)@nop'
+        'call entry(asm,rflags,rdi,rip,target)@nop'
+        'call entry(&rsp,&rax,&rsi,&rdi,&r8,&r15)@nop'
+    )
+fi
+
+if [ ! -x ./e9tool ]
+then
+    echo "error: ./e9tool not found; run ./build.sh first" >&2
+    exit 1
+fi
+
+mkdir -p tmp/overhead
+gcc -O2 -o tmp/overhead/e9work bench/e9work.c
+g++ -std=c++11 -O2 -o tmp/overhead/e9perf bench/e9perf.cpp
+./e9compile.sh examples/nop.c >/dev/null 2>&1
+
+# Run a binary RUNS times, and get the best (smallest) cost.  The metric
+# name is saved in METRIC, and the output in tmp/overhead/$NAME.out.
+measure()
+{
+    local NAME=$1
+    shift
+    local BEST=
+    for RUN in $(seq $RUNS)
+    do
+        if ! tmp/overhead/e9perf -o tmp/overhead/perf.txt "$@" \
+            >tmp/overhead/$NAME.out 2>/dev/null
+        then
+            return 1
+        fi
+        read METRIC COST < tmp/overhead/perf.txt
+        if [ -z "$BEST" ] || [ $COST -lt $BEST ]
+        then
+            BEST=$COST
+        fi
+    done
+    echo $BEST
+}
+
+FAILED=0
+declare -A BASELINE
+for WORKLOAD in $WORKLOADS
+do
+    for S in $SCALE $(( (SCALE + 99) / 100 ))
+    do
+        BASELINE[$S]=$(measure "base.$S" tmp/overhead/e9work $WORKLOAD $S)
+    done
+    read METRIC COST < tmp/overhead/perf.txt
+    echo -e "${YELLOW}$WORKLOAD${OFF} (baseline: ${BASELINE[$SCALE]} $METRIC):"
+    printf "%-45s" ACTION
+    for LEVEL in $LEVELS
+    do
+        printf " %8s" "-O$LEVEL"
+    done
+    echo
+
+    for ACTION in "${ACTIONS[@]}"
+    do
+        S=$SCALE
+        if [ "$ACTION" = print ]
+        then
+            S=$(( (SCALE + 99) / 100 ))
+        fi
+        printf "%-45s" "$ACTION"
+        for LEVEL in $LEVELS
+        do
+            RESULT=FAILED
+            COLOR=$RED
+            if ./e9tool tmp/overhead/e9work --match true "--action=$ACTION" \
+                    -O$LEVEL -o tmp/overhead/e9work.patched >/dev/null 2>&1 &&
+                COST=$(measure patched tmp/overhead/e9work.patched \
+                    $WORKLOAD $S) &&
+                cmp -s tmp/overhead/patched.out tmp/overhead/base.$S.out
+            then
+                RESULT=$(awk "BEGIN {printf(\"%.2fx\", \
+                    $COST / (${BASELINE[$S]} == 0? 1: ${BASELINE[$S]}))}")
+                COLOR=$GREEN
+            else
+                FAILED=1
+            fi
+            echo -en " $COLOR"
+            printf "%8s" "$RESULT"
+            echo -en "$OFF"
+        done
+        echo
+    done
+    echo
+done
+
+exit $FAILED
@@ -0,0 +1,75 @@
+#!/bin/bash
+#
+# Compare e9patch throughput for the JSON and binary message encodings.
+#
+# usage: bench/rpc.sh [BINARY [ACTION [RUNS]]]
+#
+# The same e9tool patch stream is captured once per encoding (using
+# `--format json'), and then replayed through `e9patch -i' RUNS times.  The
+# JSON stream is written to tmp/rpc.json.json, and the binary stream to
+# tmp/rpc.binary.rpc.
+#
+
+if [ -t 1 ]
+then
+    GREEN="\033[32m"
+    YELLOW="\033[33m"
+    OFF="\033[0m"
+else
+    GREEN=
+    YELLOW=
+    OFF=
+fi
+
+set -e
+
+BINARY=${1:-./e9tool}
+ACTION=${2:-passthru}
+RUNS=${3:-5}
+
+mkdir -p tmp
+
+now()
+{
+    date +%s%N
+}
+
+for ENCODING in json binary
+do
+    ./e9tool "$BINARY" --match true "--action=$ACTION" --format json \
+        --encoding $ENCODING --emit tmp/rpc.$ENCODING.out \
+        -o tmp/rpc.$ENCODING >/dev/null 2>&1
+done
+
+for ENCODING in json binary
+do
+    case $ENCODING in
+        json)
+            STREAM=tmp/rpc.json.json;;
+        binary)
+            STREAM=tmp/rpc.binary.rpc;;
+    esac
+    SIZE=$(stat -c %s $STREAM)
+    BEST=
+    for RUN in $(seq $RUNS)
+    do
+        T0=$(now)
+        ./e9patch -i $STREAM >/dev/null 2>&1
+        T1=$(now)
+        T=$(( (T1 - T0) / 1000000 ))
+        if [ -z "$BEST" ] || [ $T -lt $BEST ]
+        then
+            BEST=$T
+        fi
+    done
+    echo -e "${YELLOW}$ENCODING${OFF}: stream=$SIZE bytes" \
+        "best=${GREEN}${BEST}ms${OFF} ($RUNS runs)"
+done
+
+if cmp -s tmp/rpc.json.out tmp/rpc.binary.out
+then
+    echo -e "${GREEN}output identical${OFF}"
+else
+    echo "output differs!"
+    exit 1
+fi
@@ -0,0 +1,153 @@
+#!/bin/bash
+#
+# Measure e9patch throughput over a matrix of synthetic binaries.
+#
+# usage: bench/synth.sh [RUNS [E9PATCH...]]
+#
+# Synthetic x86_64 binaries (and their passthru patch streams) are generated
+# by e9synth (see `make bench') for each combination of:
+#
+#   SIZES  code size                 (default "256K 1M 4M")
+#   MIXES  instruction-length mix    (default "default short long")
+#   MODES  exe (non-PIC) or pic      (default "exe pic")
+#
+# The streams are cached under tmp/synth/ (set REGEN=1 to regenerate), and
+# replayed through each E9PATCH (default ./e9patch) RUNS times (default 3).
+# The best run is reported as patches/sec, the tactic mix (% of patch
+# locations), the number of virtual/physical mappings, and the peak RSS.
+# Each patched binary is also run, and must exit successfully.  The script
+# exits with a non-zero status if any check fails.  Everything runs offline,
+# and no frontend (e9tool) is needed.
+#
+# Note: E9PATCH must support the `--stats-json' option.
+#
+
+if [ -t 1 ]
+then
+    GREEN="\033[32m"
+    RED="\033[31m"
+    YELLOW="\033[33m"
+    OFF="\033[0m"
+else
+    GREEN=
+    RED=
+    YELLOW=
+    OFF=
+fi
+
+set -e
+
+RUNS=${1:-3}
+shift 1 || shift $#
+E9PATCHES=${@:-./e9patch}
+SIZES=${SIZES:-256K 1M 4M}
+MIXES=${MIXES:-default short long}
+MODES=${MODES:-exe pic}
+
+if [ ! -x ./e9synth ]
+then
+    make synth >/dev/null
+fi
+
+mkdir -p tmp/synth
+
+# Get a number from the --stats-json output.
+getstat()
+{
+    sed -n "s/^ *\"$1\": \([0-9.]*\),\?$/\1/p" tmp/synth/stats.json
+}
+
+# Get the number of locations patched by a tactic from the --stats-json output.
+tactic()
+{
+    PATTERN="\"$1\": {\"attempts\": [0-9]*, \"patched\": \([0-9]*\)}"
+    sed -n "s/^ *$PATTERN.*/\1/p" tmp/synth/stats.json
+}
+
+percent()
+{
+    awk "BEGIN {printf(\"%.1f\", 100.0 * $1 / ($2 == 0? 1: $2))}"
+}
+
+FAILED=0
+printf "%-22s %10s %6s %6s %6s %6s %6s %6s %8s %8s %7s %s\n" CONFIG \
+    PATCHES/s B1% B2% T1% T2% T3% FAIL% VIRTUAL PHYSICAL "RSS(MB)" CHECK
+for E9PATCH in $E9PATCHES
+do
+    echo -e "${YELLOW}$E9PATCH${OFF}:"
+    for SIZE in $SIZES
+    do
+        for MIX in $MIXES
+        do
+            case $MIX in
+                default)
+                    OPTIONS=;;
+                short)
+                    OPTIONS=--short=80;;
+                long)
+                    OPTIONS=--short=20;;
+                *)
+                    OPTIONS=--mix=$MIX;;
+            esac
+            for MODE in $MODES
+            do
+                case $MODE in
+                    exe)
+                        ;;
+                    pic)
+                        OPTIONS="$OPTIONS --pic";;
+                    *)
+                        echo "error: unknown mode \"$MODE\"" >&2
+                        exit 1;;
+                esac
+                CONFIG=$SIZE.$MIX.$MODE
+                NAME=tmp/synth/$(echo "$CONFIG" | tr -c 'A-Za-z0-9.\n' '_')
+                if [ ! -f "$NAME.json" ] || [ -n "$REGEN" ]
+                then
+                    ./e9synth --size=$SIZE $OPTIONS "$NAME"
+                fi
+
+                BEST=
+                for RUN in $(seq $RUNS)
+                do
+                    "$E9PATCH" --stats-json=tmp/synth/stats.json \
+                        -i "$NAME.json" >/dev/null 2>&1
+                    T=$(getstat wall_ms)
+                    if [ -z "$BEST" ] || \
+                        awk "BEGIN {exit !($T < $BEST)}"
+                    then
+                        BEST=$T
+                        cp tmp/synth/stats.json tmp/synth/best.json
+                    fi
+                done
+                mv tmp/synth/best.json tmp/synth/stats.json
+
+                PATCHED=$(getstat num_patched)
+                TOTAL=$(( PATCHED + $(getstat num_failed) ))
+                RATE=$(awk "BEGIN {printf(\"%d\", 1000 * $PATCHED / $BEST)}")
+                RSS=$(( $(getstat peak_rss_bytes) / (1024 * 1024) ))
+                if "./$NAME.out"
+                then
+                    CHECK="${GREEN}ok${OFF}"
+                else
+                    CHECK="${RED}FAILED${OFF}"
+                    FAILED=1
+                fi
+                printf "%-22s %10s %6s %6s %6s %6s %6s %6s %8s %8s %7s " \
+                    "$CONFIG" "$RATE" \
+                    $(percent $(tactic B1) $TOTAL) \
+                    $(percent $(tactic B2) $TOTAL) \
+                    $(percent $(tactic T1) $TOTAL) \
+                    $(percent $(tactic T2) $TOTAL) \
+                    $(percent $(tactic T3) $TOTAL) \
+                    $(percent $(getstat num_failed) $TOTAL) \
+                    $(getstat num_virtual_mappings) \
+                    $(getstat num_physical_mappings) \
+                    "$RSS"
+                echo -e "$CHECK"
+            done
+        done
+    done
+done
+
+exit $FAILED
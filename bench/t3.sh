@@ -0,0 +1,61 @@
+#!/bin/bash
+#
+# Measure e9patch throughput for T3-heavy inputs.
+#
+# usage: bench/t3.sh [BINARY [RUNS [E9PATCH...]]]
+#
+# The e9tool patch stream for BINARY is captured once, and then replayed
+# through each E9PATCH (default ./e9patch) RUNS times with tactics B2/T1/T2
+# disabled, so that every short instruction falls through to T3.  Pass an
+# older e9patch build as an extra E9PATCH to compare against.
+#
+
+if [ -t 1 ]
+then
+    GREEN="\033[32m"
+    YELLOW="\033[33m"
+    OFF="\033[0m"
+else
+    GREEN=
+    YELLOW=
+    OFF=
+fi
+
+set -e
+
+BINARY=${1:-./e9tool}
+RUNS=${2:-5}
+shift 2 || shift $#
+E9PATCHES=${@:-./e9patch}
+
+mkdir -p tmp
+
+now()
+{
+    date +%s%N
+}
+
+./e9tool "$BINARY" --match true --action=passthru --format json \
+    -o tmp/t3 >/dev/null 2>&1
+LC_ALL=C sed -i "s|\"filename\":\"a.out\"|\"filename\":\"tmp/t3.out\"|" \
+    tmp/t3.json
+
+for E9PATCH in $E9PATCHES
+do
+    BEST=
+    for RUN in $(seq $RUNS)
+    do
+        T0=$(now)
+        $E9PATCH --tactic-B2=false --tactic-T1=false --tactic-T2=false \
+            -i tmp/t3.json >tmp/t3.log 2>&1
+        T1=$(now)
+        T=$(( (T1 - T0) / 1000000 ))
+        if [ -z "$BEST" ] || [ $T -lt $BEST ]
+        then
+            BEST=$T
+        fi
+    done
+    T3=$(grep -a num_patched_T3 tmp/t3.log | sed 's/.*= *//')
+    echo -e "${YELLOW}$E9PATCH${OFF}: T3=$T3" \
+        "best=${GREEN}${BEST}ms${OFF} ($RUNS runs)"
+done
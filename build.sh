@@ -70,7 +70,7 @@ fi
 
 echo -e "${GREEN}$0${OFF}: building e9patch and e9tool..."
 make clean
-make -j `nproc` tool release
+make -j `nproc` tool release apply
 
 echo -e "${GREEN}$0${OFF}: done...!"
 
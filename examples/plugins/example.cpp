@@ -50,33 +50,11 @@ using namespace e9frontend;
 #define COUNTERS         0x789a0000        // Arbitrary
 
 /*
- * Initialize the counters and the trampoline.
+ * Send the trampoline template.  If `flags' is false, the trampoline does not
+ * preserve the flags, which is only safe if the flags are dead.
  */
-extern void *e9_plugin_init_v1(FILE *out, const ELF *elf)
+static void sendCFLimitTrampoline(FILE *out, const char *name, bool flags)
 {
-    /* 
-     * This example uses 3 counters (one for calls/jumps/returns).
-     * We allocate and initialize the counters to UINT16_MAX (or the value
-     * of the CFLIMIT environment variable) and place the counters at the
-     * virtual address COUNTERS.  For this, we use a "reserve" E9Patch API
-     * message.
-     */
-    ssize_t limit = UINT16_MAX;
-    const char *limit_str = getenv("LIMIT");
-    if (limit_str != nullptr)
-        limit = (ssize_t)atoll(limit_str);
-    const ssize_t counters[3] = {limit, limit, limit};
-    sendReserveMessage(out,
-        (intptr_t)COUNTERS,             // Memory virtual address
-        (const uint8_t *)counters,      // Memory contents
-        sizeof(counters),               // Memory size
-        (PROT_READ | PROT_WRITE));      // Memory protections
-
-    /*
-     * Mext we need to define the trampoline template using a "trampoline"
-     * E9Patch API message.
-     */
-
     // The trampoline template is specified using a form of annotated
     // machine code.  For more information about the trampoline template
     // language, please see e9patch-programming-guide.md
@@ -85,17 +63,20 @@ extern void *e9_plugin_init_v1(FILE *out, const ELF *elf)
     // 
     // lea -0x4000(%rsp),%rsp
     // push %rax
-    // seto %al
-    // lahf
-    // push %rax
+    // seto %al             (if flags)
+    // lahf                 (if flags)
+    // push %rax            (if flags)
     //
     std::stringstream code;
     code << 0x48 << ',' << 0x8d << ',' << 0xa4 << ',' << 0x24 << ','
          << 0x00 << ',' << 0xc0 << ',' << 0xff << ',' << 0xff << ',';
     code << 0x50 << ',';
-    code << 0x0f << ',' << 0x90 << ',' << 0xc0 << ',';
-    code << 0x9f << ',';
-    code << 0x50 << ',';
+    if (flags)
+    {
+        code << 0x0f << ',' << 0x90 << ',' << 0xc0 << ',';
+        code << 0x9f << ',';
+        code << 0x50 << ',';
+    }
 
     // Increment the counter and branch if <= 0:
     //
@@ -112,18 +93,21 @@ extern void *e9_plugin_init_v1(FILE *out, const ELF *elf)
     // Restore state & return from trampoline:
     //
     // .Lcont:
-    // pop %rax
-    // add $0x7f,%al
-    // sahf
+    // pop %rax             (if flags)
+    // add $0x7f,%al        (if flags)
+    // sahf                 (if flags)
     // pop %rax  
     // lea 0x4000(%rsp),%rsp
     // $instruction
     // $continue
     //
     code << "\".Lcont\",";
-    code << 0x58 << ',';
-    code << 0x04 << ',' << 0x7f << ',';
-    code << 0x9e << ',';
+    if (flags)
+    {
+        code << 0x58 << ',';
+        code << 0x04 << ',' << 0x7f << ',';
+        code << 0x9e << ',';
+    }
     code << 0x58 << ',';
     code << 0x48 << ',' << 0x8d << ',' << 0xa4 << ',' << 0x24 << ','
          << 0x00 << ',' << 0x40 << ',' << 0x00 << ',' << 0x00 << ',';
@@ -139,7 +123,40 @@ extern void *e9_plugin_init_v1(FILE *out, const ELF *elf)
     code << 0xcc << ',';
     code << 0xeb << ",{\"rel8\":\".Lcont\"}";
 
-    sendTrampolineMessage(out, "cflimit", code.str().c_str());
+    sendTrampolineMessage(out, name, code.str().c_str());
+}
+
+/*
+ * Initialize the counters and the trampoline.
+ */
+extern void *e9_plugin_init_v1(FILE *out, const ELF *elf)
+{
+    /* 
+     * This example uses 3 counters (one for calls/jumps/returns).
+     * We allocate and initialize the counters to UINT16_MAX (or the value
+     * of the CFLIMIT environment variable) and place the counters at the
+     * virtual address COUNTERS.  For this, we use a "reserve" E9Patch API
+     * message.
+     */
+    ssize_t limit = UINT16_MAX;
+    const char *limit_str = getenv("LIMIT");
+    if (limit_str != nullptr)
+        limit = (ssize_t)atoll(limit_str);
+    const ssize_t counters[3] = {limit, limit, limit};
+    sendReserveMessage(out,
+        (intptr_t)COUNTERS,             // Memory virtual address
+        (const uint8_t *)counters,      // Memory contents
+        sizeof(counters),               // Memory size
+        (PROT_READ | PROT_WRITE));      // Memory protections
+
+    /*
+     * Mext we need to define the trampoline templates using "trampoline"
+     * E9Patch API messages.  Saving/restoring the flags is slow, so a
+     * second version of the trampoline omits this step for locations where
+     * the flags are dead.
+     */
+    sendCFLimitTrampoline(out, "cflimit", /*flags=*/true);
+    sendCFLimitTrampoline(out, "cflimit_noflags", /*flags=*/false);
 
     return nullptr;
 }
@@ -195,7 +212,10 @@ extern void e9_plugin_patch_v1(FILE *out, const ELF *elf, const Instr *Is,
     metadata[1].name = nullptr;
     metadata[1].data = nullptr;
 
-    // Send a "patch" E9Patch API message.
-    sendPatchMessage(out, "cflimit", Is[idx].offset, metadata);
+    // Send a "patch" E9Patch API message.  The flags need not be preserved
+    // if they are dead:
+    const char *name = (isFlagsLive(elf, Is, size, idx)? "cflimit":
+        "cflimit_noflags");
+    sendPatchMessage(out, name, Is[idx].offset, metadata);
 }
 
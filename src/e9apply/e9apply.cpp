@@ -0,0 +1,339 @@
+/*
+ * e9apply.cpp
+ * Copyright (C) 2021 National University of Singapore
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Apply a "patch.e9d" binary delta (see e9delta.h) to an input binary.
+ */
+
+#include <cerrno>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <algorithm>
+#include <vector>
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "e9delta.h"
+
+#define NO_RETURN               __attribute__((__noreturn__))
+
+static bool option_is_tty = false;
+
+/*
+ * Report an error and exit.
+ */
+static void NO_RETURN error(const char *msg, ...)
+{
+    fprintf(stderr, "%serror%s: ",
+        (option_is_tty? "\33[31m": ""),
+        (option_is_tty? "\33[0m" : ""));
+
+    va_list ap;
+    va_start(ap, msg);
+    vfprintf(stderr, msg, ap);
+    va_end(ap);
+
+    putc('\n', stderr);
+
+    _Exit(EXIT_FAILURE);
+}
+
+/*
+ * Delta reader.
+ */
+struct DeltaReader
+{
+    const char *filename;               // Delta filename
+    FILE *in;                           // Delta stream
+
+    /*
+     * Read exactly len bytes.
+     */
+    void read(void *buf, size_t len)
+    {
+        if (fread(buf, sizeof(uint8_t), len, in) != len)
+            error("failed to read delta from file \"%s\": %s", filename,
+                (ferror(in)? strerror(errno): "unexpected end-of-file"));
+    }
+    uint64_t read64()
+    {
+        uint64_t x;
+        read(&x, sizeof(x));
+        return x;
+    }
+};
+
+/*
+ * Write buf[0..len) to the output file at the given offset.
+ */
+static void writeOutput(const char *filename, int fd, const uint8_t *buf,
+    size_t len, off_t offset)
+{
+    while (len > 0)
+    {
+        ssize_t r = pwrite(fd, buf, len, offset);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0)
+            error("failed to write output to file \"%s\": %s", filename,
+                strerror(errno));
+        buf    += r;
+        len    -= (size_t)r;
+        offset += r;
+    }
+}
+
+/*
+ * Copy input[offset..offset+len) to output[pos..pos+len).
+ */
+static void copyInput(const char *input, int fd_in, const char *output,
+    int fd_out, off_t offset, off_t pos, size_t len, bool &use_copy,
+    std::vector<uint8_t> &buf)
+{
+    while (use_copy && len > 0)
+    {
+        loff_t off_in = offset, off_out = pos;
+        ssize_t r = copy_file_range(fd_in, &off_in, fd_out, &off_out, len, 0);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+        {
+            use_copy = false;           // Not supported, so fallback.
+            break;
+        }
+        offset += r;
+        pos    += r;
+        len    -= (size_t)r;
+    }
+    while (len > 0)
+    {
+        size_t n = std::min(len, buf.size());
+        ssize_t r = pread(fd_in, buf.data(), n, offset);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            error("failed to read input from file \"%s\": %s", input,
+                (r < 0? strerror(errno): "unexpected end-of-file"));
+        writeOutput(output, fd_out, buf.data(), (size_t)r, pos);
+        offset += r;
+        pos    += r;
+        len    -= (size_t)r;
+    }
+}
+
+/*
+ * Usage.
+ */
+static void usage(FILE *stream, const char *progname)
+{
+    fprintf(stream, "usage: %s [OPTIONS] DELTA INPUT OUTPUT\n\n"
+        "Apply the \"patch.e9d\" binary delta DELTA (as generated by\n"
+        "e9patch/e9tool) to the binary INPUT, and write the patched binary\n"
+        "to OUTPUT.  If DELTA is \"-\" then the delta is read from stdin.\n"
+        "\n"
+        "OPTIONS:\n"
+        "\n"
+        "\t--help, -h\n"
+        "\t\tPrint this message and exit.\n"
+        "\n", progname);
+}
+
+/*
+ * Options.
+ */
+enum Option
+{
+    OPTION_HELP,
+};
+
+/*
+ * Entry.
+ */
+int main(int argc, char **argv)
+{
+    option_is_tty = (isatty(STDERR_FILENO) != 0);
+
+    const int no_arg = no_argument;
+    static const struct option long_options[] =
+    {
+        {"help", no_arg, nullptr, OPTION_HELP},
+        {nullptr, 0, nullptr, 0}
+    };
+    while (true)
+    {
+        int idx;
+        int opt = getopt_long_only(argc, argv, "h", long_options, &idx);
+        if (opt < 0)
+            break;
+        switch (opt)
+        {
+            case OPTION_HELP: case 'h':
+                usage(stdout, argv[0]);
+                exit(EXIT_SUCCESS);
+            default:
+                error("failed to parse command-line options; try `--help' "
+                    "for more information");
+        }
+    }
+    if (argc - optind != 3)
+        error("expected 3 arguments (DELTA INPUT OUTPUT), got %d; try "
+            "`--help' for more information", argc - optind);
+    const char *delta  = argv[optind];
+    const char *input  = argv[optind+1];
+    const char *output = argv[optind+2];
+
+    // Step (1): Open the files & check the header:
+    DeltaReader R = {delta, stdin};
+    if (strcmp(delta, "-") != 0)
+    {
+        R.in = fopen(delta, "r");
+        if (R.in == nullptr)
+            error("failed to open delta file \"%s\" for reading: %s", delta,
+                strerror(errno));
+    }
+    E9DHeader hdr;
+    R.read(&hdr, sizeof(hdr));
+    if (memcmp(hdr.magic, E9D_MAGIC, sizeof(E9D_MAGIC)) != 0)
+        error("failed to parse delta file \"%s\"; invalid magic number",
+            delta);
+    if (hdr.version != E9D_VERSION)
+        error("failed to parse delta file \"%s\"; unsupported version %u "
+            "(expected %u)", delta, hdr.version, E9D_VERSION);
+    int fd_in = open(input, O_RDONLY);
+    if (fd_in < 0)
+        error("failed to open input file \"%s\" for reading: %s", input,
+            strerror(errno));
+    struct stat buf;
+    if (fstat(fd_in, &buf) < 0)
+        error("failed to get length of file \"%s\": %s", input,
+            strerror(errno));
+    if ((uint64_t)buf.st_size != hdr.input_size)
+        error("failed to apply delta file \"%s\"; input file \"%s\" has "
+            "size %zu (expected %zu)", delta, input, (size_t)buf.st_size,
+            (size_t)hdr.input_size);
+    int fd_out = open(output, O_WRONLY | O_CREAT | O_TRUNC,
+        S_IRUSR | S_IWUSR | S_IXUSR |
+        S_IRGRP | S_IWGRP | S_IXGRP |
+        S_IROTH | S_IWOTH | S_IXOTH);
+    if (fd_out < 0)
+        error("failed to open output file \"%s\" for writing: %s", output,
+            strerror(errno));
+    if (ftruncate(fd_out, (off_t)hdr.output_size) < 0)
+        error("failed to set length of output file \"%s\" to %zu bytes: %s",
+            output, (size_t)hdr.output_size, strerror(errno));
+
+    // Step (2): Apply the operations:
+    std::vector<uint8_t> block(E9D_BLOCK), zblock;
+    const E9DZlib *zlib = nullptr;
+    bool use_copy = true;
+    uint64_t pos = 0;
+    while (true)
+    {
+        uint8_t op;
+        R.read(&op, sizeof(op));
+        if (op == E9D_END)
+            break;
+        uint64_t offset = 0, len = 0, zlen = 0;
+        switch (op)
+        {
+            case E9D_COPY:
+                offset = R.read64();
+                len    = R.read64();
+                if (offset > hdr.input_size || len > hdr.input_size - offset)
+                    error("failed to apply delta file \"%s\"; copy range "
+                        "exceeds the input size (%zu)", delta,
+                        (size_t)hdr.input_size);
+                break;
+            case E9D_INSERT: case E9D_ZERO:
+                len = R.read64();
+                break;
+            case E9D_INSERT_Z:
+                len  = R.read64();
+                zlen = R.read64();
+                break;
+            default:
+                error("failed to apply delta file \"%s\"; invalid operation "
+                    "(%u)", delta, (unsigned)op);
+        }
+        if (len > hdr.output_size - pos)
+            error("failed to apply delta file \"%s\"; operation exceeds the "
+                "output size (%zu)", delta, (size_t)hdr.output_size);
+        if ((op == E9D_INSERT || op == E9D_INSERT_Z) && len > E9D_BLOCK)
+            error("failed to apply delta file \"%s\"; block size (%zu) "
+                "exceeds the maximum (%zu)", delta, (size_t)len, E9D_BLOCK);
+        switch (op)
+        {
+            case E9D_COPY:
+                copyInput(input, fd_in, output, fd_out, (off_t)offset,
+                    (off_t)pos, len, use_copy, block);
+                break;
+            case E9D_INSERT:
+                R.read(block.data(), len);
+                writeOutput(output, fd_out, block.data(), len, (off_t)pos);
+                break;
+            case E9D_INSERT_Z:
+            {
+                if (zlib == nullptr && (zlib = e9dLoadZlib()) == nullptr)
+                    error("failed to apply delta file \"%s\"; the delta is "
+                        "compressed but zlib (libz.so.1) is not available",
+                        delta);
+                if (zlen > zlib->compressBound(E9D_BLOCK))
+                    error("failed to apply delta file \"%s\"; compressed "
+                        "block size (%zu) is too large", delta, (size_t)zlen);
+                zblock.resize(zlen);
+                R.read(zblock.data(), zlen);
+                unsigned long n = len;
+                if (zlib->uncompress(block.data(), &n, zblock.data(),
+                        zlen) != /*Z_OK=*/0 || n != len)
+                    error("failed to apply delta file \"%s\"; failed to "
+                        "decompress block", delta);
+                writeOutput(output, fd_out, block.data(), len, (off_t)pos);
+                break;
+            }
+            case E9D_ZERO:
+                break;                  // The output is already zero-filled
+        }
+        pos += len;
+    }
+    if (pos != hdr.output_size)
+        error("failed to apply delta file \"%s\"; output size (%zu) does "
+            "not match the expected size (%zu)", delta, (size_t)pos,
+            (size_t)hdr.output_size);
+
+    // Step (3): Clean up:
+    if (R.in != stdin)
+        fclose(R.in);
+    close(fd_in);
+    // Note: failure is ignored, since the output might be /dev/null.
+    (void)fchmod(fd_out, S_IRUSR | S_IWUSR | S_IXUSR |
+                         S_IRGRP | S_IWGRP | S_IXGRP |
+                         S_IROTH | S_IWOTH | S_IXOTH);
+    if (close(fd_out) < 0)
+        error("failed to close output file \"%s\": %s", output,
+            strerror(errno));
+
+    return 0;
+}
@@ -96,28 +96,61 @@ RB_GENERATE_STATIC(Tree, Node, entry, compare);
 #define flag_set(flags, flag, val)  \
     ((val)? (flags) | (flag): (flags) & ~(flag))
 
-static Node *insert(Node *root, intptr_t lb, intptr_t ub, size_t size,
-    uint32_t flags);
+#define SLAB_NODES                  4096
+#define HOT_PAGES_MAX               8
+
+static Node *insert(Allocator &allocator, Node *root, intptr_t lb,
+    intptr_t ub, size_t size, uint32_t flags);
 
 /*
- * Allocate a node.
+ * Allocate a node.  Nodes are carved from slabs owned by the allocator, and
+ * freed nodes are recycled via an intrusive free-list (threaded through the
+ * RB-tree left pointer).
  */
-static Node *alloc()
+static Node *alloc(Allocator &allocator)
 {
-    Node *n = (Node *)malloc(sizeof(Node));
-    if (n == nullptr)
-        error("failed to allocate %zu bytes for interval tree node: %s",
-            sizeof(Node), strerror(ENOMEM));
+    Node *n = allocator.free;
+    if (n != nullptr)
+        allocator.free = n->entry.left;
+    else
+    {
+        if (allocator.slabs.size() == 0 || allocator.slab_used >= SLAB_NODES)
+        {
+            size_t size = SLAB_NODES * sizeof(Node);
+            void *slab = malloc(size);
+            if (slab == nullptr)
+                error("failed to allocate %zu bytes for interval tree nodes: "
+                    "%s", size, strerror(ENOMEM));
+            allocator.slabs.push_back(slab);
+            allocator.slab_used = 0;
+            stat_alloc_peak_bytes += size;
+        }
+        n = (Node *)allocator.slabs.back() + allocator.slab_used;
+        allocator.slab_used++;
+    }
+    stat_num_alloc_nodes++;
+    stat_num_alloc_nodes_peak =
+        std::max(stat_num_alloc_nodes_peak, stat_num_alloc_nodes);
     n->alloc.T = nullptr;
     n->alloc.I = nullptr;
     return n;
 }
 
+/*
+ * Free a node.
+ */
+static void free(Allocator &allocator, Node *n)
+{
+    n->entry.left  = allocator.free;
+    allocator.free = n;
+    stat_num_alloc_nodes--;
+}
+
 /*
  * Allocate and initialize a new interval tree node.
  */
-static Node *node(Node *parent, intptr_t lb, intptr_t ub, size_t size,
-    uint32_t flags)
+static Node *node(Allocator &allocator, Node *parent, intptr_t lb,
+    intptr_t ub, size_t size, uint32_t flags)
 {
     bool alloc_left = ((flags & FLAG_RIGHT) != 0? false:
         ((flags & FLAG_LB) != 0 || (flags & FLAG_UB) == 0));
@@ -150,7 +183,7 @@ static Node *node(Node *parent, intptr_t lb, intptr_t ub, size_t size,
         }
     }
 
-    Node *n = alloc();
+    Node *n = alloc(allocator);
     n->alloc.lb     = LB;
     n->alloc.ub     = UB;
     n->lb           = LB;
@@ -166,8 +199,8 @@ static Node *node(Node *parent, intptr_t lb, intptr_t ub, size_t size,
 /*
  * Insert left-child helper.
  */
-static Node *insertLeftChild(Node *root, intptr_t lb, intptr_t ub, size_t size,
-    uint32_t flags)
+static Node *insertLeftChild(Allocator &allocator, Node *root, intptr_t lb,
+    intptr_t ub, size_t size, uint32_t flags)
 {
     ub = std::min(ub, root->alloc.lb);
     if ((intptr_t)size > ub - lb)
@@ -176,17 +209,17 @@ static Node *insertLeftChild(Node *root, intptr_t lb, intptr_t ub, size_t size,
         (root->alloc.lb - ub < (ssize_t)PAGE_SIZE));
     Node *n;
     if (root->entry.left == nullptr)
-        n = root->entry.left = node(root, lb, ub, size, flags);
+        n = root->entry.left = node(allocator, root, lb, ub, size, flags);
     else
-        n = insert(root->entry.left, lb, ub, size, flags);
+        n = insert(allocator, root->entry.left, lb, ub, size, flags);
     return n;
 }
 
 /*
  * Insert right-child helper.
  */
-static Node *insertRightChild(Node *root, intptr_t lb, intptr_t ub,
-    size_t size, uint32_t flags)
+static Node *insertRightChild(Allocator &allocator, Node *root, intptr_t lb,
+    intptr_t ub, size_t size, uint32_t flags)
 {
     lb = std::max(lb, root->alloc.ub);
     if ((intptr_t)size > ub - lb)
@@ -195,22 +228,22 @@ static Node *insertRightChild(Node *root, intptr_t lb, intptr_t ub,
         (lb - root->alloc.ub < (ssize_t)PAGE_SIZE));
     Node *n;
     if (root->entry.right == nullptr)
-        n = root->entry.right = node(root, lb, ub, size, flags);
+        n = root->entry.right = node(allocator, root, lb, ub, size, flags);
     else
-        n = insert(root->entry.right, lb, ub, size, flags);
+        n = insert(allocator, root->entry.right, lb, ub, size, flags);
     return n;
 }
 
 /*
  * Insert a new allocation or reservation into the interval tree node `root`.
  */
-static Node *insert(Node *root, intptr_t lb, intptr_t ub, size_t size,
-    uint32_t flags)
+static Node *insert(Allocator &allocator, Node *root, intptr_t lb,
+    intptr_t ub, size_t size, uint32_t flags)
 {
     if ((intptr_t)size > ub - lb)
         return nullptr;
     if (root == nullptr)
-        return node(nullptr, lb, ub, size, flags);
+        return node(allocator, nullptr, lb, ub, size, flags);
 
     Node *n = nullptr;
     if (size <= root->gap)
@@ -218,14 +251,16 @@ static Node *insert(Node *root, intptr_t lb, intptr_t ub, size_t size,
         intptr_t rlb = std::max(lb, root->lb);
         intptr_t rub = std::min(ub, root->ub);
         if (n == nullptr)
-            n = insertRightChild(root, rlb, rub, size, flags);
+            n = insertRightChild(allocator, root, rlb, rub, size, flags);
         if (n == nullptr)
-            n = insertLeftChild(root, rlb, rub, size, flags);
+            n = insertLeftChild(allocator, root, rlb, rub, size, flags);
     }
     if (n == nullptr && ub > root->ub)
-        n = insertRightChild(root, std::max(lb, root->ub), ub, size, flags);
+        n = insertRightChild(allocator, root, std::max(lb, root->ub), ub,
+            size, flags);
     if (n == nullptr && lb < root->lb)
-        n = insertLeftChild(root, lb, std::min(ub, root->lb), size, flags);
+        n = insertLeftChild(allocator, root, lb, std::min(ub, root->lb),
+            size, flags);
 
     if (n != nullptr)
         fix(root);
@@ -264,10 +299,48 @@ const Alloc *allocate(Allocator &allocator, intptr_t lb, intptr_t ub,
     uint32_t flags = (same_page? FLAG_SAME_PAGE: 0);
     Node *n = nullptr;
     const intptr_t target = 0x70000000;
-    if (option_Oorder_trampolines && ub > target)
-        n = insert(allocator.tree.root, lb, target, size, flags | FLAG_RIGHT);
+    bool hot = false;
+    if (!option_hot.empty() && I != nullptr)
+    {
+        // Profile-guided placement: trampolines for hot instructions are
+        // packed downwards from `hot_target', or else into a page that
+        // already contains hot trampolines (for punned jumps that cannot
+        // reach the hot region).  All other trampolines are kept above
+        // `hot_target' (if possible).
+        const intptr_t hot_target = 0x60000000;
+        hot = (option_hot.find(I->addr) != option_hot.end());
+        if (hot)
+        {
+            n = insert(allocator, allocator.tree.root, lb,
+                std::min(ub, hot_target), size, flags | FLAG_RIGHT);
+            auto i = allocator.hot.lower_bound(lb / (intptr_t)PAGE_SIZE);
+            for (unsigned j = 0; n == nullptr && i != allocator.hot.end() &&
+                    *i <= (ub - 1) / (intptr_t)PAGE_SIZE &&
+                    j < HOT_PAGES_MAX; ++i, j++)
+            {
+                intptr_t page_lb = *i * (intptr_t)PAGE_SIZE;
+                intptr_t page_ub = page_lb + (intptr_t)PAGE_SIZE;
+                n = insert(allocator, allocator.tree.root,
+                    std::max(lb, page_lb), std::min(ub, page_ub), size,
+                    flags);
+            }
+        }
+        else if (ub > hot_target)
+        {
+            intptr_t cold_lb = std::max(lb, hot_target);
+            if (option_Oorder_trampolines && ub > target)
+                n = insert(allocator, allocator.tree.root, cold_lb, target,
+                    size, flags | FLAG_RIGHT);
+            if (n == nullptr)
+                n = insert(allocator, allocator.tree.root, cold_lb, ub,
+                    size, flags);
+        }
+    }
+    if (n == nullptr && option_Oorder_trampolines && ub > target)
+        n = insert(allocator, allocator.tree.root, lb, target, size,
+            flags | FLAG_RIGHT);
     if (n == nullptr)
-        n = insert(allocator.tree.root, lb, ub, size, flags);
+        n = insert(allocator, allocator.tree.root, lb, ub, size, flags);
     if (n == nullptr)
         return nullptr;
     if (allocator.tree.root == nullptr)
@@ -277,9 +350,31 @@ const Alloc *allocate(Allocator &allocator, intptr_t lb, intptr_t ub,
     Alloc *A = &n->alloc;
     A->T = T;
     A->I = I;
+    if (hot)
+    {
+        for (intptr_t page = A->lb / (intptr_t)PAGE_SIZE;
+                page <= (A->ub - 1) / (intptr_t)PAGE_SIZE; page++)
+            allocator.hot.insert(page);
+    }
     return A;
 }
 
+/*
+ * Insert an allocation spanning exactly [lb..ub).  Returns the allocation,
+ * or nullptr if the range overlaps an existing allocation.
+ */
+static Alloc *place(Allocator &allocator, intptr_t lb, intptr_t ub)
+{
+    Node *n = insert(allocator, allocator.tree.root, lb, ub, (ub - lb),
+        /*flags=*/0);
+    if (n == nullptr)
+        return nullptr;
+    if (allocator.tree.root == nullptr)
+        allocator.tree.root = n;
+    rebalanceInsert(&allocator.tree, n);
+    return &n->alloc;
+}
+
 /*
  * Reserves a chunk of the virtual address space spanning the range [lb..ub].
  * Returns `true` on success, `false` on failure.
@@ -292,18 +387,55 @@ bool reserve(Allocator &allocator, intptr_t lb, intptr_t ub)
     ub += (ub % PAGE_SIZE == 0? 0: PAGE_SIZE - ub % PAGE_SIZE);
     if (ub - lb <= 0)
         return false;
-    uint32_t flags = 0;
-    Node *n = insert(allocator.tree.root, lb, ub, (ub - lb), flags);
-    if (n == nullptr)
-        return false;
-    if (allocator.tree.root == nullptr)
-        allocator.tree.root = n;
-    rebalanceInsert(&allocator.tree, n);
+    return (place(allocator, lb, ub) != nullptr);
+}
 
-    Alloc *A = &n->alloc;
-    A->T = nullptr;
-    A->I = nullptr;
-    return true;
+/*
+ * Initialize `shard` as a shard of `allocator` that can only allocate within
+ * the range [lb..ub).  Existing allocations within the range are copied as
+ * reservations.
+ */
+void shardAllocator(const Allocator &allocator, Allocator &shard,
+    intptr_t lb, intptr_t ub)
+{
+    bool ok = true;
+    if (lb > RELATIVE_ADDRESS_MIN)
+        ok = ok && (place(shard, RELATIVE_ADDRESS_MIN, lb) != nullptr);
+    if (ub < RELATIVE_ADDRESS_MAX)
+        ok = ok && (place(shard, ub, RELATIVE_ADDRESS_MAX) != nullptr);
+    ok = ok &&
+        (place(shard, ABSOLUTE_ADDRESS_MIN, ABSOLUTE_ADDRESS_MAX) != nullptr);
+    for (auto i = allocator.begin(), iend = allocator.end(); ok && i != iend;
+            ++i)
+    {
+        const Alloc *A = *i;
+        intptr_t LB = std::max(A->lb, lb), UB = std::min(A->ub, ub);
+        if (LB < UB)
+            ok = (place(shard, LB, UB) != nullptr);
+    }
+    if (!ok)
+        error("failed to create allocator shard for range "
+            ADDRESS_FORMAT ".." ADDRESS_FORMAT, ADDRESS(lb), ADDRESS(ub));
+}
+
+/*
+ * Merge all allocations made by `shard` back into `allocator`.
+ */
+void mergeAllocator(Allocator &allocator, const Allocator &shard)
+{
+    for (auto i = shard.begin(), iend = shard.end(); i != iend; ++i)
+    {
+        const Alloc *A = *i;
+        if (A->T == nullptr)
+            continue;       // Reservation
+        Alloc *B = place(allocator, A->lb, A->ub);
+        if (B == nullptr)
+            error("failed to merge allocation " ADDRESS_FORMAT ".."
+                ADDRESS_FORMAT " from allocator shard", ADDRESS(A->lb),
+                ADDRESS(A->ub));
+        B->T = A->T;
+        B->I = A->I;
+    }
 }
 
 /*
@@ -316,7 +448,16 @@ void deallocate(Allocator &allocator, const Alloc *a)
     Node *n = (Node *)(a);
     assert(n->alloc.T != nullptr);
     rebalanceRemove(&allocator.tree, n);
-    free(n);
+    free(allocator, n);
+}
+
+/*
+ * Release all nodes (bulk teardown).
+ */
+Allocator::~Allocator()
+{
+    for (void *slab: slabs)
+        ::free(slab);
 }
 
 /*
@@ -27,6 +27,9 @@ const Alloc *allocate(Allocator &allocator, intptr_t lb, intptr_t ub,
     const Trampoline *T, const Instr *I, bool same_page = false);
 bool reserve(Allocator &allocator, intptr_t lb, intptr_t ub);
 void deallocate(Allocator &allocator, const Alloc *a);
+void shardAllocator(const Allocator &allocator, Allocator &shard,
+    intptr_t lb, intptr_t ub);
+void mergeAllocator(Allocator &allocator, const Allocator &shard);
 
 #define RELATIVE_ADDRESS_MAX        0x1FFFFFFFFFFFF000ll
 #define RELATIVE_ADDRESS_MIN        (-0x1FFFFFFFFFFFF000ll)
@@ -19,6 +19,8 @@
 #include <cstdlib>
 #include <cstring>
 
+#include <algorithm>
+#include <new>
 #include <string>
 
 #include <fcntl.h>
@@ -31,26 +33,131 @@
 #include "e9emit.h"
 #include "e9patch.h"
 #include "e9json.h"
+#include "e9parallel.h"
 #include "e9tactics.h"
+#include "e9trampoline.h"
 #include "e9x86_64.h"
 
+#define INSTR_CHUNK_SIZE            4096
+#define INSTR_INDEX_SIZE            1024
+
+/*
+ * Allocate (uninitialized) storage for an instruction.
+ */
+void *InstrSet::alloc()
+{
+    if (chunks.size() == 0 || chunk_used >= INSTR_CHUNK_SIZE)
+    {
+        size_t size = INSTR_CHUNK_SIZE * sizeof(Instr);
+        void *chunk = malloc(size);
+        if (chunk == nullptr)
+            error("failed to allocate %zu bytes for instructions: %s", size,
+                strerror(ENOMEM));
+        chunks.push_back(chunk);
+        chunk_used = 0;
+    }
+    Instr *I = (Instr *)chunks.back() + chunk_used;
+    chunk_used++;
+    return (void *)I;
+}
+
+/*
+ * Compare an instruction against an offset.
+ */
+static bool compareInstr(const Instr *I, size_t offset)
+{
+    return (I->offset < offset);
+}
+
+/*
+ * Insert an instruction into the index.  Returns the index position, or -1
+ * if another instruction exists at the same offset.
+ */
+ssize_t InstrSet::insert(Instr *I)
+{
+    Instr **i = std::lower_bound(index + lo, index + hi, (size_t)I->offset,
+        compareInstr);
+    if (i < index + hi && (*i)->offset == I->offset)
+        return -1;
+    size_t n = hi - lo, pos = i - (index + lo);
+
+    // Shift whichever side is smaller, growing the index if necessary:
+    bool front = (pos < n - pos);
+    if (front? lo == 0: hi == cap)
+    {
+        size_t new_cap = std::max((size_t)INSTR_INDEX_SIZE, 2 * n);
+        Instr **new_index = (Instr **)malloc(new_cap * sizeof(Instr *));
+        if (new_index == nullptr)
+            error("failed to allocate %zu bytes for instruction index: %s",
+                new_cap * sizeof(Instr *), strerror(ENOMEM));
+        size_t new_lo = (new_cap - n) / 2;
+        if (n > 0)
+            memcpy(new_index + new_lo, index + lo, n * sizeof(Instr *));
+        free(index);
+        index = new_index;
+        lo    = new_lo;
+        hi    = new_lo + n;
+        cap   = new_cap;
+    }
+    if (front)
+    {
+        memmove(index + lo - 1, index + lo, pos * sizeof(Instr *));
+        lo--;
+    }
+    else
+    {
+        memmove(index + lo + pos + 1, index + lo + pos,
+            (n - pos) * sizeof(Instr *));
+        hi++;
+    }
+    index[lo + pos] = I;
+    return (ssize_t)pos;
+}
+
+/*
+ * Find the first instruction with an offset >= `offset`, else nullptr.
+ */
+Instr *InstrSet::lower_bound(off_t offset) const
+{
+    Instr **i = std::lower_bound(index + lo, index + hi, (size_t)offset,
+        compareInstr);
+    return (i == index + hi? nullptr: *i);
+}
+
+/*
+ * Find the instruction at `offset`, else nullptr.
+ */
+Instr *InstrSet::find(off_t offset) const
+{
+    Instr *I = lower_bound(offset);
+    return (I != nullptr && I->offset == (size_t)offset? I: nullptr);
+}
+
+/*
+ * Free all instructions.
+ */
+InstrSet::~InstrSet()
+{
+    free(index);
+    for (void *chunk: chunks)
+        free(chunk);
+}
+
 /*
  * Insert an instruction into a binary.
  */
 void insertInstruction(Binary *B, Instr *I)
 {
     // Insert the instruction into the index:
-    auto result = B->Is.insert(std::make_pair((off_t)I->offset, I));
-    if (!result.second)
+    ssize_t i = B->Is.insert(I);
+    if (i < 0)
         error("failed to insert instruction at offset (+%zu), another "
             "instruction already exists at that offset", I->offset);
-    InstrSet::iterator i = result.first;
 
     // Find and validate successor and predecessor instructions:
-    ++i;
-    if (i != B->Is.end())
+    if ((size_t)i + 1 < B->Is.size())
     {
-        Instr *J = i->second;
+        Instr *J = B->Is[i + 1];
         if (I->offset + I->size > J->offset)
             error("failed to insert instruction at offset (+%zu), instruction "
                 "overlaps with another instruction at offset (+%zu)",
@@ -63,11 +170,9 @@ void insertInstruction(Binary *B, Instr *I)
         J->prev = I;
     }
 
-    i = result.first;
-    if (i != B->Is.begin())
+    if (i > 0)
     {
-        --i;
-        Instr *J = i->second;
+        Instr *J = B->Is[i - 1];
         if (J->offset + J->size > I->offset)
             error("failed to insert instruction at offset (+%zu), instruction "
                 "overlaps with another instruction at offset (+%zu)",
@@ -115,13 +220,29 @@ static void queueFlush(Binary *B, intptr_t cursor)
             "messages were not send in reverse order", cursor);
     B->cursor = cursor;
 
+    // In parallel mode, patching is deferred until the final flush, and the
+    // queue is patched in batches (between options entries):
+    bool parallel = (option_threads > 1);
+    if (parallel && cursor != INTPTR_MIN)
+        return;
+    PhaseTimer timer(PHASE_PATCH, /*cpu=*/(cursor == INTPTR_MIN));
+    std::vector<PatchEntry> batch;
+
     cursor += /*max short jmp=*/ INT8_MAX + 2 + /*max instruction size=*/15 +
         /*a bit extra=*/32;
     while (!B->Q.empty() &&
             (B->Q.back().options || B->Q.back().I->addr > cursor))
     {
         const auto &entry = B->Q.back();
-        if (!entry.options)
+        if (!entry.options && parallel)
+        {
+            // Patch entry (deferred)
+            Instr *I = entry.I;
+            I->debug = (option_trap_all ||
+                option_trap.find(I->addr) != option_trap.end());
+            batch.push_back(entry);
+        }
+        else if (!entry.options)
         {
             // Patch entry
             Instr *I            = entry.I;
@@ -133,23 +254,29 @@ static void queueFlush(Binary *B, intptr_t cursor)
             }
             I->debug = (option_trap_all ||
                 option_trap.find(I->addr) != option_trap.end());
-            if (patch(*B, I, T))
+            if (patch(B->allocator, I, T))
                 stat_num_patched++;
             else
                 stat_num_failed++;
+            progress("patching", stat_num_patched + stat_num_failed, 0);
         }
         else
         {
             // Options entry
+            patchParallel(B, batch);
+            batch.clear();
             char * const *argv = entry.argv;
             int argc;
             for (argc = 0; argv[argc] != nullptr; argc++)
                 ;
             parseOptions(argc, argv, /*api=*/true);
+            flushTrampolineLayouts();
+            parallel = (option_threads > 1);
             delete[] argv;
         }
         B->Q.pop_back();
     }
+    patchParallel(B, batch);
 }
 
 /*
@@ -261,6 +388,8 @@ mmap_failed:
             filename, strerror(errno));
     B->patched.state = (uint8_t *)ptr;
     memset(B->patched.state + size, STATE_OVERFLOW, ext_size - size);
+    B->dirty.init(size);
+    setDirtyMap(&B->dirty);
 
     return B;
 }
@@ -332,9 +461,10 @@ static void parseInstruction(Binary *B, const Message &msg)
         else
             pcrel32_idx = pcrel_idx;    // Must be pcrel32
     }
-    Instr *I = new Instr(offset, address, length, B->original.bytes + offset,
-        B->patched.bytes + offset, B->patched.state + offset, pcrel32_idx,
-        pcrel8_idx, B->elf.pic, /*debug=*/false);
+    Instr *I = new (B->Is.alloc()) Instr(offset, address, length,
+        B->original.bytes + offset, B->patched.bytes + offset,
+        B->patched.state + offset, pcrel32_idx, pcrel8_idx, B->elf.pic,
+        /*debug=*/false);
     insertInstruction(B, I);
 }
 
@@ -378,11 +508,10 @@ static void parsePatch(Binary *B, const Message &msg)
         error("failed to parse \"patch\" message (id=%u); duplicate "
             "parameters detected", msg.id);
 
-    auto i = B->Is.find(offset);
-    if (i == B->Is.end())
+    Instr *I = B->Is.find(offset);
+    if (I == nullptr)
         error("failed to parse \"patch\" message (id=%u); no matching "
             "instruction at offset (%zd)", msg.id, offset);
-    Instr *I = i->second;
     I->metadata = meta;
 
     auto j = B->Ts.find(trampoline);
@@ -428,33 +557,62 @@ static void parseEmit(Binary *B, const Message &msg)
 
     // Flush the queue:
     queueFlush(B, INTPTR_MIN);
-    putchar('\n');
+    progressDone();
+    if (option_trace_progress)
+        putchar('\n');
 
     // Create and optimize the mappings:
     MappingSet mappings;
-    buildMappings(B->allocator, option_mem_mapping_size, mappings);
-    switch (option_mem_granularity)
     {
-        case 64:
-            optimizeMappings<Key64>(B->allocator, option_mem_mapping_size,
-                mappings);
-            break;
-        case 128:
-            optimizeMappings<Key128>(B->allocator, option_mem_mapping_size,
-                mappings);
-            break;
-        case 4096:
-            optimizeMappings<Key4096>(B->allocator, option_mem_mapping_size,
-                mappings);
-            break;
-        default:
-            error("unimplemented granularity (%zu)", option_mem_granularity);
+        PhaseTimer timer(PHASE_BUILD_MAPPINGS);
+        buildMappings(B->allocator, option_mem_mapping_size, mappings);
+    }
+    {
+        PhaseTimer timer(PHASE_OPTIMIZE_MAPPINGS);
+        switch (option_mem_granularity)
+        {
+            case 64:
+                optimizeMappings<Key64>(B->allocator,
+                    option_mem_mapping_size, mappings);
+                break;
+            case 128:
+                optimizeMappings<Key128>(B->allocator,
+                    option_mem_mapping_size, mappings);
+                break;
+            case 4096:
+                optimizeMappings<Key4096>(B->allocator,
+                    option_mem_mapping_size, mappings);
+                break;
+            default:
+                error("unimplemented granularity (%zu)",
+                    option_mem_granularity);
+        }
+
+        std::sort(mappings.begin(), mappings.end(),
+            [](const Mapping *a, const Mapping *b)
+            {
+                return (a->base < b->base);
+            });
     }
 
     // Create the patched binary:
-    B->patched.size = emitElf(B, mappings, option_mem_mapping_size);
+    {
+        PhaseTimer timer(PHASE_LOADER);
+        B->patched.size = emitElf(B, mappings, option_mem_mapping_size);
+    }
+    {
+        PhaseTimer timer(PHASE_WRITE);
+        if (format == FORMAT_BINARY && option_emit_mmap &&
+                emitMappedBinary(filename, B, mappings, B->patched.size))
+            return;
+    }
+    {
+        PhaseTimer timer(PHASE_FLATTEN);
+        flattenMappings(mappings, B->patched.bytes, /*base=*/0);
+    }
 
     // Emit the result:
+    PhaseTimer timer_write(PHASE_WRITE);
     switch (format)
     {
         case FORMAT_BINARY:
@@ -476,6 +634,9 @@ static void parseEmit(Binary *B, const Message &msg)
             emitPatch(filename, "xz", B->original.fd, B->patched.bytes,
                 B->patched.size);
             break;
+        case FORMAT_PATCH_E9D:
+            emitDelta(filename, B, B->patched.size);
+            break;
         default:
             error("failed to parse \"emit\" message (id=%u); invalid "
                 "\"format\" code %u", msg.id, (unsigned)format);
@@ -0,0 +1,111 @@
+/*
+ * e9delta.h
+ * Copyright (C) 2021 National University of Singapore
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __E9DELTA_H
+#define __E9DELTA_H
+
+/*
+ * The "patch.e9d" binary delta format.
+ *
+ * A delta is a header followed by a sequence of block operations that
+ * construct the output (patched) binary from start to finish.  Each
+ * operation appends to the output:
+ *
+ *      E9D_COPY     offset len     (len bytes of the input at offset)
+ *      E9D_INSERT   len data       (len literal bytes)
+ *      E9D_INSERT_Z len zlen zdata (len bytes, zlib compressed to zlen)
+ *      E9D_ZERO     len            (len zero bytes)
+ *      E9D_END
+ *
+ * All integers are 64-bit little endian.  Literal blocks are at most
+ * E9D_BLOCK bytes, so that both sides only need bounded buffers.
+ *
+ * Compression uses zlib, which is loaded at runtime (if available), so
+ * neither e9patch nor e9apply has a build-time dependency on zlib.
+ *
+ * This header is shared by e9patch and e9apply, and is self-contained.
+ */
+
+#include <cstdint>
+
+#include <dlfcn.h>
+
+#define E9D_MAGIC           "E9D"
+#define E9D_VERSION         1
+#define E9D_BLOCK           (1ul << 20)     // Maximum literal block size
+
+/*
+ * Delta header.
+ */
+struct E9DHeader
+{
+    char magic[4];                      // E9D_MAGIC
+    uint32_t version;                   // E9D_VERSION
+    uint64_t input_size;                // Size of the input binary
+    uint64_t output_size;               // Size of the output binary
+};
+
+static_assert(sizeof(E9DHeader) == 24, "bad delta header size");
+
+/*
+ * Delta operations.
+ */
+enum E9DOp : uint8_t
+{
+    E9D_END,
+    E9D_COPY,
+    E9D_INSERT,
+    E9D_INSERT_Z,
+    E9D_ZERO,
+};
+
+/*
+ * The (runtime loaded) zlib functions.
+ */
+struct E9DZlib
+{
+    unsigned long (*compressBound)(unsigned long len);
+    int (*compress2)(uint8_t *dst, unsigned long *dst_len,
+        const uint8_t *src, unsigned long src_len, int level);
+    int (*uncompress)(uint8_t *dst, unsigned long *dst_len,
+        const uint8_t *src, unsigned long src_len);
+};
+
+/*
+ * Load zlib.  Returns nullptr if zlib is not available.
+ */
+static inline const E9DZlib *e9dLoadZlib()
+{
+    static E9DZlib zlib;
+    static bool init = false, ok = false;
+    if (init)
+        return (ok? &zlib: nullptr);
+    init = true;
+    void *handle = dlopen("libz.so.1", RTLD_NOW | RTLD_LOCAL);
+    if (handle == nullptr)
+        return nullptr;
+    zlib.compressBound =
+        (decltype(zlib.compressBound))dlsym(handle, "compressBound");
+    zlib.compress2  = (decltype(zlib.compress2))dlsym(handle, "compress2");
+    zlib.uncompress = (decltype(zlib.uncompress))dlsym(handle, "uncompress");
+    ok = (zlib.compressBound != nullptr && zlib.compress2 != nullptr &&
+          zlib.uncompress != nullptr);
+    return (ok? &zlib: nullptr);
+}
+
+#endif
@@ -29,12 +29,15 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <utility>
+#include <vector>
 
 #include "e9alloc.h"
 #include "e9elf.h"
 #include "e9loader.h"
 #include "e9mapping.h"
+#include "e9parallel.h"
 #include "e9patch.h"
 
 static const
@@ -179,24 +182,26 @@ void parseElf(Allocator &allocator, const char *filename, uint8_t *data,
  */
 static size_t emitRefactoredPatch(const uint8_t *original, uint8_t *data,
     size_t size, size_t mapping_size, const InstrSet &Is,
-    RefactorSet &refactors)
+    const DirtyMap &dirty, RefactorSet &refactors)
 {
     if (option_static_loader)
         return 0;
 
     assert(size % PAGE_SIZE == 0);
 
-    // Step #1: Find refactorings:
+    // Step #1: Find refactorings.  Only the dirty pages can differ from
+    //          the original:
     intptr_t curr_addr   = INTPTR_MIN;
     off_t    curr_offset = -1;
     size_t   curr_size   = 0;
-    for (off_t offset = 0; offset < (off_t)size; offset += PAGE_SIZE)
+    for (size_t page = dirty.next(0); page < dirty.num_pages;
+            page = dirty.next(page + 1))
     {
+        off_t offset = (off_t)(page * PAGE_SIZE);
         if (memcmp(original + offset, data + offset, PAGE_SIZE) == 0)
             continue;
-        auto i = Is.lower_bound(offset);
-        assert(i != Is.end());
-        const Instr *I = i->second;
+        const Instr *I = Is.lower_bound(offset);
+        assert(I != nullptr);
         intptr_t page_addr   = I->addr - (I->addr % PAGE_SIZE);
         off_t    page_offset = I->offset - (I->offset % PAGE_SIZE);
         assert(page_offset == offset);
@@ -344,12 +349,15 @@ static size_t emitLoaderMmap(uint8_t *data, bool pic, intptr_t addr,
     }
 
     const size_t MIN_SIZE = (pic? 21: 18);
-    if (size <= MIN_SIZE)
-        fputs("\33[36m0\33[0m", stdout);
-    else
-        putchar((size - MIN_SIZE < 10?
-                '0' + (size - MIN_SIZE):
-                'A' + (size - MIN_SIZE)));
+    if (option_trace_progress)
+    {
+        if (size <= MIN_SIZE)
+            fputs("\33[36m0\33[0m", stdout);
+        else
+            putchar((size - MIN_SIZE < 10?
+                    '0' + (size - MIN_SIZE):
+                    'A' + (size - MIN_SIZE)));
+    }
 
     return size;
 }
@@ -385,12 +393,163 @@ static size_t emitLoadFuncPtrIntoRAX(uint8_t *data, bool pic, intptr_t fptr)
     return size;
 }
 
+/*
+ * A planned loader mmap() call.
+ */
+struct LoaderMmap
+{
+    intptr_t addr;                      // Address (relative or absolute).
+    size_t len;                         // Length.
+    off_t offset;                       // File offset.
+    int prot;                           // Protections.
+    bool user;                          // Call the user mmap() function?
+    bool refactor;                      // Refactoring (else trampoline)?
+};
+
+/*
+ * Plan the loader mmap() calls in calls[lb..].  The calls are for disjoint
+ * address ranges, so can be freely reordered.  The calls are sorted by
+ * address (for locality), and calls that are contiguous in both the address
+ * space and the file are coalesced into a single call.
+ */
+static void planLoaderMmaps(std::vector<LoaderMmap> &calls, size_t lb)
+{
+    std::sort(calls.begin() + lb, calls.end(),
+        [](const LoaderMmap &a, const LoaderMmap &b)
+        {
+            return (a.addr < b.addr);
+        });
+    size_t j = lb;
+    for (size_t i = lb; i < calls.size(); i++)
+    {
+        if (j > lb)
+        {
+            LoaderMmap &prev = calls[j-1];
+            const LoaderMmap &curr = calls[i];
+            if (IS_ABSOLUTE(prev.addr) == IS_ABSOLUTE(curr.addr) &&
+                    prev.addr + (intptr_t)prev.len == curr.addr &&
+                    prev.offset + (off_t)prev.len == curr.offset &&
+                    prev.prot == curr.prot && prev.user == curr.user)
+            {
+                prev.len += curr.len;
+                continue;
+            }
+        }
+        calls[j++] = calls[i];
+    }
+    calls.resize(j);
+}
+
+/*
+ * The maximum number of lazy mappings.  Beyond this, all mappings are loaded
+ * eagerly, since the loaded lazy mappings (and the fragments of the
+ * reservation between them) could exceed the default vm.max_map_count
+ * (65530).
+ */
+static const size_t LAZY_MMAPS_MAX = 16384;
+
+/*
+ * Test if a loader mmap() call can be loaded lazily.
+ */
+static bool isLazyMmap(const LoaderMmap &call)
+{
+    return (!call.user && (call.prot & PROT_WRITE) == 0 &&
+        call.prot != PROT_NONE);
+}
+
+/*
+ * Plan the loader's calls to mmap() that load trampoline pages.  The
+ * preloaded mappings are loaded first, and the refactorings are loaded
+ * last.  For `--lazy-loader', the (non-writable) trampoline mappings are
+ * not loaded, but are instead listed in `lazy' (unless there are more than
+ * LAZY_MMAPS_MAX).
+ */
+static void planLoader(const RefactorSet &refactors,
+    const MappingSet &mappings, intptr_t base, intptr_t mmap,
+    std::vector<LoaderMmap> &calls, std::vector<LoaderMmap> &lazy)
+{
+    std::vector<Bounds> bounds;
+    intptr_t ub = INTPTR_MIN;
+    for (int preload = 1; preload >= false; preload--)
+    {
+        size_t lb = calls.size();
+        for (auto mapping: mappings)
+        {
+            if (preload == false)
+                stat_num_physical_bytes += mapping->size;
+            off_t offset_0  = mapping->offset;
+            for (; mapping != nullptr; mapping = mapping->merged)
+            {
+                if (mapping->preload != (bool)preload)
+                    continue;
+                bounds.clear();
+                getVirtualBounds(mapping, bounds);
+                for (const auto b: bounds)
+                {
+                    if (!IS_ABSOLUTE(mapping->base))
+                        ub = std::max(ub, mapping->base + b.ub);
+                    LoaderMmap call = {mapping->base + b.lb,
+                        (size_t)(b.ub - b.lb), offset_0 + b.lb, mapping->prot,
+                        (!preload && mmap != INTPTR_MIN), false};
+                    stat_num_virtual_bytes += call.len;
+                    calls.push_back(call);
+                }
+            }
+        }
+        stat_num_loader_mmaps_unplanned += calls.size() - lb;
+        planLoaderMmaps(calls, lb);
+        if (preload || !option_lazy_loader)
+            continue;
+        size_t n = 0;
+        for (size_t i = lb; i < calls.size(); i++)
+            n += (isLazyMmap(calls[i])? 1: 0);
+        if (n > LAZY_MMAPS_MAX)
+        {
+            // Each lazy mapping splits the PROT_NONE reservation when it is
+            // loaded, so the number of VMAs may approach twice the number
+            // of lazy mappings, which can exceed vm.max_map_count.
+            warning("too many lazy mappings (%zu > %zu); falling back to "
+                "eager loading (see `--mem-mapping-size')", n,
+                LAZY_MMAPS_MAX);
+            continue;
+        }
+        size_t j = lb;
+        for (size_t i = lb; i < calls.size(); i++)
+        {
+            const LoaderMmap &call = calls[i];
+            if (isLazyMmap(call))
+                lazy.push_back(call);
+            else
+                calls[j++] = call;
+        }
+        calls.resize(j);
+    }
+    if (ub > base)
+    {
+        // This error may occur if the front-end changes `--mem-loader'
+        // mid-way through the patching process.  It is easiest to detect
+        // the error here than earlier.
+        error("loader base address (0x%lx) (see `--mem-loader') must not "
+            "exceed maximum mapping address (0x%lx) (see `--mem-ub')",
+            base, ub);
+    }
+    size_t lb = calls.size();
+    for (const auto &refactor: refactors)
+    {
+        LoaderMmap call = {refactor.addr, refactor.size,
+            refactor.patched.offset, PROT_READ | PROT_EXEC, false, true};
+        calls.push_back(call);
+    }
+    stat_num_loader_mmaps_unplanned += calls.size() - lb;
+    planLoaderMmaps(calls, lb);
+}
+
 /*
  * Emit the loader.
  */
-static size_t emitLoader(const RefactorSet &refactors,
-    const MappingSet &mappings, uint8_t *data, intptr_t base, intptr_t entry,
-    bool pic, const InitSet &inits, intptr_t mmap, Mode mode)
+static size_t emitLoader(const std::vector<LoaderMmap> &calls,
+    const std::vector<LoaderMmap> &lazy, uint8_t *data, intptr_t base,
+    intptr_t entry, bool pic, const InitSet &inits, intptr_t mmap, Mode mode)
 {
     /*
      * Stage #1
@@ -408,7 +567,31 @@ static size_t emitLoader(const RefactorSet &refactors,
      * Stage #2
      */
 
-    // Step (1): Setup mmap() prot/flags parameters.
+    // Step (1): Setup lazy loading (if necessary).  The setup function
+    //           e9lazy() is in %rax, and returns the fd:
+    size_t table_idx = 0;
+    if (!lazy.empty())
+    {
+        const uint8_t lazy_setup[] =
+        {
+            0x55,                       // push %rbp
+            0x48, 0x89, 0xe5,           // mov %rsp,%rbp
+            0x48, 0x83, 0xe4, 0xf0,     // and $-16,%rsp
+            0x44, 0x89, 0xc6,           // mov %r8d,%esi
+            0x4c, 0x89, 0xe2,           // mov %r12,%rdx
+            0x48, 0x8d, 0x3d,           // lea table(%rip),%rdi
+                0x00, 0x00, 0x00, 0x00,
+            0xff, 0xd0,                 // callq *%rax
+            0x41, 0x89, 0xc0,           // mov %eax,%r8d
+            0x48, 0x89, 0xec,           // mov %rbp,%rsp
+            0x5d,                       // pop %rbp
+        };
+        memcpy(data + size, lazy_setup, sizeof(lazy_setup));
+        table_idx = size + 21;
+        size += sizeof(lazy_setup);
+    }
+
+    // Step (2): Setup mmap() prot/flags parameters.
     int32_t prot = PROT_READ | PROT_EXEC, flags = MAP_PRIVATE | MAP_FIXED;
 
     // mov $prot,%edx
@@ -431,79 +614,28 @@ static size_t emitLoader(const RefactorSet &refactors,
         mmap_idx = size;
     }
 
-    // Step (2): Emit calls to mmap() that load trampoline pages:
+    // Step (3): Emit the planned calls to mmap():
     off_t prev_offset = -1;
     size_t prev_len   = SIZE_MAX;
     int prev_prot     = prot;
-    std::vector<Bounds> bounds;
-    intptr_t ub       = INTPTR_MIN;
-    for (int preload = 1; preload >= false; preload--)
-    {
-        for (auto mapping: mappings)
-        {
-            if (preload == false)
-                stat_num_physical_bytes += mapping->size;
-            off_t offset_0  = mapping->offset;
-            for (; mapping != nullptr; mapping = mapping->merged)
-            {
-                if (mapping->preload != (bool)preload)
-                    continue;
-                bounds.clear();
-                getVirtualBounds(mapping, bounds);
-                for (const auto b: bounds)
-                {
-                    if (!IS_ABSOLUTE(mapping->base))
-                        ub = std::max(ub, mapping->base + b.ub);
-                    intptr_t base = mapping->base + b.lb;
-                    size_t len    = b.ub - b.lb;
-                    off_t offset  = offset_0 + b.lb;
-                    int prot      = mapping->prot;
-                    debug("load trampoline: mmap(" ADDRESS_FORMAT ", %zu, "
-                        "%s%s%s0, MAP_FIXED | MAP_PRIVATE, fd, +%zd)",
-                        ADDRESS(base), len,
-                        (prot & PROT_READ? "PROT_READ | ": ""),
-                        (prot & PROT_WRITE? "PROT_WRITE | ": ""),
-                        (prot & PROT_EXEC? "PROT_EXEC | ": ""), offset);
-                    stat_num_virtual_bytes += len;
-                    size += emitLoaderMmap(data + size, pic, base, len,
-                        prev_len, prot, prev_prot, offset, prev_offset,
-                        (!preload && mmap != INTPTR_MIN));
-                    prev_len    = len;
-                    prev_offset = offset;
-                    prev_prot   = prot;
-                }
-            }
-        }
-    }
-    if (ub > base)
+    for (const auto &call: calls)
     {
-        // This error may occur if the front-end changes `--mem-loader'
-        // mid-way through the patching process.  It is easiest to detect
-        // the error here than earlier.
-        error("loader base address (0x%lx) (see `--mem-loader') must not "
-            "exceed maximum mapping address (0x%lx) (see `--mem-ub')",
-            base, ub);
-    }
-    for (const auto &refactor: refactors)
-    {
-        intptr_t base = refactor.addr;
-        size_t len    = refactor.size;
-        off_t offset  = refactor.patched.offset;
-        int prot      = PROT_READ | PROT_EXEC;
-        debug("load refactoring: mmap(" ADDRESS_FORMAT ", %zu, %s%s%s0, "
+        debug("load %s: mmap(" ADDRESS_FORMAT ", %zu, %s%s%s0, "
             "MAP_FIXED | MAP_PRIVATE, fd, +%zd)",
-            ADDRESS(base), len,
-            (prot & PROT_READ? "PROT_READ | ": ""),
-            (prot & PROT_WRITE? "PROT_WRITE | ": ""),
-            (prot & PROT_EXEC? "PROT_EXEC | ": ""), offset);
-        size += emitLoaderMmap(data + size, pic, base, len, prev_len, prot,
-            prev_prot, offset, prev_offset);
-        prev_len    = len;
-        prev_offset = offset;
-        prev_prot   = prot;
-    }
-
-    // Step (3): Close the fd:
+            (call.refactor? "refactoring": "trampoline"),
+            ADDRESS(call.addr), call.len,
+            (call.prot & PROT_READ? "PROT_READ | ": ""),
+            (call.prot & PROT_WRITE? "PROT_WRITE | ": ""),
+            (call.prot & PROT_EXEC? "PROT_EXEC | ": ""), call.offset);
+        size += emitLoaderMmap(data + size, pic, call.addr, call.len,
+            prev_len, call.prot, prev_prot, call.offset, prev_offset,
+            call.user);
+        prev_len    = call.len;
+        prev_offset = call.offset;
+        prev_prot   = call.prot;
+    }
+
+    // Step (4): Close the fd (unless used for lazy loading):
     const uint8_t close_fd[] =
     {
         0x4c, 0x89, 0xc7,               // movq %r8,%rdi
@@ -511,10 +643,13 @@ static size_t emitLoader(const RefactorSet &refactors,
             0x03, 0x00, 0x00, 0x00,
         0x0f, 0x05,                     // syscall (close)
     };
-    memcpy(data + size, close_fd, sizeof(close_fd));
-    size += sizeof(close_fd);
+    if (lazy.empty())
+    {
+        memcpy(data + size, close_fd, sizeof(close_fd));
+        size += sizeof(close_fd);
+    }
 
-    // Step (4): Call the initialization routines (if any):
+    // Step (5): Call the initialization routines (if any):
     for (auto init: inits)
     {
         size += emitLoadFuncPtrIntoRAX(data + size, pic, init);
@@ -552,10 +687,10 @@ static size_t emitLoader(const RefactorSet &refactors,
         data[size++] = 0xff; data[size++] = 0xd0;
     }
 
-    // Step (5): Setup jump to the real program/library entry address.
+    // Step (6): Setup jump to the real program/library entry address.
     size += emitLoadFuncPtrIntoRAX(data + size, pic, entry);
 
-    // Step (6): Restore the register state (saved by loader entry):
+    // Step (7): Restore the register state (saved by loader entry):
     const uint8_t restore_state[] =
     {
         0x5f,                           // popq %rdi
@@ -574,7 +709,7 @@ static size_t emitLoader(const RefactorSet &refactors,
     memcpy(data + size, restore_state, sizeof(restore_state));
     size += sizeof(restore_state);
 
-    // Step (7): Jump to real entry address:
+    // Step (8): Jump to real entry address:
     // jmpq *rax
     data[size++] = 0xff; data[size++] = 0xe0;
 
@@ -638,9 +773,274 @@ static size_t emitLoader(const RefactorSet &refactors,
         data[size++] = 0xc3;
     }
 
+    /*
+     * Lazy loading table
+     */
+
+    if (!lazy.empty())
+    {
+        size = (size % sizeof(uint64_t) == 0? size:
+            size + sizeof(uint64_t) - (size % sizeof(uint64_t)));
+        int32_t diff32 = size - table_idx;
+        memcpy(data + table_idx - sizeof(int32_t), &diff32, sizeof(diff32));
+
+        E9LazyTable *table = (E9LazyTable *)(data + size);
+        table->num_relative = 0;
+        table->num_absolute = 0;
+        for (const auto &call: lazy)
+        {
+            debug("lazy trampoline: mmap(" ADDRESS_FORMAT ", %zu, "
+                "%s%s0, MAP_FIXED | MAP_PRIVATE, fd, +%zd)",
+                ADDRESS(call.addr), call.len,
+                (call.prot & PROT_READ? "PROT_READ | ": ""),
+                (call.prot & PROT_EXEC? "PROT_EXEC | ": ""), call.offset);
+            assert(call.len <= UINT32_MAX);
+            E9LazyMap *map = table->maps + table->num_relative +
+                table->num_absolute;
+            map->addr   = BASE_ADDRESS(call.addr);
+            map->offset = call.offset;
+            map->len    = (uint32_t)call.len;
+            map->prot   = call.prot;
+            if (IS_ABSOLUTE(call.addr))
+                table->num_absolute++;
+            else
+            {
+                assert(table->num_absolute == 0);
+                table->num_relative++;
+            }
+        }
+        size += sizeof(E9LazyTable) + lazy.size() * sizeof(E9LazyMap);
+    }
+
     return size;
 }
 
+/*
+ * Check if the pages of [lb..ub) overlap any of the `used' ranges.
+ */
+static bool isOverlapping(const std::vector<Bounds> &used, intptr_t lb,
+    intptr_t ub)
+{
+    const intptr_t page_size = (intptr_t)PAGE_SIZE;
+    lb = lb - (lb % page_size);
+    ub = (ub % page_size == 0? ub: ub + page_size - (ub % page_size));
+    for (const auto &b: used)
+    {
+        if (lb < b.ub && b.lb < ub)
+            return true;
+    }
+    return false;
+}
+
+/*
+ * Move the loader mmap() calls that can instead be loaded by the kernel
+ * (as PT_LOAD segments) into `segments' (see `--static-trampolines').
+ * This also plans the new program header table, which is placed at file
+ * offset `*phdrs_offset' (>= size) and address `*phdrs_addr'.  Returns
+ * `false' if no calls were moved.
+ */
+static bool planSegments(const Binary *B, size_t size,
+    std::vector<LoaderMmap> &calls, const std::vector<LoaderMmap> &lazy,
+    std::vector<LoaderMmap> &segments, off_t *phdrs_offset,
+    intptr_t *phdrs_addr)
+{
+    if (option_static_trampolines == 0 || B->mode != MODE_EXECUTABLE)
+        return false;
+
+    // Step (1): Find the address ranges used by the original segments:
+    const Elf64_Ehdr *ehdr = B->elf.ehdr;
+    const Elf64_Phdr *phdrs =
+        (const Elf64_Phdr *)(B->patched.bytes + ehdr->e_phoff);
+    std::vector<Bounds> used;
+    intptr_t delta = INTPTR_MAX, lowest = INTPTR_MAX;
+    for (unsigned i = 0; i < ehdr->e_phnum; i++)
+    {
+        const Elf64_Phdr *phdr = phdrs + i;
+        if (phdr->p_type != PT_LOAD)
+            continue;
+        intptr_t lb = (intptr_t)phdr->p_vaddr;
+        used.push_back({lb, lb + (intptr_t)phdr->p_memsz});
+        if (lb < lowest)
+        {
+            lowest = lb;
+            delta  = lb - (intptr_t)phdr->p_offset;
+        }
+    }
+
+    // Step (2): Select the segments.  The kernel limits the program header
+    //           table to 64KB, which must also fit the original headers,
+    //           the loader, and the table itself:
+    const size_t MAX_PHNUM = 65536 / sizeof(Elf64_Phdr);
+    size_t max = std::min((size_t)option_static_trampolines,
+        MAX_PHNUM - std::min(MAX_PHNUM, (size_t)ehdr->e_phnum + 2));
+    std::vector<LoaderMmap> calls_0(calls);
+    size_t j = 0;
+    for (const auto &call: calls)
+    {
+        intptr_t addr = BASE_ADDRESS(call.addr);
+        if (segments.size() < max && !call.user && !call.refactor &&
+                !(B->elf.pic && IS_ABSOLUTE(call.addr)) && addr >= 0 &&
+                !isOverlapping(used, addr, addr + (intptr_t)call.len))
+        {
+            segments.push_back(call);
+            if (addr < lowest)
+            {
+                lowest = addr;
+                delta  = addr - (intptr_t)call.offset;
+            }
+        }
+        else
+            calls[j++] = call;
+    }
+    calls.resize(j);
+    if (segments.empty())
+        return false;
+
+    // Step (3): Place the new program header table.  Older kernels assume
+    //           that the table is loaded at (delta + offset), where delta is
+    //           the (vaddr - offset) of the first PT_LOAD segment.  The file
+    //           is padded until that address range is free:
+    for (const auto &call: segments)
+        used.push_back({BASE_ADDRESS(call.addr),
+            BASE_ADDRESS(call.addr) + (intptr_t)call.len});
+    for (const auto &call: calls)
+    {
+        if (!B->elf.pic || !IS_ABSOLUTE(call.addr))
+            used.push_back({BASE_ADDRESS(call.addr),
+                BASE_ADDRESS(call.addr) + (intptr_t)call.len});
+    }
+    for (const auto &call: lazy)
+    {
+        if (!B->elf.pic || !IS_ABSOLUTE(call.addr))
+            used.push_back({BASE_ADDRESS(call.addr),
+                BASE_ADDRESS(call.addr) + (intptr_t)call.len});
+    }
+    const size_t MAX_PADDING = 1024 * PAGE_SIZE;
+    size_t phdrs_size = (ehdr->e_phnum + segments.size() + 2) *
+        sizeof(Elf64_Phdr);
+    for (size_t padding = 0; padding <= MAX_PADDING; padding += PAGE_SIZE)
+    {
+        intptr_t addr = delta + (intptr_t)(size + padding);
+        if (addr + (intptr_t)phdrs_size > option_mem_loader)
+            break;
+        if (!isOverlapping(used, addr, addr + (intptr_t)phdrs_size))
+        {
+            *phdrs_offset = (off_t)(size + padding);
+            *phdrs_addr   = addr;
+            return true;
+        }
+    }
+    warning("failed to place the program header table for `--static-"
+        "trampolines'; the trampolines will be loaded by the loader");
+    calls.swap(calls_0);
+    segments.clear();
+    return false;
+}
+
+/*
+ * Emit the new program header table at offset `phdrs_offset' (see
+ * planSegments()).  The PT_LOAD segments are sorted by address, and
+ * include the trampoline segments, the table itself, and the loader (if
+ * loader_size > 0).
+ */
+static void emitPhdrs(const Binary *B,
+    const std::vector<LoaderMmap> &segments, off_t phdrs_offset,
+    intptr_t phdrs_addr, off_t loader_offset, size_t loader_size)
+{
+    Elf64_Ehdr *ehdr = B->elf.ehdr;
+    const Elf64_Phdr *phdrs =
+        (const Elf64_Phdr *)(B->patched.bytes + ehdr->e_phoff);
+
+    // Step (1): Collect & sort the PT_LOAD segments:
+    std::vector<Elf64_Phdr> loads;
+    for (unsigned i = 0; i < ehdr->e_phnum; i++)
+    {
+        if (phdrs[i].p_type == PT_LOAD)
+            loads.push_back(phdrs[i]);
+    }
+    for (const auto &call: segments)
+    {
+        Elf64_Phdr phdr;
+        phdr.p_type   = PT_LOAD;
+        phdr.p_flags  = ((call.prot & PROT_READ)?  PF_R: 0) |
+                        ((call.prot & PROT_WRITE)? PF_W: 0) |
+                        ((call.prot & PROT_EXEC)?  PF_X: 0);
+        phdr.p_offset = call.offset;
+        phdr.p_vaddr  = (Elf64_Addr)BASE_ADDRESS(call.addr);
+        phdr.p_paddr  = (Elf64_Addr)nullptr;
+        phdr.p_filesz = call.len;
+        phdr.p_memsz  = call.len;
+        phdr.p_align  = PAGE_SIZE;
+        loads.push_back(phdr);
+    }
+    size_t num_phdrs = ehdr->e_phnum + segments.size() + 1 +
+        (loader_size > 0? 1: 0);
+    size_t phdrs_size = num_phdrs * sizeof(Elf64_Phdr);
+    Elf64_Phdr phdr_self;
+    phdr_self.p_type   = PT_LOAD;
+    phdr_self.p_flags  = PF_R;
+    phdr_self.p_offset = phdrs_offset;
+    phdr_self.p_vaddr  = (Elf64_Addr)phdrs_addr;
+    phdr_self.p_paddr  = (Elf64_Addr)nullptr;
+    phdr_self.p_filesz = phdrs_size;
+    phdr_self.p_memsz  = phdrs_size;
+    phdr_self.p_align  = PAGE_SIZE;
+    loads.push_back(phdr_self);
+    if (loader_size > 0)
+    {
+        Elf64_Phdr phdr;
+        phdr.p_type   = PT_LOAD;
+        phdr.p_flags  = PF_X | PF_R;
+        phdr.p_offset = loader_offset;
+        phdr.p_vaddr  = (Elf64_Addr)option_mem_loader;
+        phdr.p_paddr  = (Elf64_Addr)nullptr;
+        phdr.p_filesz = loader_size;
+        phdr.p_memsz  = loader_size;
+        phdr.p_align  = PAGE_SIZE;
+        loads.push_back(phdr);
+    }
+    std::sort(loads.begin(), loads.end(),
+        [](const Elf64_Phdr &a, const Elf64_Phdr &b)
+        {
+            return (a.p_vaddr < b.p_vaddr);
+        });
+
+    // Step (2): Emit the table.  The PT_LOAD segments replace the original
+    //           PT_LOAD segments (in order), and PT_PHDR is updated:
+    Elf64_Phdr *table = (Elf64_Phdr *)(B->patched.bytes + phdrs_offset);
+    size_t k = 0;
+    bool seen_load = false;
+    for (unsigned i = 0; i < ehdr->e_phnum; i++)
+    {
+        const Elf64_Phdr *phdr = phdrs + i;
+        switch (phdr->p_type)
+        {
+            case PT_LOAD:
+                if (seen_load)
+                    continue;
+                seen_load = true;
+                for (const auto &load: loads)
+                    table[k++] = load;
+                continue;
+            case PT_PHDR:
+                table[k] = *phdr;
+                table[k].p_offset = phdrs_offset;
+                table[k].p_vaddr  = (Elf64_Addr)phdrs_addr;
+                table[k].p_paddr  = (Elf64_Addr)phdrs_addr;
+                table[k].p_filesz = phdrs_size;
+                table[k].p_memsz  = phdrs_size;
+                k++;
+                continue;
+            default:
+                table[k++] = *phdr;
+                continue;
+        }
+    }
+    assert(k == num_phdrs);
+    ehdr->e_phoff = (Elf64_Off)phdrs_offset;
+    ehdr->e_phnum = (Elf64_Half)num_phdrs;
+}
+
 /*
  * Emit the (modified) ELF binary.
  */
@@ -658,23 +1058,42 @@ size_t emitElf(const Binary *B, const MappingSet &mappings,
     // Step (2): Refactor the patching (if necessary):
     RefactorSet refactors;
     size += emitRefactoredPatch(B->original.bytes, data, size, mapping_size,
-        B->Is, refactors);
+        B->Is, B->dirty, refactors);
     
-    // Step (3): Emit all mappings:
+    // Step (3): Assign the file offsets of all mappings.
+    // NOTE: The mappings themselves are not flattened here, since the
+    //       contents may be written directly into the output file (see
+    //       flattenMappings() and emitMappedBinary()).
     for (auto mapping: mappings)
     {
-        uint8_t *base = data + size;
         mapping->offset = (off_t)size;
-        flattenMapping(base, mapping, /*int3=*/0xcc);
         size += mapping->size;
     }
 
-    // Step (4): Modify the entry address.
+    // Step (4): Plan the loader, and the trampoline segments (if any).  If
+    //           all trampolines are loaded as segments, and there are no
+    //           initialization routines, then the loader is not needed:
+    std::vector<LoaderMmap> calls, lazy, segments;
+    planLoader(refactors, mappings, option_mem_loader, B->mmap, calls,
+        lazy);
+    off_t phdrs_offset = 0;
+    intptr_t phdrs_addr = 0;
+    bool static_phdrs = planSegments(B, size, calls, lazy, segments,
+        &phdrs_offset, &phdrs_addr);
+    bool loader = (!static_phdrs || !calls.empty() || !lazy.empty() ||
+        !B->inits.empty());
+    stat_num_loader_mmaps    += calls.size();
+    stat_num_loader_lazy     += lazy.size();
+    stat_num_loader_segments += segments.size();
+
+    // Step (5): Modify the entry address (if the loader is used).
     intptr_t old_entry = 0;
     switch (B->mode)
     {
         case MODE_EXECUTABLE:
         {
+            if (!loader)
+                break;
             Elf64_Ehdr *ehdr = B->elf.ehdr;
             old_entry     = (intptr_t)B->elf.ehdr->e_entry;
             ehdr->e_entry = (Elf64_Addr)option_mem_loader + LOADER_OFFSET;
@@ -707,16 +1126,31 @@ size_t emitElf(const Binary *B, const MappingSet &mappings,
         }
     }
 
-    // Step (5): Emit the loader:
+    // Step (6): Emit the loader.  If trampoline segments are used, then the
+    //           loader is placed after the new program header table:
+    if (static_phdrs)
+        size = (size_t)phdrs_offset + (B->elf.ehdr->e_phnum +
+            segments.size() + 2) * sizeof(Elf64_Phdr);
+    size = (size % PAGE_SIZE == 0?
+        size: size + PAGE_SIZE - (size % PAGE_SIZE));
     off_t loader_offset = (off_t)size;
-    size_t loader_size  = emitLoader(refactors, mappings, data + size,
-        option_mem_loader, old_entry, B->elf.pic, B->inits, B->mmap, B->mode);
+    size_t loader_size  = 0;
+    if (loader)
+        loader_size = emitLoader(calls, lazy, data + size, option_mem_loader,
+            old_entry, B->elf.pic, B->inits, B->mmap, B->mode);
     size += loader_size;
 
-    // Step (6): Modify the PHDR to load the loader.
-    // NOTE: Currently we use the well-known and easy-to-implement PT_NOTE
-    //       injection method to load the loader.  Some alternative methods
-    //       may also work, but are not yet implemented.
+    // Step (7): Modify the PHDR to load the loader (and segments).
+    // NOTE: By default we use the well-known and easy-to-implement PT_NOTE
+    //       injection method to load the loader.  Otherwise, a new program
+    //       header table is emitted (see emitPhdrs()).
+    if (static_phdrs)
+    {
+        emitPhdrs(B, segments, phdrs_offset, phdrs_addr, loader_offset,
+            loader_size);
+        stat_output_file_size = size;
+        return size;
+    }
     Elf64_Phdr *phdr = B->elf.phdr_note;
     phdr->p_type   = PT_LOAD;
     phdr->p_flags  = PF_X | PF_R;
@@ -731,3 +1165,18 @@ size_t emitElf(const Binary *B, const MappingSet &mappings,
     return size;
 }
 
+/*
+ * Flatten all mappings into the output buffer `data', where data[0]
+ * corresponds to the file offset `base' (the mapping offsets are assigned
+ * by emitElf()).  The mappings are disjoint, so are flattened in parallel.
+ */
+void flattenMappings(const MappingSet &mappings, uint8_t *data, off_t base)
+{
+    parallelFor(mappings.size(), getEmitThreads(),
+        [&](size_t lb, size_t ub)
+        {
+            for (size_t i = lb; i < ub; i++)
+                flattenMapping(data + (mappings[i]->offset - base),
+                    mappings[i], /*int3=*/0xcc);
+        });
+}
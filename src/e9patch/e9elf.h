@@ -29,5 +29,7 @@ void parseElf(Allocator &allocator, const char *filename, uint8_t *data,
     size_t size, Mode mode, ElfInfo &info);
 size_t emitElf(const Binary *B, const MappingSet &mappings,
     size_t mapping_size);
+void flattenMappings(const MappingSet &mappings, uint8_t *data,
+    off_t base);
 
 #endif
@@ -17,6 +17,7 @@
  */
 
 #include <algorithm>
+#include <vector>
 
 #include <cerrno>
 #include <cstdint>
@@ -25,14 +26,19 @@
 #include <cstring>
 
 #include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include "e9delta.h"
+#include "e9elf.h"
 #include "e9emit.h"
 #include "e9patch.h"
 
+#define EMIT_WINDOW         (1ll << 26)     // Output mapping window (64MB)
+
 /*
  * Emit the complete patched executable binary file.
  */
@@ -58,6 +64,371 @@ void emitBinary(const char *filename, const uint8_t *bin, size_t len)
             strerror(errno));
 }
 
+/*
+ * Add the pages overlapping [offset..offset+len) to `pages'.
+ */
+static void addPages(std::vector<size_t> &pages, size_t offset, size_t len)
+{
+    for (size_t page = offset / PAGE_SIZE;
+            len > 0 && page <= (offset + len - 1) / PAGE_SIZE; page++)
+        pages.push_back(page);
+}
+
+/*
+ * Get the (sorted) pages of the input binary that may differ from the
+ * original, i.e., the pages marked by the tactics (see DirtyMap), and the
+ * pages containing the ELF headers modified by emitElf().  All other pages
+ * are known to be unmodified.
+ */
+static void getDirtyPages(const Binary *B, std::vector<size_t> &pages)
+{
+    const DirtyMap &dirty = B->dirty;
+    for (size_t page = dirty.next(0); page < dirty.num_pages;
+            page = dirty.next(page + 1))
+        pages.push_back(page);
+    addPages(pages, 0, sizeof(Elf64_Ehdr));
+    addPages(pages, (const uint8_t *)B->elf.phdr_note - B->patched.bytes,
+        sizeof(Elf64_Phdr));
+    if (B->elf.phdr_dynamic != nullptr)
+        addPages(pages, B->elf.phdr_dynamic->p_offset,
+            B->elf.phdr_dynamic->p_filesz);
+    std::sort(pages.begin(), pages.end());
+    pages.erase(std::unique(pages.begin(), pages.end()), pages.end());
+    while (!pages.empty() && pages.back() * PAGE_SIZE >= B->size)
+        pages.pop_back();
+}
+
+/*
+ * Write buf[0..len) to the output file at the given offset.
+ */
+static void writeOutput(const char *filename, int fd, const uint8_t *buf,
+    size_t len, off_t offset)
+{
+    while (len > 0)
+    {
+        ssize_t r = pwrite(fd, buf, len, offset);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0)
+            error("failed to write output to file \"%s\": %s", filename,
+                strerror(errno));
+        buf    += r;
+        len    -= (size_t)r;
+        offset += r;
+    }
+}
+
+/*
+ * Copy the unmodified range [offset..offset+len) of the original binary
+ * into the output file.  Where possible, copy_file_range() is used, which
+ * avoids copying the data through user space (and may share the extents
+ * on file systems that support reflinks).
+ */
+static void copyOriginal(const char *filename, const Binary *B, int fd,
+    off_t offset, size_t len, bool &use_copy)
+{
+    while (use_copy && len > 0)
+    {
+        loff_t off_in = offset, off_out = offset;
+        ssize_t r = copy_file_range(B->original.fd, &off_in, fd, &off_out,
+            len, 0);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+        {
+            use_copy = false;           // Not supported, so fallback.
+            break;
+        }
+        offset += r;
+        len    -= (size_t)r;
+    }
+    writeOutput(filename, fd, B->original.bytes + offset, len, offset);
+}
+
+/*
+ * Emit the complete patched executable binary file directly into the
+ * output file.  The layout must already be known (see emitElf()), so the
+ * output file is truncated to the final length `len', and the mappings are
+ * flattened directly into (windows of) a memory mapping of the file.  The
+ * unmodified pages of the original binary are copied with
+ * copy_file_range().  This avoids building the (possibly very large)
+ * output in an anonymous buffer, and then copying it again.  Returns
+ * `false' if the output file is not a regular file, in which case nothing
+ * is written.
+ */
+bool emitMappedBinary(const char *filename, const Binary *B,
+    const MappingSet &mappings, size_t len)
+{
+    int fd = open(filename, O_RDWR | O_CREAT,
+        S_IRUSR | S_IWUSR | S_IXUSR |
+        S_IRGRP | S_IWGRP | S_IXGRP |
+        S_IROTH | S_IWOTH | S_IXOTH);
+    if (fd < 0)
+        return false;
+    struct stat out_stat, in_stat;
+    if (fstat(fd, &out_stat) < 0 || !S_ISREG(out_stat.st_mode) ||
+        fstat(B->original.fd, &in_stat) < 0 ||
+        (out_stat.st_dev == in_stat.st_dev &&
+         out_stat.st_ino == in_stat.st_ino))
+    {
+        // Not a regular file, or overwrites the input binary (which is
+        // still mapped).
+        close(fd);
+        return false;
+    }
+    if (ftruncate(fd, 0) < 0 || ftruncate(fd, (off_t)len) < 0)
+        error("failed to set length of output file \"%s\" to %zu bytes: "
+            "%s", filename, len, strerror(errno));
+
+    // Step (1): Copy the original binary.  Only the modified pages are
+    //           copied from the patched buffer (everything else is copied
+    //           from the original):
+    const uint8_t *data = B->patched.bytes;
+    const size_t size = B->size;
+    std::vector<size_t> pages;
+    getDirtyPages(B, pages);
+    bool use_copy = true;
+    size_t clean = 0;
+    for (size_t page: pages)
+    {
+        size_t i = page * PAGE_SIZE, n = std::min(size - i, PAGE_SIZE);
+        if (memcmp(data + i, B->original.bytes + i, n) == 0)
+            continue;
+        if (clean < i)
+            copyOriginal(filename, B, fd, (off_t)clean, i - clean, use_copy);
+        writeOutput(filename, fd, data + i, n, (off_t)i);
+        clean = i + n;
+    }
+    if (clean < size)
+        copyOriginal(filename, B, fd, (off_t)clean, size - clean, use_copy);
+
+    // Step (2): Copy the non-mapping extensions, i.e., the refactored
+    //           pages (before) and the loader (after the mappings):
+    size_t lb = size, ub = size;
+    if (!mappings.empty())
+    {
+        lb = (size_t)mappings.front()->offset;
+        ub = (size_t)mappings.back()->offset + mappings.back()->size;
+    }
+    if (size < lb)
+        writeOutput(filename, fd, data + size, lb - size, (off_t)size);
+    if (ub < len)
+        writeOutput(filename, fd, data + ub, len - ub, (off_t)ub);
+
+    // Step (3): Flatten the mappings directly into the output file.  This
+    //           is done in windows, so the mapped output never counts
+    //           towards the resident set size by more than EMIT_WINDOW:
+    MappingSet window;
+    for (size_t i = 0, j = 0; i < mappings.size(); i = j)
+    {
+        off_t base = mappings[i]->offset;
+        base -= base % PAGE_SIZE;
+        off_t end = base;
+        window.clear();
+        for (; j < mappings.size(); j++)
+        {
+            off_t next = mappings[j]->offset + (off_t)mappings[j]->size;
+            if (j > i && next - base > EMIT_WINDOW)
+                break;
+            window.push_back(mappings[j]);
+            end = next;
+        }
+        uint8_t *out = (uint8_t *)mmap(nullptr, end - base,
+            PROT_READ | PROT_WRITE, MAP_SHARED, fd, base);
+        if (out == MAP_FAILED)
+            error("failed to map output file \"%s\": %s", filename,
+                strerror(errno));
+        {
+            PhaseTimer timer(PHASE_FLATTEN);
+            flattenMappings(window, out, base);
+        }
+        if (munmap(out, end - base) < 0)
+            error("failed to unmap output file \"%s\": %s", filename,
+                strerror(errno));
+    }
+
+    if (fchmod(fd, S_IRUSR | S_IWUSR | S_IXUSR |
+                   S_IRGRP | S_IWGRP | S_IXGRP |
+                   S_IROTH | S_IWOTH | S_IXOTH))
+        warning("failed to set execute permission for output file \"%s\": "
+            "%s", filename, strerror(errno));
+    if (close(fd) < 0)
+        error("failed to close output file \"%s\": %s", filename,
+            strerror(errno));
+    return true;
+}
+
+/*
+ * Delta writer.  Adjacent COPY operations are merged.
+ */
+struct DeltaWriter
+{
+    const char *filename;               // Output filename
+    FILE *out;                          // Output stream
+    const E9DZlib *zlib;                // zlib (or nullptr)
+    std::vector<uint8_t> zbuf;          // Compression buffer
+    size_t copy_offset = 0;             // Pending COPY offset
+    size_t copy_len    = 0;             // Pending COPY length
+
+    DeltaWriter(const char *filename, FILE *out) :
+        filename(filename), out(out), zlib(e9dLoadZlib())
+    {
+        if (zlib != nullptr)
+            zbuf.resize(zlib->compressBound(E9D_BLOCK));
+    }
+
+    /*
+     * Write raw bytes.
+     */
+    void write(const void *buf, size_t len)
+    {
+        if (fwrite(buf, sizeof(uint8_t), len, out) != len)
+            error("failed to write delta to file \"%s\": %s", filename,
+                strerror(errno));
+    }
+    void write(E9DOp op, uint64_t x)
+    {
+        write(&op, sizeof(op));
+        write(&x, sizeof(x));
+    }
+
+    /*
+     * Flush the pending COPY operation (if any).
+     */
+    void flush()
+    {
+        if (copy_len == 0)
+            return;
+        write(E9D_COPY, copy_offset);
+        write(&copy_len, sizeof(uint64_t));
+        copy_len = 0;
+    }
+
+    /*
+     * Copy input[offset..offset+len) to the output.
+     */
+    void copy(size_t offset, size_t len)
+    {
+        if (len == 0)
+            return;
+        if (copy_len > 0 && copy_offset + copy_len == offset)
+        {
+            copy_len += len;
+            return;
+        }
+        flush();
+        copy_offset = offset;
+        copy_len    = len;
+    }
+
+    /*
+     * Insert buf[0..len) into the output.
+     */
+    void insert(const uint8_t *buf, size_t len)
+    {
+        flush();
+        while (len > 0)
+        {
+            size_t n = std::min(len, E9D_BLOCK);
+            unsigned long zlen = zbuf.size();
+            if (zlib != nullptr &&
+                zlib->compress2(zbuf.data(), &zlen, buf, n,
+                    /*Z_BEST_SPEED=*/1) == /*Z_OK=*/0 && zlen < n)
+            {
+                write(E9D_INSERT_Z, n);
+                write(&zlen, sizeof(uint64_t));
+                write(zbuf.data(), zlen);
+            }
+            else
+            {
+                write(E9D_INSERT, n);
+                write(buf, n);
+            }
+            buf += n;
+            len -= n;
+        }
+    }
+
+    /*
+     * Append len zero bytes to the output.
+     */
+    void zero(size_t len)
+    {
+        if (len == 0)
+            return;
+        flush();
+        write(E9D_ZERO, len);
+    }
+};
+
+/*
+ * Emit a "patch.e9d" binary delta (see e9delta.h).  Within the input
+ * binary, only the dirty pages (see getDirtyPages()) are compared with the
+ * original, and all other pages are copied from the input.  Everything
+ * past the end of the input binary (refactored pages, trampolines and the
+ * loader) is inserted.
+ */
+void emitDelta(const char *filename, const Binary *B, size_t len)
+{
+    FILE *out = stdout;
+    if (strcmp(filename, "-") != 0)
+    {
+        out = fopen(filename, "w");
+        if (out == nullptr)
+            error("failed to open output file \"%s\" for writing: %s",
+                filename, strerror(errno));
+    }
+    const uint8_t *data = B->patched.bytes, *original = B->original.bytes;
+    const size_t size = B->size;
+
+    // Step (1): Find the dirty pages:
+    std::vector<size_t> pages;
+    getDirtyPages(B, pages);
+
+    // Step (2): Emit the header:
+    DeltaWriter W(filename, out);
+    E9DHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, E9D_MAGIC, sizeof(E9D_MAGIC));
+    hdr.version     = E9D_VERSION;
+    hdr.input_size  = size;
+    hdr.output_size = len;
+    W.write(&hdr, sizeof(hdr));
+
+    // Step (3): Emit the input binary:
+    size_t clean = 0;
+    for (size_t page: pages)
+    {
+        size_t lb = page * PAGE_SIZE, ub = std::min(lb + PAGE_SIZE, size);
+        if (memcmp(data + lb, original + lb, ub - lb) == 0)
+            continue;
+        size_t first = lb, last = ub;
+        while (data[first] == original[first])
+            first++;
+        while (data[last-1] == original[last-1])
+            last--;
+        W.copy(clean, first - clean);
+        W.insert(data + first, last - first);
+        clean = last;
+    }
+    W.copy(clean, size - clean);
+
+    // Step (4): Emit the extensions:
+    size_t round = (size % PAGE_SIZE == 0? size:
+        size + PAGE_SIZE - size % PAGE_SIZE);
+    W.zero(round - size);
+    W.insert(data + round, len - round);
+    W.flush();
+    uint8_t end = E9D_END;
+    W.write(&end, sizeof(end));
+
+    if (out != stdout && fclose(out) < 0)
+        error("failed to close output file \"%s\": %s", filename,
+            strerror(errno));
+    else if (out == stdout)
+        fflush(stdout);
+}
+
 /*
  * Emit a binary patch.  Implements (an approximation of) the pipeline:
  *      cat bin1 | xxd > tmp.1
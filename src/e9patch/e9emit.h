@@ -22,7 +22,13 @@
 #include <cstdint>
 #include <cstdlib>
 
+#include "e9mapping.h"
+#include "e9patch.h"
+
 void emitBinary(const char *filename, const uint8_t *bin, size_t len);
+bool emitMappedBinary(const char *filename, const Binary *B,
+    const MappingSet &mappings, size_t len);
+void emitDelta(const char *filename, const Binary *B, size_t len);
 void emitPatch(const char *filename, const char *compress, int fd1,
     const uint8_t *bin2, size_t len2);
 
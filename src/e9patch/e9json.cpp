@@ -23,7 +23,10 @@
 #include <cstdlib>
 #include <cstring>
 
+#include <algorithm>
+#include <deque>
 #include <set>
+#include <string>
 #include <vector>
 
 #include <sys/mman.h>
@@ -31,8 +34,13 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "e9json.h"
 #include "e9patch.h"
+#include "e9ring.h"
 #include "e9trampoline.h"
 
 /*
@@ -55,29 +63,163 @@
 #define parse_error(parser, msg, ...)                                   \
     error("line %zu: " msg, (parser).lineno, ##__VA_ARGS__)
 
+/*
+ * Block-buffered input.  Regular files are mmap()'ed in their entirety,
+ * otherwise (pipes, terminals) the input is read() in large blocks.  This
+ * avoids the per-character overheads of stdio.  Shared-memory rings are
+ * read in-place, block by block.
+ */
+#define BLOCK_SIZE          (1 << 20)
+struct Input
+{
+    FILE *stream = nullptr;             // Input stream
+    int fd = -1;                        // Input file descriptor
+    bool pipe = false;                  // Input is a pipe?
+    const char *buf = nullptr;          // Input buffer
+    size_t pos = 0;                     // Input buffer position
+    size_t len = 0;                     // Input buffer length
+    char *block = nullptr;              // Block buffer (if not mmap'ed)
+    RingReader *ring = nullptr;         // Shared-memory ring (if any)
+
+    Input()
+    {
+        ;
+    }
+
+    Input(const char *buf, size_t len) : buf(buf), len(len)
+    {
+        ;
+    }
+
+    /*
+     * Attach to the given stream.
+     */
+    void open(FILE *stream)
+    {
+        this->stream = stream;
+        fd  = fileno(stream);
+        buf = nullptr;
+        pos = len = 0;
+        struct stat statbuf;
+        if (fstat(fd, &statbuf) < 0)
+            error("failed to stat input: %s", strerror(errno));
+        pipe = S_ISFIFO(statbuf.st_mode);
+        off_t offset = lseek(fd, 0, SEEK_CUR);
+        if (S_ISREG(statbuf.st_mode) && offset >= 0 &&
+                offset < statbuf.st_size)
+        {
+            void *ptr = mmap(nullptr, statbuf.st_size, PROT_READ,
+                MAP_PRIVATE, fd, 0);
+            if (ptr != MAP_FAILED)
+            {
+                (void)madvise(ptr, statbuf.st_size, MADV_SEQUENTIAL);
+                buf = (const char *)ptr;
+                pos = (size_t)offset;
+                len = (size_t)statbuf.st_size;
+                fd  = -1;
+                return;
+            }
+        }
+        if (block == nullptr)
+        {
+            block = new char[BLOCK_SIZE];
+        }
+        buf = block;
+    }
+
+    /*
+     * Attach to the given shared-memory ring.
+     */
+    void open(RingReader *ring)
+    {
+        this->ring = ring;
+        pipe = true;
+        buf  = nullptr;
+        pos  = len = 0;
+    }
+
+    /*
+     * Refill the input buffer.  Returns `false' on end-of-file.
+     */
+    bool refill()
+    {
+        if (ring != nullptr)
+        {
+            const uint8_t *data;
+            if (!ring->next(&data, &len))
+                return false;
+            buf = (const char *)data;
+            pos = 0;
+            return true;
+        }
+        if (fd < 0)
+            return false;
+        while (true)
+        {
+            ssize_t r = read(fd, block, BLOCK_SIZE);
+            if (r < 0 && errno == EINTR)
+                continue;
+            if (r < 0)
+                error("failed to read input: %s", strerror(errno));
+            if (r == 0)
+                return false;
+            pos = 0;
+            len = (size_t)r;
+            return true;
+        }
+    }
+
+    /*
+     * Get a pointer to the next `n' bytes, using `tmp' as storage if the
+     * bytes span multiple blocks.  Returns nullptr on end-of-file.
+     */
+    const uint8_t *get(size_t n, std::vector<uint8_t> &tmp)
+    {
+        if (len - pos >= n)
+        {
+            const uint8_t *ptr = (const uint8_t *)buf + pos;
+            pos += n;
+            return ptr;
+        }
+        tmp.resize(n);
+        size_t i = 0;
+        while (i < n)
+        {
+            if (pos >= len && !refill())
+                return nullptr;
+            size_t m = std::min(n - i, len - pos);
+            memcpy(tmp.data() + i, buf + pos, m);
+            pos += m;
+            i   += m;
+        }
+        return tmp.data();
+    }
+};
+
 /*
  * JSON parser.
  */
 struct Parser
 {
-    FILE * const stream;                // Input stream
+    Input &input;                       // Input
     size_t lineno;                      // Line number
     char peek = '\0';                   // Peek'ed token
     bool b;                             // Boolean value
-    bool pipe = false;                  // Input is a pipe?
+    bool pipe;                          // Input is a pipe?
     int32_t i;                          // Integer value
     char s[STRING_MAX];                 // String value
 
-    Parser(FILE *stream, size_t lineno) : stream(stream), lineno(lineno)
+    Parser(Input &input, size_t lineno) : input(input), lineno(lineno),
+        pipe(input.pipe)
     {
-        struct stat buf;
-        if (fstat(fileno(stream), &buf) == 0 && S_ISFIFO(buf.st_mode))
-            pipe = true;
+        ;
     }
 
     char getc()
     {
-        char c = ::getc(stream);
+        if (input.pos >= input.len && !input.refill())
+            return EOF;
+        char c = input.buf[input.pos++];
         if (c == '\n')
             lineno++;
         return c;
@@ -85,12 +227,60 @@ struct Parser
 
     void ungetc(char c)
     {
+        if (c == EOF)
+            return;
         if (c == '\n')
             lineno--;
-        ::ungetc(c, stream);
+        input.pos--;
+    }
+
+    /*
+     * Match (and consume) the keyword suffix `str' if it is in the buffer.
+     */
+    bool match(const char *str, size_t n)
+    {
+        if (input.len - input.pos < n ||
+                memcmp(input.buf + input.pos, str, n) != 0)
+            return false;
+        input.pos += n;
+        return true;
     }
 };
 
+/*
+ * Find the length of the plain (unescaped) prefix of a string, i.e., the
+ * number of characters before the first `"', `\\', newline or (char)EOF.
+ */
+static size_t scanString(const char *str, size_t n)
+{
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i quote = _mm_set1_epi8('\"'), slash = _mm_set1_epi8('\\'),
+        nl = _mm_set1_epi8('\n'), eof = _mm_set1_epi8((char)EOF);
+    for (; i + sizeof(__m128i) <= n; i += sizeof(__m128i))
+    {
+        __m128i x = _mm_loadu_si128((const __m128i *)(str + i));
+        __m128i m = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(x, quote), _mm_cmpeq_epi8(x, slash)),
+            _mm_or_si128(_mm_cmpeq_epi8(x, nl), _mm_cmpeq_epi8(x, eof)));
+        unsigned mask = (unsigned)_mm_movemask_epi8(m);
+        if (mask != 0)
+            return i + __builtin_ctz(mask);
+    }
+#endif
+    for (; i < n; i++)
+    {
+        switch (str[i])
+        {
+            case '\"': case '\\': case '\n': case (char)EOF:
+                return i;
+            default:
+                break;
+        }
+    }
+    return i;
+}
+
 /*
  * Get the token name for error reporting.
  */
@@ -159,27 +349,31 @@ static char peekToken(Parser &parser)
         case ':': case ',': case '{': case '}': case '[': case ']': case EOF:
             return (parser.peek = c);
         case 't':
-            if (parser.getc() != 'r' || parser.getc() != 'u' ||
-                    parser.getc() != 'e')
+            if (!parser.match("rue", 3) && (parser.getc() != 'r' ||
+                    parser.getc() != 'u' || parser.getc() != 'e'))
                 goto bad_token;
             parser.b = true;
             return (parser.peek = TOKEN_BOOL);
         case 'f':
-            if (parser.getc() != 'a' || parser.getc() != 'l' ||
-                    parser.getc() != 's' || parser.getc() != 'e')
+            if (!parser.match("alse", 4) && (parser.getc() != 'a' ||
+                    parser.getc() != 'l' || parser.getc() != 's' ||
+                    parser.getc() != 'e'))
                 goto bad_token;
             parser.b = false;
             return (parser.peek = TOKEN_BOOL);
         case 'n':
-            if (parser.getc() != 'u' || parser.getc() != 'l' ||
-                    parser.getc() != 'l')
+            if (!parser.match("ull", 3) && (parser.getc() != 'u' ||
+                    parser.getc() != 'l' || parser.getc() != 'l'))
                 goto bad_token;
             return (parser.peek = TOKEN_NULL);
         case '-': case '0': case '1': case '2': case '3': case '4':
         case '5': case '6': case '7': case '8': case '9':
         {
-            unsigned len = 0;
-            parser.s[len++] = c;
+            // Numbers are at most NUMBER_MAX-1 characters, so the value
+            // can be accumulated directly without overflow.
+            bool neg = (c == '-');
+            unsigned len = 1;
+            int64_t x = (neg? 0: c - '0');
             while (true)
             {
                 if (len >= NUMBER_MAX)
@@ -189,17 +383,17 @@ static char peekToken(Parser &parser)
                 if (!isdigit(c))
                 {
                     parser.ungetc(c);
-                    parser.s[len++] = '\0';
                     break;
                 }
-                parser.s[len++] = c;
+                x = 10 * x + (c - '0');
+                len++;
             }
-            if (parser.s[0] == '-' && parser.s[1] == '\0')
+            if (neg && len == 1)
             {
                 c = '-';
                 goto bad_token;
             }
-            int64_t x = (int64_t)strtoll(parser.s, nullptr, 10);
+            x = (neg? -x: x);
             if (x < INT32_MIN || x > INT32_MAX)
                 parse_error(parser, "failed to read JSON number, value is "
                     "out of range (%d..%d)", INT32_MIN, INT32_MAX);
@@ -209,8 +403,16 @@ static char peekToken(Parser &parser)
         case '\"':
         {
             unsigned len = 0;
+            Input &input = parser.input;
             while (true)
             {
+                // Fast path: copy any plain characters in bulk.
+                size_t n = scanString(input.buf + input.pos,
+                    std::min(input.len - input.pos, (size_t)STRING_MAX - len));
+                memcpy(parser.s + len, input.buf + input.pos, n);
+                input.pos += n;
+                len += (unsigned)n;
+
                 if (len >= STRING_MAX)
                     parse_error(parser, "failed to read JSON string, maximum "
                         "length (%u) was exceeded", STRING_MAX);
@@ -334,10 +536,10 @@ static char expectToken2(Parser &parser, char token1, char token2)
 /*
  * Convert a string into a number.
  */
-static intptr_t stringToNumber(const Parser &parser)
+static intptr_t stringToNumber(const Parser &parser, const char *str)
 {
     bool neg = false;
-    const char *s = parser.s;
+    const char *s = str;
     if (s[0] == '-')
     {
         neg = true;
@@ -350,8 +552,8 @@ static intptr_t stringToNumber(const Parser &parser)
     errno = 0;
     intptr_t x = (intptr_t)strtoull(s, &end, base);
     if (errno != 0 || (end != nullptr && *end != '\0'))
-        parse_error(parser, "failed to parse number from JSON string \"%s\"",
-            parser.s);
+        parse_error(parser, "failed to parse number from string \"%s\"",
+            str);
     return (neg? -x: x);
 }
 
@@ -421,6 +623,7 @@ static bool validateParam(Method method, ParamName paramName)
         case METHOD_BINARY:
             switch (paramName)
             {
+                case PARAM_ENCODING:
                 case PARAM_FILENAME:
                 case PARAM_MODE:
                     return true;
@@ -672,7 +875,7 @@ type_error:
             if (token == TOKEN_NUMBER)
                 x = (intptr_t)parser.i;
             else
-                x = stringToNumber(parser);
+                x = stringToNumber(parser, parser.s);
             switch (entry.kind)
             {
                 case ENTRY_INT8:
@@ -710,7 +913,7 @@ type_error:
                 if (token == TOKEN_NUMBER)
                     entry.uint64 = (uint64_t)parser.i;
                 else
-                    entry.uint64 = (uint64_t)stringToNumber(parser);
+                    entry.uint64 = (uint64_t)stringToNumber(parser, parser.s);
             }
             break;
         }
@@ -915,9 +1118,9 @@ static char * const *parseStrings(Parser &parser, const char *first = nullptr)
 /*
  * Parse a protection.
  */
-static int parseProtection(const Parser &parser, unsigned i, char c, int prot)
+static int parseProtection(const Parser &parser, const char *str, unsigned i,
+    char c, int prot)
 {
-    const char *str = parser.s;
     if (str[i] == c)
         return prot;
     else if (str[i] == '-')
@@ -927,6 +1130,259 @@ static int parseProtection(const Parser &parser, unsigned i, char c, int prot)
             "expected `%c' or '-', found `%c'", str, c, str[i]);
 }
 
+/*
+ * Convert a string into a parameter name.
+ */
+static ParamName getParamName(const char *str)
+{
+    switch (str[0])
+    {
+        case 'a':
+            if (strcmp(str, "address") == 0)
+                return PARAM_ADDRESS;
+            else if (strcmp(str, "absolute") == 0)
+                return PARAM_ABSOLUTE;
+            else if (strcmp(str, "argv") == 0)
+                return PARAM_ARGV;
+            break;
+        case 'b':
+            if (strcmp(str, "bytes") == 0)
+                return PARAM_BYTES;
+            break;
+        case 'e':
+            if (strcmp(str, "encoding") == 0)
+                return PARAM_ENCODING;
+            break;
+        case 'f':
+            if (strcmp(str, "filename") == 0)
+                return PARAM_FILENAME;
+            else if (strcmp(str, "format") == 0)
+                return PARAM_FORMAT;
+            break;
+        case 'i':
+            if (strcmp(str, "init") == 0)
+                return PARAM_INIT;
+            break;
+        case 'l':
+            if (strcmp(str, "length") == 0)
+                return PARAM_LENGTH;
+            break;
+        case 'o':
+            if (strcmp(str, "offset") == 0)
+                return PARAM_OFFSET;
+            break;
+        case 'p':
+            if (strcmp(str, "protection") == 0)
+                return PARAM_PROTECTION;
+            break;
+        case 'm':
+            if (strcmp(str, "metadata") == 0)
+                return PARAM_METADATA;
+            else if (strcmp(str, "mode") == 0)
+                return PARAM_MODE;
+            else if (strcmp(str, "mmap") == 0)
+                return PARAM_MMAP;
+            break;
+        case 'n':
+            if (strcmp(str, "name") == 0)
+                return PARAM_NAME;
+            break;
+        case 't':
+            if (strcmp(str, "trampoline") == 0)
+                return PARAM_TRAMPOLINE;
+            else if (strcmp(str, "template") == 0)
+                return PARAM_TEMPLATE;
+            break;
+    }
+    return PARAM_UNKNOWN;
+}
+
+/*
+ * Convert a string into a method.
+ */
+static Method getMethod(const char *str)
+{
+    switch (str[0])
+    {
+        case 'b':
+            if (strcmp(str, "binary") == 0)
+                return METHOD_BINARY;
+            break;
+        case 'e':
+            if (strcmp(str, "emit") == 0)
+                return METHOD_EMIT;
+            break;
+        case 'i':
+            if (strcmp(str, "instruction") == 0)
+                return METHOD_INSTRUCTION;
+            break;
+        case 'o':
+            if (strcmp(str, "options") == 0)
+                return METHOD_OPTIONS;
+            break;
+        case 'p':
+            if (strcmp(str, "patch") == 0)
+                return METHOD_PATCH;
+            break;
+        case 'r':
+            if (strcmp(str, "reserve") == 0)
+                return METHOD_RESERVE;
+            break;
+        case 't':
+            if (strcmp(str, "trampoline") == 0)
+                return METHOD_TRAMPOLINE;
+            break;
+    }
+    return METHOD_UNKNOWN;
+}
+
+/*
+ * Parse a string-valued parameter.
+ */
+static ParamValue parseStringValue(const Parser &parser, ParamName name,
+    const char *str)
+{
+    ParamValue value;
+    value.string = nullptr;
+    switch (name)
+    {
+        case PARAM_ADDRESS:
+        case PARAM_OFFSET:
+        case PARAM_LENGTH:
+        case PARAM_INIT:
+        case PARAM_MMAP:
+            value.integer = stringToNumber(parser, str);
+            break;
+        case PARAM_FILENAME:
+        case PARAM_NAME:
+        case PARAM_TRAMPOLINE:
+            value.string = dupString(str);
+            break;
+        case PARAM_PROTECTION:
+        {
+            int prot = PROT_NONE;
+            prot |= parseProtection(parser, str, 0, 'r', PROT_READ);
+            prot |= parseProtection(parser, str, 1, 'w', PROT_WRITE);
+            prot |= parseProtection(parser, str, 2, 'x', PROT_EXEC);
+            if (str[3] != '\0')
+                parse_error(parser, "failed to parse protection "
+                    "string \"%s\"; string length must be 3", str);
+            value.integer = (intptr_t)prot;
+            break;
+        }
+        case PARAM_FORMAT:
+            if (strcmp(str, "binary") == 0)
+                value.integer = (intptr_t)FORMAT_BINARY;
+            else if (strcmp(str, "patch") == 0)
+                value.integer = (intptr_t)FORMAT_PATCH;
+            else if (strcmp(str, "patch.gz") == 0)
+                value.integer = (intptr_t)FORMAT_PATCH_GZ;
+            else if (strcmp(str, "patch.bz2") == 0)
+                value.integer = (intptr_t)FORMAT_PATCH_BZIP2;
+            else if (strcmp(str, "patch.xz") == 0)
+                value.integer = (intptr_t)FORMAT_PATCH_XZ;
+            else if (strcmp(str, "patch.e9d") == 0)
+                value.integer = (intptr_t)FORMAT_PATCH_E9D;
+            else
+                parse_error(parser, "failed to parse format string "
+                    "\"%s\"; expected one of {\"binary\", \"patch\", "
+                    "\"patch.gz\", \"patch.bz2\", \"patch.xz\", "
+                    "\"patch.e9d\"}", str);
+            break;
+        case PARAM_MODE:
+            if (strcmp(str, "exe") == 0)
+                value.integer = (intptr_t)MODE_EXECUTABLE;
+            else if (strcmp(str, "dso") == 0)
+                value.integer = (intptr_t)MODE_SHARED_OBJECT;
+            else
+                parse_error(parser, "failed to parse mode string "
+                    "\"%s\"; expected one of {\"exe\", \"dso\"}", str);
+            break;
+        case PARAM_ENCODING:
+            if (strcmp(str, "json") == 0)
+                value.integer = (intptr_t)ENCODING_JSON;
+            else if (strcmp(str, "binary") == 0)
+                value.integer = (intptr_t)ENCODING_BINARY;
+            else
+                parse_error(parser, "failed to parse encoding string "
+                    "\"%s\"; expected one of {\"json\", \"binary\"}", str);
+            break;
+        default:
+            parse_error(parser, "failed to parse parameter; unexpected "
+                "string value \"%s\"", str);
+    }
+    return value;
+}
+
+/*
+ * Parse a parameter value.
+ */
+static ParamValue parseValue(Parser &parser, ParamName name)
+{
+    ParamValue value;
+    value.string = nullptr;
+    switch (name)
+    {
+        case PARAM_ADDRESS:
+        case PARAM_OFFSET:
+        case PARAM_LENGTH:
+        case PARAM_INIT:
+        case PARAM_MMAP:
+        {
+            char token = expectToken2(parser, TOKEN_NUMBER, TOKEN_STRING);
+            if (token == TOKEN_NUMBER)
+                value.integer = (intptr_t)parser.i;
+            else
+                value = parseStringValue(parser, name, parser.s);
+            break;
+        }
+        case PARAM_ABSOLUTE:
+            expectToken(parser, TOKEN_BOOL);
+            value.boolean = parser.b;
+            break;
+        case PARAM_ARGV:
+            value.strings = parseStrings(parser, "<option>");
+            break;
+        case PARAM_FILENAME:
+        case PARAM_NAME:
+        case PARAM_TRAMPOLINE:
+        case PARAM_PROTECTION:
+        case PARAM_FORMAT:
+        case PARAM_MODE:
+        case PARAM_ENCODING:
+            expectToken(parser, TOKEN_STRING);
+            value = parseStringValue(parser, name, parser.s);
+            break;
+        case PARAM_TEMPLATE:
+            value.trampoline = parseTrampoline(parser, /*debug=*/true);
+            break;
+        case PARAM_METADATA:
+            value.metadata = parseMetadata(parser);
+            break;
+        case PARAM_BYTES:
+            value.trampoline = parseBytes(parser);
+            break;
+        case PARAM_UNKNOWN:
+            parseAndDiscardObject(parser);
+            break;
+    }
+    return value;
+}
+
+/*
+ * Add a parameter to a message.
+ */
+static void addParam(const Parser &parser, Message &msg, ParamName name,
+    ParamValue value)
+{
+    if (msg.num_params >= PARAM_MAX)
+        parse_error(parser, "failed to parse message; number of "
+            "parameters exceeds the maximum (%u)", PARAM_MAX);
+    msg.params[msg.num_params].name  = name;
+    msg.params[msg.num_params].value = value;
+    msg.num_params++;
+}
+
 /*
  * Parse a parameter object.
  */
@@ -939,158 +1395,12 @@ static void parseParams(Parser &parser, Message &msg)
         return;
     while (true)
     {
-        ParamName name = PARAM_UNKNOWN;
-        switch (parser.s[0])
-        {
-            case 'a':
-                if (strcmp(parser.s, "address") == 0)
-                    name = PARAM_ADDRESS;
-                else if (strcmp(parser.s, "absolute") == 0)
-                    name = PARAM_ABSOLUTE;
-                else if (strcmp(parser.s, "argv") == 0)
-                    name = PARAM_ARGV;
-                break;
-            case 'b':
-                if (strcmp(parser.s, "bytes") == 0)
-                    name = PARAM_BYTES;
-                break;
-            case 'f':
-                if (strcmp(parser.s, "filename") == 0)
-                    name = PARAM_FILENAME;
-                else if (strcmp(parser.s, "format") == 0)
-                    name = PARAM_FORMAT;
-                break;
-            case 'i':
-                if (strcmp(parser.s, "init") == 0)
-                    name = PARAM_INIT;
-                break;
-            case 'l':
-                if (strcmp(parser.s, "length") == 0)
-                    name = PARAM_LENGTH;
-                break;
-            case 'o':
-                if (strcmp(parser.s, "offset") == 0)
-                    name = PARAM_OFFSET;
-                break;
-            case 'p':
-                if (strcmp(parser.s, "protection") == 0)
-                    name = PARAM_PROTECTION;
-                break;
-            case 'm':
-                if (strcmp(parser.s, "metadata") == 0)
-                    name = PARAM_METADATA;
-                else if (strcmp(parser.s, "mode") == 0)
-                    name = PARAM_MODE;
-                else if (strcmp(parser.s, "mmap") == 0)
-                    name = PARAM_MMAP;
-                break;
-            case 'n':
-                if (strcmp(parser.s, "name") == 0)
-                    name = PARAM_NAME;
-                break;
-            case 't':
-                if (strcmp(parser.s, "trampoline") == 0)
-                    name = PARAM_TRAMPOLINE;
-                else if (strcmp(parser.s, "template") == 0)
-                    name = PARAM_TEMPLATE;
-                break;
-        }
+        ParamName name = getParamName(parser.s);
         expectToken(parser, ':');
         if (!validateParam(msg.method, name))
             parseAndDiscardObject(parser);
         else
-        {
-            ParamValue value;
-            value.string = nullptr;
-            switch (name)
-            {
-                case PARAM_ADDRESS:
-                case PARAM_OFFSET:
-                case PARAM_LENGTH:
-                case PARAM_INIT:
-                case PARAM_MMAP:
-                    token = expectToken2(parser, TOKEN_NUMBER, TOKEN_STRING);
-                    if (token == TOKEN_NUMBER)
-                        value.integer = (intptr_t)parser.i;
-                    else
-                        value.integer = stringToNumber(parser);
-                    break;
-                case PARAM_ABSOLUTE:
-                    expectToken(parser, TOKEN_BOOL);
-                    value.boolean = parser.b;
-                    break;
-                case PARAM_ARGV:
-                    value.strings = parseStrings(parser, "<option>");
-                    break;
-                case PARAM_FILENAME:
-                case PARAM_NAME:
-                case PARAM_TRAMPOLINE:
-                    expectToken(parser, TOKEN_STRING);
-                    value.string = dupString(parser.s);
-                    break;
-                case PARAM_TEMPLATE:
-                    value.trampoline = parseTrampoline(parser, /*debug=*/true);
-                    break;
-                case PARAM_METADATA:
-                    value.metadata = parseMetadata(parser);
-                    break;
-                case PARAM_PROTECTION:
-                {
-                    expectToken(parser, TOKEN_STRING);
-                    int prot = PROT_NONE;
-                    prot |= parseProtection(parser, 0, 'r', PROT_READ);
-                    prot |= parseProtection(parser, 1, 'w', PROT_WRITE);
-                    prot |= parseProtection(parser, 2, 'x', PROT_EXEC);
-                    if (parser.s[3] != '\0')
-                        parse_error(parser, "failed to parse protection "
-                            "string \"%s\"; string length must be 3",
-                            parser.s, parser.s[0]);
-                    value.integer = (intptr_t)prot;
-                    break;
-                }
-                case PARAM_BYTES:
-                    value.trampoline = parseBytes(parser);
-                    break;
-                case PARAM_FORMAT:
-                    expectToken(parser, TOKEN_STRING);
-                    if (strcmp(parser.s, "binary") == 0)
-                        value.integer = (intptr_t)FORMAT_BINARY;
-                    else if (strcmp(parser.s, "patch") == 0)
-                        value.integer = (intptr_t)FORMAT_PATCH;
-                    else if (strcmp(parser.s, "patch.gz") == 0)
-                        value.integer = (intptr_t)FORMAT_PATCH_GZ;
-                    else if (strcmp(parser.s, "patch.bz2") == 0)
-                        value.integer = (intptr_t)FORMAT_PATCH_BZIP2;
-                    else if (strcmp(parser.s, "patch.xz") == 0)
-                        value.integer = (intptr_t)FORMAT_PATCH_XZ;
-                    else
-                        parse_error(parser, "failed to parse format string "
-                            "\"%s\"; expected one of {\"binary\", \"patch\", "
-                            "\"patch.gz\", \"patch.bz2\", \"patch.xz\"}",
-                            parser.s);
-                    break;
-                case PARAM_MODE:
-                    expectToken(parser, TOKEN_STRING);
-                    if (strcmp(parser.s, "exe") == 0)
-                        value.integer = (intptr_t)MODE_EXECUTABLE;
-                    else if (strcmp(parser.s, "dso") == 0)
-                        value.integer = (intptr_t)MODE_SHARED_OBJECT;
-                    else
-                        parse_error(parser, "failed to parse mode string "
-                            "\"%s\"; expected one of {\"exe\", \"dso\"}",
-                            parser.s);
-                    break;
-                case PARAM_UNKNOWN:
-                    parseAndDiscardObject(parser);
-                    break;
-            }
-            if (msg.num_params >= PARAM_MAX)
-                parse_error(parser, "failed to parse JSON message; number of "
-                    "parameters exceeds the maximum (%u)", PARAM_MAX);
-            msg.params[msg.num_params].name  = name;
-            msg.params[msg.num_params].value = value;
-            msg.num_params++;
-        }
+            addParam(parser, msg, name, parseValue(parser, name));
         token = expectToken2(parser, '}', ',');
         if (token == '}')
             return;
@@ -1100,6 +1410,289 @@ static void parseParams(Parser &parser, Message &msg)
     }
 }
 
+/*
+ * The (optional) binary message encoding.  Each message is a frame of the
+ * form:
+ *
+ *      0xE9 SIZE ID METHOD NUM_PARAMS (NAME VALUE)*
+ *
+ * where SIZE (the number of bytes following SIZE) and ID are 32-bit
+ * little-endian integers, and NUM_PARAMS is a single byte.  METHOD and
+ * NAME are strings, and VALUE is one of:
+ *
+ *      'I' INT64                   Integer (little-endian)
+ *      'B' BYTE                    Boolean
+ *      'S' LEN32 BYTES             String (interned)
+ *      'R' IDX32                   Reference to an interned string
+ *      'X' LEN32 BYTES             Raw byte blob
+ *      'J' LEN32 BYTES             Value encoded as JSON text
+ *
+ * Every 'S' string is appended to a stream-wide table, so that later frames
+ * can refer to it by index.  Binary frames can be freely mixed with JSON
+ * messages, but are only accepted after the "binary" message has
+ * negotiated the binary encoding.
+ */
+#define WIRE_MAGIC          0xE9
+#define WIRE_INTEGER        'I'
+#define WIRE_BOOL           'B'
+#define WIRE_STRING         'S'
+#define WIRE_STRING_REF     'R'
+#define WIRE_BLOB           'X'
+#define WIRE_JSON           'J'
+
+static Encoding encoding = ENCODING_JSON;
+
+/*
+ * Interned wire string.
+ */
+struct WireString
+{
+    const char *str;                    // String value
+    Method method;                      // String as a method
+    ParamName name;                     // String as a parameter name
+};
+static std::deque<WireString> wire_strings;
+
+/*
+ * Decoded wire value.
+ */
+struct WireValue
+{
+    char tag = '\0';                    // Value tag
+    int64_t integer = 0;                // Integer/boolean value
+    const WireString *string = nullptr; // String value
+    const uint8_t *data = nullptr;      // Blob/JSON value
+    uint32_t len = 0;                   // Blob/JSON length
+};
+
+/*
+ * Binary frame reader.
+ */
+struct WireReader
+{
+    const Parser &parser;               // Parser (for error reporting)
+    const uint8_t *ptr;                 // Current position
+    const uint8_t *end;                 // Frame end
+
+    WireReader(const Parser &parser, const uint8_t *ptr, size_t size) :
+        parser(parser), ptr(ptr), end(ptr + size)
+    {
+        ;
+    }
+
+    const uint8_t *get(size_t len)
+    {
+        if ((size_t)(end - ptr) < len)
+            parse_error(parser, "failed to parse binary message; frame is "
+                "truncated");
+        const uint8_t *data = ptr;
+        ptr += len;
+        return data;
+    }
+
+    uint8_t getU8()
+    {
+        return *get(sizeof(uint8_t));
+    }
+
+    uint32_t getU32()
+    {
+        const uint8_t *data = get(sizeof(uint32_t));
+        return (uint32_t)data[0] | (uint32_t)data[1] << 8 |
+            (uint32_t)data[2] << 16 | (uint32_t)data[3] << 24;
+    }
+
+    int64_t getI64()
+    {
+        const uint8_t *data = get(sizeof(uint64_t));
+        uint64_t x = 0;
+        for (unsigned i = 0; i < sizeof(uint64_t); i++)
+            x |= (uint64_t)data[i] << (8 * i);
+        return (int64_t)x;
+    }
+};
+
+/*
+ * Create a single-entry BYTES trampoline.
+ */
+Trampoline *makeBytesTrampoline(const uint8_t *data, size_t len)
+{
+    std::vector<uint8_t> bytes(data, data + len);
+    uint8_t *ptr = new uint8_t[sizeof(Trampoline) + sizeof(Entry)];
+    Trampoline *T  = (Trampoline *)ptr;
+    T->prot        = PROT_READ | PROT_EXEC;
+    T->num_entries = 1;
+    T->preload     = false;
+    T->entries[0]  = makeBytesEntry(bytes);
+    return T;
+}
+
+/*
+ * Read a wire string.
+ */
+static const WireString *getWireString(WireReader &reader, char tag)
+{
+    switch (tag)
+    {
+        case WIRE_STRING:
+        {
+            uint32_t len = reader.getU32();
+            const char *data = (const char *)reader.get(len);
+            std::string tmp(data, len);
+            if (tmp.size() != strlen(tmp.c_str()))
+                parse_error(reader.parser, "failed to parse binary message; "
+                    "string contains a nul character");
+            WireString ws;
+            ws.str    = dupString(tmp.c_str());
+            ws.method = getMethod(ws.str);
+            ws.name   = getParamName(ws.str);
+            wire_strings.push_back(ws);
+            return &wire_strings.back();
+        }
+        case WIRE_STRING_REF:
+        {
+            uint32_t idx = reader.getU32();
+            if (idx >= wire_strings.size())
+                parse_error(reader.parser, "failed to parse binary message; "
+                    "string index %u is out-of-range (0..%zu)", idx,
+                    wire_strings.size());
+            return &wire_strings[idx];
+        }
+        default:
+            parse_error(reader.parser, "failed to parse binary message; "
+                "expected string, found tag 0x%.2X", (unsigned)(uint8_t)tag);
+    }
+}
+
+/*
+ * Read a wire value.
+ */
+static void getWireValue(WireReader &reader, WireValue &value)
+{
+    value.tag = (char)reader.getU8();
+    switch (value.tag)
+    {
+        case WIRE_INTEGER:
+            value.integer = reader.getI64();
+            break;
+        case WIRE_BOOL:
+            value.integer = (int64_t)reader.getU8();
+            break;
+        case WIRE_STRING: case WIRE_STRING_REF:
+            value.string = getWireString(reader, value.tag);
+            break;
+        case WIRE_BLOB: case WIRE_JSON:
+            value.len  = reader.getU32();
+            value.data = reader.get(value.len);
+            break;
+        default:
+            parse_error(reader.parser, "failed to parse binary message; "
+                "unknown value tag 0x%.2X", (unsigned)(uint8_t)value.tag);
+    }
+}
+
+/*
+ * Convert a wire value into a parameter value.
+ */
+static ParamValue convertWireValue(const Parser &parser, ParamName name,
+    const WireValue &wval)
+{
+    ParamValue value;
+    value.string = nullptr;
+    switch (wval.tag)
+    {
+        case WIRE_INTEGER:
+            switch (name)
+            {
+                case PARAM_ADDRESS: case PARAM_OFFSET: case PARAM_LENGTH:
+                case PARAM_INIT: case PARAM_MMAP:
+                    value.integer = wval.integer;
+                    return value;
+                default:
+                    break;
+            }
+            break;
+        case WIRE_BOOL:
+            if (name != PARAM_ABSOLUTE)
+                break;
+            value.boolean = (wval.integer != 0);
+            return value;
+        case WIRE_STRING: case WIRE_STRING_REF:
+            switch (name)
+            {
+                case PARAM_FILENAME: case PARAM_NAME: case PARAM_TRAMPOLINE:
+                    value.string = wval.string->str;
+                    return value;
+                default:
+                    return parseStringValue(parser, name, wval.string->str);
+            }
+        case WIRE_BLOB:
+            if (name != PARAM_BYTES)
+                break;
+            value.trampoline = makeBytesTrampoline(wval.data, wval.len);
+            return value;
+        case WIRE_JSON:
+        {
+            Input input((const char *)wval.data, wval.len);
+            Parser sub(input, parser.lineno);
+            value = parseValue(sub, name);
+            expectToken(sub, EOF);
+            return value;
+        }
+    }
+    parse_error(parser, "failed to parse binary message; unexpected value "
+        "tag `%c' for parameter", wval.tag);
+}
+
+/*
+ * Parse a binary message frame.
+ */
+static bool getBinaryMessage(Parser &parser, Message &msg)
+{
+    if (encoding != ENCODING_BINARY)
+        parse_error(parser, "failed to parse message; binary message "
+            "encoding has not been negotiated");
+
+    static std::vector<uint8_t> tmp;
+    const uint8_t *hdr = parser.input.get(sizeof(uint32_t), tmp);
+    if (hdr == nullptr)
+    {
+        if (parser.pipe)
+            exit(EXIT_FAILURE);
+        parse_error(parser, "failed to read binary message header");
+    }
+    WireReader hdr_reader(parser, hdr, sizeof(uint32_t));
+    uint32_t size = hdr_reader.getU32();
+    const uint8_t *frame = parser.input.get(size, tmp);
+    if (frame == nullptr)
+    {
+        if (parser.pipe)
+            exit(EXIT_FAILURE);
+        parse_error(parser, "failed to read binary message of size %u",
+            size);
+    }
+
+    WireReader reader(parser, frame, size);
+    msg.id     = reader.getU32();
+    msg.method = getWireString(reader, (char)reader.getU8())->method;
+    msg.lineno = parser.lineno;
+    msg.num_params = 0;
+    unsigned num_params = reader.getU8();
+    for (unsigned i = 0; i < num_params; i++)
+    {
+        ParamName name = getWireString(reader, (char)reader.getU8())->name;
+        WireValue wval;
+        getWireValue(reader, wval);
+        if (!validateParam(msg.method, name))
+            continue;
+        addParam(parser, msg, name, convertWireValue(parser, name, wval));
+    }
+    if (reader.ptr != reader.end)
+        parse_error(parser, "failed to parse binary message; %zu trailing "
+            "byte(s) in frame", (size_t)(reader.end - reader.ptr));
+    return true;
+}
+
 /*
  * Convert a method into a string for error reporting.
  */
@@ -1123,11 +1716,16 @@ const char *getMethodString(Method method)
 }
 
 /*
- * Parse a message from the given stream.
+ * Parse a message using the given parser.
  */
-bool getMessage(FILE *stream, size_t lineno, Message &msg)
+static bool getMessage(Parser &parser, Message &msg)
 {
-    Parser parser(stream, lineno);
+    char c;
+    while (isspace(c = parser.getc()))
+        ;
+    if (c == (char)WIRE_MAGIC)
+        return getBinaryMessage(parser, msg);
+    parser.ungetc(c);
 
     char token = expectToken2(parser, '{', EOF);
     if (token == EOF)
@@ -1139,38 +1737,7 @@ bool getMessage(FILE *stream, size_t lineno, Message &msg)
     expectString(parser, "method");
     expectToken(parser, ':');
     expectToken(parser, TOKEN_STRING);
-    msg.method = METHOD_UNKNOWN;
-    switch (parser.s[0])
-    {
-        case 'b':
-            if (strcmp(parser.s, "binary") == 0)
-                msg.method = METHOD_BINARY;
-            break;
-        case 'e':
-            if (strcmp(parser.s, "emit") == 0)
-                msg.method = METHOD_EMIT;
-            break;
-        case 'i':
-            if (strcmp(parser.s, "instruction") == 0)
-                msg.method = METHOD_INSTRUCTION;
-            break;
-        case 'o':
-            if (strcmp(parser.s, "options") == 0)
-                msg.method = METHOD_OPTIONS;
-            break;
-        case 'p':
-            if (strcmp(parser.s, "patch") == 0)
-                msg.method = METHOD_PATCH;
-            break;
-        case 'r':
-            if (strcmp(parser.s, "reserve") == 0)
-                msg.method = METHOD_RESERVE;
-            break;
-        case 't':
-            if (strcmp(parser.s, "trampoline") == 0)
-                msg.method = METHOD_TRAMPOLINE;
-            break;
-    }
+    msg.method = getMethod(parser.s);
     expectToken(parser, ',');
     expectString(parser, "params");
     expectToken(parser, ':');
@@ -1182,6 +1749,75 @@ bool getMessage(FILE *stream, size_t lineno, Message &msg)
     msg.lineno = parser.lineno;
     msg.id = parser.i;
     expectToken(parser, '}');
+
+    if (msg.method == METHOD_BINARY)
+    {
+        for (unsigned i = 0; i < msg.num_params; i++)
+        {
+            if (msg.params[i].name == PARAM_ENCODING)
+                encoding = (Encoding)msg.params[i].value.integer;
+        }
+    }
     return true;
 }
 
+/*
+ * Parse a message from the given stream.
+ */
+bool getMessage(FILE *stream, size_t lineno, Message &msg)
+{
+    static Input input;
+    if (input.stream != stream)
+        input.open(stream);
+    Parser parser(input, lineno);
+    return getMessage(parser, msg);
+}
+
+/*
+ * Parse a message from the given shared-memory ring.
+ */
+bool getMessage(RingReader *ring, size_t lineno, Message &msg)
+{
+    static Input input;
+    if (input.ring != ring)
+        input.open(ring);
+    Parser parser(input, lineno);
+    return getMessage(parser, msg);
+}
+
+/*
+ * Parse a message from buf[pos..len), and advance `pos' past the message.
+ */
+bool getMessage(const char *buf, size_t len, size_t &pos, size_t lineno,
+    Message &msg)
+{
+    Input input(buf, len);
+    input.pos = pos;
+    Parser parser(input, lineno);
+    bool result = getMessage(parser, msg);
+    pos = input.pos;
+    return result;
+}
+
+/*
+ * Parse a parameter value from a JSON fragment, e.g., a trampoline template
+ * or metadata object.
+ */
+ParamValue getParamValue(ParamName name, const char *json, size_t len)
+{
+    Input input(json, len);
+    Parser parser(input, 1);
+    ParamValue value = parseValue(parser, name);
+    expectToken(parser, EOF);
+    return value;
+}
+
+/*
+ * Convert a string parameter value, e.g., a mode or format string.
+ */
+ParamValue getParamValue(ParamName name, const char *str)
+{
+    Input input;
+    Parser parser(input, 1);
+    return parseStringValue(parser, name, str);
+}
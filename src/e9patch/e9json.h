@@ -49,6 +49,7 @@ enum ParamName
     PARAM_ADDRESS,
     PARAM_ARGV,
     PARAM_BYTES,
+    PARAM_ENCODING,
     PARAM_FILENAME,
     PARAM_FORMAT,
     PARAM_INIT,
@@ -72,7 +73,17 @@ enum Format
     FORMAT_PATCH,
     FORMAT_PATCH_GZ,
     FORMAT_PATCH_BZIP2,
-    FORMAT_PATCH_XZ
+    FORMAT_PATCH_XZ,
+    FORMAT_PATCH_E9D
+};
+
+/*
+ * Supported message encodings.
+ */
+enum Encoding
+{
+    ENCODING_JSON,
+    ENCODING_BINARY
 };
 
 /*
@@ -111,6 +122,12 @@ struct Message
 };
 
 bool getMessage(FILE *stream, size_t lineno, Message &msg);
+bool getMessage(struct RingReader *ring, size_t lineno, Message &msg);
+bool getMessage(const char *buf, size_t len, size_t &pos, size_t lineno,
+    Message &msg);
+ParamValue getParamValue(ParamName name, const char *json, size_t len);
+ParamValue getParamValue(ParamName name, const char *str);
+Trampoline *makeBytesTrampoline(const uint8_t *data, size_t len);
 const char *getMethodString(Method method);
 
 #endif
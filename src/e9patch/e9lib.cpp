@@ -0,0 +1,261 @@
+/*
+ * e9lib.cpp
+ * Copyright (C) 2021 National University of Singapore
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The struct-based messages are converted into the same `Message'
+ * representation produced by the JSON-RPC parser, and are then handled by
+ * parseMessage().  Thus the library and the e9patch program share all
+ * message validation and semantics.
+ */
+
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+#include <string>
+
+#include <unistd.h>
+
+#include "e9api.h"
+#include "e9json.h"
+#include "e9lib.h"
+#include "e9patch.h"
+
+static Binary *B   = nullptr;           // The binary (if any).
+static unsigned id = 0;                 // Message ID.
+static size_t lineno = 1;               // JSON-RPC line number.
+static clock_t start = 0;               // Start time.
+
+/*
+ * Add a parameter to a message.
+ */
+static void addParam(Message &msg, ParamName name, ParamValue value)
+{
+    msg.params[msg.num_params].name  = name;
+    msg.params[msg.num_params].value = value;
+    msg.num_params++;
+}
+
+/*
+ * Add an integer parameter to a message.
+ */
+static void addInteger(Message &msg, ParamName name, intptr_t x)
+{
+    ParamValue value;
+    value.integer = (int64_t)x;
+    addParam(msg, name, value);
+}
+
+/*
+ * Initialize a message.
+ */
+static void initMessage(Message &msg, Method method)
+{
+    msg.method     = method;
+    msg.lineno     = lineno;
+    msg.id         = id++;
+    msg.num_params = 0;
+}
+
+/*
+ * Initialize the backend.
+ */
+void e9lib::init(int argc, char * const argv[])
+{
+    start = clock();
+    stat_start_time = getWallTime();
+
+    option_is_tty = (isatty(STDERR_FILENO) != 0);
+    if (getenv("E9PATCH_TTY") != nullptr)
+        option_is_tty = true;
+    if (getenv("E9PATCH_DEBUG") != nullptr)
+        option_debug = true;
+
+    parseOptions(argc, argv);
+    if (option_input != "-" || option_output != "-")
+        error("failed to initialize backend library; the `--input' and "
+            "`--output' options are not supported");
+}
+
+/*
+ * Send a "binary" message.
+ */
+void e9lib::binary(const BinaryMessage &bmsg)
+{
+    Message msg;
+    initMessage(msg, METHOD_BINARY);
+    addParam(msg, PARAM_FILENAME,
+        getParamValue(PARAM_FILENAME, bmsg.filename));
+    addParam(msg, PARAM_MODE, getParamValue(PARAM_MODE, bmsg.mode));
+    B = parseMessage(B, msg);
+}
+
+/*
+ * Send an "instruction" message.
+ */
+void e9lib::instruction(const InstructionMessage &imsg)
+{
+    Message msg;
+    initMessage(msg, METHOD_INSTRUCTION);
+    addInteger(msg, PARAM_ADDRESS, imsg.address);
+    addInteger(msg, PARAM_LENGTH, (intptr_t)imsg.length);
+    addInteger(msg, PARAM_OFFSET, (intptr_t)imsg.offset);
+    B = parseMessage(B, msg);
+}
+
+/*
+ * Send a "patch" message.
+ */
+void e9lib::patch(const PatchMessage &pmsg)
+{
+    Message msg;
+    initMessage(msg, METHOD_PATCH);
+    ParamValue value;
+    value.string = pmsg.trampoline;
+    addParam(msg, PARAM_TRAMPOLINE, value);
+    addInteger(msg, PARAM_OFFSET, (intptr_t)pmsg.offset);
+    if (pmsg.metadata != nullptr)
+    {
+        std::string json("{");
+        for (unsigned i = 0; pmsg.metadata[i].name != nullptr; i++)
+        {
+            json += (i > 0? ",\"$": "\"$");
+            json += pmsg.metadata[i].name;
+            json += "\":[";
+            const char *data = pmsg.metadata[i].data;
+            size_t len = strlen(data);
+            while (len > 0 && isspace(data[len-1]))
+                len--;
+            if (len > 0 && data[len-1] == ',')
+                len--;
+            json.append(data, len);
+            json += ']';
+        }
+        json += '}';
+        addParam(msg, PARAM_METADATA,
+            getParamValue(PARAM_METADATA, json.c_str(), json.size()));
+    }
+    B = parseMessage(B, msg);
+}
+
+/*
+ * Send a "trampoline" message.
+ */
+void e9lib::trampoline(const TrampolineMessage &tmsg)
+{
+    Message msg;
+    initMessage(msg, METHOD_TRAMPOLINE);
+    addParam(msg, PARAM_NAME, getParamValue(PARAM_NAME, tmsg.name));
+    addParam(msg, PARAM_TEMPLATE,
+        getParamValue(PARAM_TEMPLATE, tmsg.templ, strlen(tmsg.templ)));
+    B = parseMessage(B, msg);
+}
+
+/*
+ * Send a "reserve" message.
+ */
+void e9lib::reserve(const ReserveMessage &rmsg)
+{
+    Message msg;
+    initMessage(msg, METHOD_RESERVE);
+    addInteger(msg, PARAM_ADDRESS, rmsg.address);
+    if (rmsg.absolute)
+    {
+        ParamValue value;
+        value.boolean = true;
+        addParam(msg, PARAM_ABSOLUTE, value);
+    }
+    if (rmsg.bytes != nullptr)
+    {
+        ParamValue value;
+        value.trampoline = makeBytesTrampoline(rmsg.bytes, rmsg.length);
+        addParam(msg, PARAM_BYTES, value);
+    }
+    else
+        addInteger(msg, PARAM_LENGTH, (intptr_t)rmsg.length);
+    if (rmsg.protection != nullptr)
+        addParam(msg, PARAM_PROTECTION,
+            getParamValue(PARAM_PROTECTION, rmsg.protection));
+    if (rmsg.init != 0)
+        addInteger(msg, PARAM_INIT, rmsg.init);
+    if (rmsg.mmap != 0)
+        addInteger(msg, PARAM_MMAP, rmsg.mmap);
+    B = parseMessage(B, msg);
+}
+
+/*
+ * Send an "emit" message.
+ */
+void e9lib::emit(const EmitMessage &emsg)
+{
+    Message msg;
+    initMessage(msg, METHOD_EMIT);
+    addParam(msg, PARAM_FILENAME,
+        getParamValue(PARAM_FILENAME, emsg.filename));
+    addParam(msg, PARAM_FORMAT, getParamValue(PARAM_FORMAT, emsg.format));
+    B = parseMessage(B, msg);
+}
+
+/*
+ * Send an "options" message.
+ */
+void e9lib::options(char * const argv[])
+{
+    size_t argc;
+    for (argc = 0; argv[argc] != nullptr; argc++)
+        ;
+    char **args = new char *[argc + 2];
+    args[0] = strdup("<option>");
+    for (size_t i = 0; i < argc; i++)
+        args[i+1] = strdup(argv[i]);
+    args[argc+1] = nullptr;
+
+    Message msg;
+    initMessage(msg, METHOD_OPTIONS);
+    ParamValue value;
+    value.strings = args;
+    addParam(msg, PARAM_ARGV, value);
+    B = parseMessage(B, msg);
+}
+
+/*
+ * Send JSON-RPC messages.
+ */
+void e9lib::messages(const char *json, size_t len)
+{
+    size_t pos = 0;
+    Message msg;
+    while (getMessage(json, len, pos, lineno, msg))
+    {
+        B = parseMessage(B, msg);
+        lineno = msg.lineno;
+    }
+}
+
+/*
+ * Finalize the backend.
+ */
+void e9lib::fini()
+{
+    if (B == nullptr)
+        return;
+    printStats(B, clock() - start);
+    fflush(stdout);
+}
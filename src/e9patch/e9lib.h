@@ -0,0 +1,150 @@
+/*
+ * e9lib.h
+ * Copyright (C) 2021 National University of Singapore
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __E9LIB_H
+#define __E9LIB_H
+
+/*
+ * libe9patch: the E9Patch backend as a static library.
+ *
+ * Each function corresponds to one message of the JSON-RPC interface (see
+ * the e9patch-programming-guide), but takes the message parameters as a
+ * struct rather than as serialized text.  This lets a frontend run the
+ * backend in-process without a pipe or a separate e9patch process.
+ *
+ * String parameters use the same values as the JSON-RPC interface (e.g.,
+ * "exe"/"dso" for the mode).  Trampoline templates and metadata are given
+ * as JSON fragments in the usual template syntax.  As with the e9patch
+ * program, all errors are fatal.
+ *
+ * This header is self-contained, and does not depend on any of the backend
+ * internals.
+ */
+
+#include <cstddef>
+#include <cstdint>
+
+#include <sys/types.h>
+
+namespace e9lib
+{
+
+/*
+ * A "binary" message.
+ */
+struct BinaryMessage
+{
+    const char *filename;               // Input binary
+    const char *mode;                   // "exe" or "dso"
+};
+
+/*
+ * An "instruction" message.
+ */
+struct InstructionMessage
+{
+    intptr_t address;                   // Instruction address
+    size_t length;                      // Instruction length
+    off_t offset;                       // Instruction file offset
+};
+
+/*
+ * A "patch" message metadata entry.
+ */
+struct MetadataEntry
+{
+    const char *name;                   // Macro name (without the `$')
+    const char *data;                   // Macro template (JSON array
+                                        // elements)
+};
+
+/*
+ * A "patch" message.
+ */
+struct PatchMessage
+{
+    const char *trampoline;             // Trampoline name
+    off_t offset;                       // Instruction file offset
+    const MetadataEntry *metadata;      // Metadata (nullptr name terminated)
+                                        // or nullptr
+};
+
+/*
+ * A "trampoline" message.
+ */
+struct TrampolineMessage
+{
+    const char *name;                   // Trampoline name
+    const char *templ;                  // Trampoline template (JSON array)
+};
+
+/*
+ * A "reserve" message.  If `bytes' is nullptr, then `length' bytes of
+ * address space are reserved, else `bytes[0..length)' is loaded at the
+ * reserved address.
+ */
+struct ReserveMessage
+{
+    intptr_t address;                   // Reserved address
+    bool absolute;                      // Address is absolute?
+    const uint8_t *bytes;               // Reserved bytes (or nullptr)
+    size_t length;                      // Reserved length
+    const char *protection;             // Protections (or nullptr), e.g.,
+                                        // "r-x"
+    intptr_t init;                      // Initialization function (or 0)
+    intptr_t mmap;                      // mmap() replacement (or 0)
+};
+
+/*
+ * An "emit" message.
+ */
+struct EmitMessage
+{
+    const char *filename;               // Output filename
+    const char *format;                 // "binary", "patch", "patch.gz", ...
+};
+
+/*
+ * Initialize the backend with the e9patch command-line options.
+ */
+extern void init(int argc, char * const argv[]);
+
+/*
+ * Send a message to the backend.
+ */
+extern void binary(const BinaryMessage &msg);
+extern void instruction(const InstructionMessage &msg);
+extern void patch(const PatchMessage &msg);
+extern void trampoline(const TrampolineMessage &msg);
+extern void reserve(const ReserveMessage &msg);
+extern void emit(const EmitMessage &msg);
+extern void options(char * const argv[]);
+
+/*
+ * Send all JSON-RPC messages in json[0..len) to the backend.
+ */
+extern void messages(const char *json, size_t len);
+
+/*
+ * Finalize the backend and print the statistics (if any).
+ */
+extern void fini();
+
+}   // namespace e9lib
+
+#endif
@@ -32,6 +32,7 @@
 #include <dirent.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/ucontext.h>
 #include <unistd.h>
 
 #include "e9loader.h"
@@ -43,6 +44,16 @@
 #define STRING_2(x) #x
 
 #define BUFSIZ      8192
+#define PAGE_SIZE   4096
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+#ifndef SA_RESTORER
+#define SA_RESTORER 0x04000000
+#endif
+
+#define LAZY_FD_MIN 1000            // Below the default RLIMIT_NOFILE (1024)
 
 static NO_INLINE int e9binary(char *path_buf);
 
@@ -50,11 +61,14 @@ extern const char mapsname[];
 extern const char maps_err_str[];
 extern const char open_err_str[];
 extern const char mmap_err_str[];
+extern const char sigaction_err_str[];
 extern const char common_err_str[];
 
 extern "C"
 {
     int e9entry(void);
+    int e9lazy(const E9LazyTable *table, int fd, intptr_t base);
+    void e9restore(void);
     NO_INLINE NO_RETURN void e9error(const char *err_str, int err);
 }
 
@@ -116,6 +130,7 @@ asm (
     "\tsubq %rdx,%r12\n"                    // ELF base into %r12
     "\tmov $9, %r13d\n"                     // SYS_MMAP into %r13
     "\tleaq .LMMAP_ERROR(%rip), %r14\n"     // mmap error handler into %r14
+    "\tleaq e9lazy(%rip), %rax\n"           // Lazy loading setup into %rax
 
     // (4) jump to stage #2
     // Stage #2 will be placed at the end of the (.text) section.
@@ -150,6 +165,12 @@ asm (
     ".ascii \"map file \\\"%s\\\" (errno=%d)\\n\"\n"
     ".byte 0x00\n"
 
+    ".globl sigaction_err_str\n"
+    ".type sigaction_err_str,@function\n"
+    "sigaction_err_str:\n"
+    ".ascii \"install SIGSEGV handler for \\\"%s\\\" (errno=%d)\\n\"\n"
+    ".byte 0x00\n"
+
     ".globl common_err_str\n"
     ".type common_err_str,@function\n" 
     "common_err_str:\n"
@@ -165,6 +186,14 @@ asm (
     "\tneg %rsi\n"
     "\tjmp e9error\n"
 
+    /*
+     * Signal return trampoline (for the lazy loading SIGSEGV handler).
+     */
+    ".globl e9restore\n"
+    ".type e9restore,@function\n"
+    "e9restore:\n"
+    "\tmov $15, %eax\n"                     // SYS_RT_SIGRETURN
+    "\tsyscall\n"
 );
 
 static int e9open(const char *filename_0, int flags_0, int mode_0)
@@ -255,6 +284,99 @@ static int e9close(int fd_0)
     return (int)err;
 }
 
+static intptr_t e9mmap(intptr_t addr_0, size_t len_0, int prot_0,
+    int flags_0, int fd_0, off_t offset_0)
+{
+    register uintptr_t addr asm("rdi")   = (uintptr_t)addr_0;
+    register uintptr_t len asm("rsi")    = (uintptr_t)len_0;
+    register uintptr_t prot asm("rdx")   = (uintptr_t)prot_0;
+    register uintptr_t flags asm("r10")  = (uintptr_t)flags_0;
+    register uintptr_t fd asm("r8")      = (uintptr_t)fd_0;
+    register uintptr_t offset asm("r9")  = (uintptr_t)offset_0;
+    register intptr_t result asm("rax");
+
+    asm volatile (
+        "mov $9, %%eax\n\t"             // SYS_MMAP
+        "syscall"
+        : "=rax"(result) : "r"(addr), "r"(len), "r"(prot), "r"(flags),
+            "r"(fd), "r"(offset) : "rcx", "r11", "memory");
+
+    return result;
+}
+
+static int e9munmap(intptr_t addr_0, size_t len_0)
+{
+    register uintptr_t addr asm("rdi") = (uintptr_t)addr_0;
+    register uintptr_t len asm("rsi")  = (uintptr_t)len_0;
+    register intptr_t err asm("rax");
+
+    asm volatile (
+        "mov $11, %%eax\n\t"            // SYS_MUNMAP
+        "syscall"
+        : "=rax"(err) : "r"(addr), "r"(len) : "rcx", "r11");
+
+    return (int)err;
+}
+
+static int e9mprotect(intptr_t addr_0, size_t len_0, int prot_0)
+{
+    register uintptr_t addr asm("rdi") = (uintptr_t)addr_0;
+    register uintptr_t len asm("rsi")  = (uintptr_t)len_0;
+    register uintptr_t prot asm("rdx") = (uintptr_t)prot_0;
+    register intptr_t err asm("rax");
+
+    asm volatile (
+        "mov $10, %%eax\n\t"            // SYS_MPROTECT
+        "syscall"
+        : "=rax"(err) : "r"(addr), "r"(len), "r"(prot) : "rcx", "r11");
+
+    return (int)err;
+}
+
+/*
+ * Kernel sigaction structure.
+ */
+struct ksigaction
+{
+    void *handler;
+    unsigned long flags;
+    void (*restorer)(void);
+    uint64_t mask;
+};
+
+static int e9sigaction(int sig_0, const struct ksigaction *act_0,
+    struct ksigaction *oldact_0)
+{
+    register uintptr_t sig asm("rdi")    = (uintptr_t)sig_0;
+    register uintptr_t act asm("rsi")    = (uintptr_t)act_0;
+    register uintptr_t oldact asm("rdx") = (uintptr_t)oldact_0;
+    register uintptr_t size asm("r10")   = sizeof(act_0->mask);
+    register intptr_t err asm("rax");
+
+    asm volatile (
+        "mov $13, %%eax\n\t"            // SYS_RT_SIGACTION
+        "syscall"
+        : "=rax"(err) : "r"(sig), "r"(act), "r"(oldact), "r"(size)
+        : "rcx", "r11", "memory");
+
+    return (int)err;
+}
+
+static int e9fcntl(int fd_0, int cmd_0, int arg_0)
+{
+    register uintptr_t fd asm("rdi")  = (uintptr_t)fd_0;
+    register uintptr_t cmd asm("rsi") = (uintptr_t)cmd_0;
+    register uintptr_t arg asm("rdx") = (uintptr_t)arg_0;
+    register intptr_t err asm("rax");
+
+    asm volatile (
+        "mov $72, %%eax\n\t"            // SYS_FCNTL
+        "syscall"
+        : "=rax"(err) : "r"(fd), "r"(cmd), "r"(arg) : "rcx", "r11");
+
+    return (int)err;
+}
+
 /*
  * Convert a number into a string.
  */
@@ -423,3 +545,188 @@ int e9entry(void)
     return fd;
 }
 
+
+/*
+ * Lazy loading state.  The state is stored in a read-only page that begins
+ * with a stub that passes the state to the SIGSEGV handler.
+ */
+struct E9LazyState
+{
+    uint8_t stub[32];                   // Handler stub
+    const E9LazyTable *table;           // Lazy loading table
+    intptr_t base;                      // ELF base
+    int fd;                             // Binary fd
+    struct ksigaction old;              // Old SIGSEGV action
+};
+
+/*
+ * Find the lazy mapping that contains `addr' (or nullptr).
+ */
+static const E9LazyMap *e9lazyfind(const E9LazyMap *maps, size_t num,
+    intptr_t addr)
+{
+    size_t lo = 0, hi = num;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        const E9LazyMap *map = maps + mid;
+        if (addr < map->addr)
+            hi = mid;
+        else if (addr >= map->addr + (intptr_t)map->len)
+            lo = mid + 1;
+        else
+            return map;
+    }
+    return nullptr;
+}
+
+/*
+ * The lazy loading SIGSEGV handler.  Accesses to a reserved (PROT_NONE)
+ * lazy mapping are handled by mapping the corresponding part of the binary,
+ * and restarting the faulting instruction.  All other faults are passed to
+ * the old SIGSEGV action.
+ */
+extern "C" void e9lazyfault(int sig, siginfo_t *info, void *ctx_0,
+    const E9LazyState *state)
+{
+    const ucontext_t *ctx = (const ucontext_t *)ctx_0;
+    const E9LazyTable *table = state->table;
+    intptr_t addr = (intptr_t)info->si_addr, base = 0;
+    const E9LazyMap *map = nullptr;
+    if (info->si_code == SEGV_ACCERR)
+    {
+        map = e9lazyfind(table->maps, table->num_relative,
+            addr - state->base);
+        if (map != nullptr)
+            base = state->base;
+        else
+            map = e9lazyfind(table->maps + table->num_relative,
+                table->num_absolute, addr);
+    }
+    if (map != nullptr)
+    {
+        // Check the access is permitted by the mapping (else the fault
+        // would simply repeat):
+        const uint64_t PF_WRITE = 0x2, PF_INSTR = 0x10;
+        uint64_t err = (uint64_t)ctx->uc_mcontext.gregs[REG_ERR];
+        if ((err & PF_WRITE) != 0 ||
+                (map->prot & ((err & PF_INSTR) != 0? PROT_EXEC: PROT_READ))
+                    == 0)
+            map = nullptr;
+    }
+    if (map != nullptr)
+    {
+        intptr_t addr = map->addr + base;
+        intptr_t result = e9mmap(addr, map->len, map->prot,
+            MAP_PRIVATE | MAP_FIXED, state->fd, map->offset);
+        if (result != addr)
+            e9error(mmap_err_str, (int)-result);
+        return;
+    }
+
+    // Not a lazy mapping:
+    const struct ksigaction *old = &state->old;
+    if (old->handler == (void *)SIG_DFL || old->handler == (void *)SIG_IGN)
+    {
+        // Restore the default action, and the fault will repeat:
+        struct ksigaction dfl = {(void *)SIG_DFL, 0, nullptr, 0};
+        (void)e9sigaction(SIGSEGV, &dfl, nullptr);
+    }
+    else if ((old->flags & SA_SIGINFO) != 0)
+        ((void (*)(int, siginfo_t *, void *))old->handler)(sig, info, ctx_0);
+    else
+        ((void (*)(int))old->handler)(sig);
+}
+
+/*
+ * Reserve (PROT_NONE) the address ranges of maps[lo..hi).  The whole span,
+ * including any gaps, is reserved with a single call if it is free.  Else
+ * the span is split, so that only the mappings themselves are reserved
+ * around any existing mapping.
+ */
+static void e9reserve(const E9LazyMap *maps, size_t lo, size_t hi,
+    intptr_t base)
+{
+    const int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+    intptr_t addr = maps[lo].addr + base;
+    intptr_t end  = maps[hi-1].addr + (intptr_t)maps[hi-1].len + base;
+    if (hi - lo > 1)
+    {
+        // Note: older kernels treat MAP_FIXED_NOREPLACE as a hint.
+        intptr_t result = e9mmap(addr, end - addr, PROT_NONE,
+            flags | MAP_FIXED_NOREPLACE, -1, 0);
+        if (result == addr)
+            return;
+        if (result < -PAGE_SIZE || result >= 0)
+            (void)e9munmap(result, end - addr);
+        size_t mid = lo + (hi - lo) / 2;
+        e9reserve(maps, lo, mid, base);
+        e9reserve(maps, mid, hi, base);
+        return;
+    }
+    intptr_t result = e9mmap(addr, end - addr, PROT_NONE, flags | MAP_FIXED,
+        -1, 0);
+    if (result != addr)
+        e9error(mmap_err_str, (int)-result);
+}
+
+/*
+ * Setup lazy loading.  Called by stage #2 of the loader.
+ */
+int e9lazy(const E9LazyTable *table, int fd, intptr_t base)
+{
+    // Step (0): The fd is kept open for the handler.  Move it to a high
+    //           number, so programs that close their (low) fds are less
+    //           likely to close it:
+    int hfd = e9fcntl(fd, F_DUPFD_CLOEXEC, LAZY_FD_MIN);
+    if (hfd >= 0)
+    {
+        e9close(fd);
+        fd = hfd;
+    }
+    else
+        (void)e9fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    // Step (1): Reserve the address ranges of the lazy mappings:
+    if (table->num_relative > 0)
+        e9reserve(table->maps, 0, table->num_relative, base);
+    if (table->num_absolute > 0)
+        e9reserve(table->maps + table->num_relative, 0,
+            table->num_absolute, 0);
+
+    // Step (2): Create the state & handler stub:
+    intptr_t result = e9mmap(0x0, PAGE_SIZE, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (result < 0 && result > -PAGE_SIZE)
+        e9error(mmap_err_str, (int)-result);
+    E9LazyState *state = (E9LazyState *)result;
+    uint8_t *stub = state->stub;
+    intptr_t handler = (intptr_t)&e9lazyfault;
+    // lea -7(%rip),%rcx   # State into %rcx (4th argument)
+    *stub++ = 0x48; *stub++ = 0x8d; *stub++ = 0x0d;
+    *stub++ = 0xf9; *stub++ = 0xff; *stub++ = 0xff; *stub++ = 0xff;
+    // movabs $handler,%rax
+    *stub++ = 0x48; *stub++ = 0xb8;
+    for (unsigned i = 0; i < sizeof(handler); i++)
+        *stub++ = (uint8_t)(handler >> (8 * i));
+    // jmpq *%rax
+    *stub++ = 0xff; *stub++ = 0xe0;
+    state->table = table;
+    state->base  = base;
+    state->fd    = fd;
+
+    // Step (3): Install the SIGSEGV handler:
+    int err = e9sigaction(SIGSEGV, nullptr, &state->old);
+    if (err < 0)
+        e9error(sigaction_err_str, -err);
+    err = e9mprotect((intptr_t)state, PAGE_SIZE, PROT_READ | PROT_EXEC);
+    if (err < 0)
+        e9error(mmap_err_str, -err);
+    struct ksigaction act = {(void *)state->stub,
+        SA_SIGINFO | SA_ONSTACK | SA_NODEFER | SA_RESTORER, e9restore, 0};
+    err = e9sigaction(SIGSEGV, &act, nullptr);
+    if (err < 0)
+        e9error(sigaction_err_str, -err);
+
+    return fd;
+}
@@ -19,9 +19,35 @@
 #ifndef __E9LOADER_H
 #define __E9LOADER_H
 
+#include <cstdint>
+
 /*
  * Loader entry offset.
  */
 #define LOADER_OFFSET           sizeof(void *)
 
+/*
+ * Lazy loading (see `--lazy-loader').  The loader reserves the address
+ * ranges of the lazy mappings, and maps each mapping on the first access
+ * (via a SIGSEGV handler).
+ */
+struct E9LazyMap
+{
+    int64_t addr;                       // Address (base address)
+    int64_t offset;                     // File offset
+    uint32_t len;                       // Length
+    int32_t prot;                       // Protections
+};
+
+/*
+ * Lazy loading table.  The relative mappings are followed by the absolute
+ * mappings, and each is sorted by address.
+ */
+struct E9LazyTable
+{
+    uint64_t num_relative;              // Number of relative mappings
+    uint64_t num_absolute;              // Number of absolute mappings
+    E9LazyMap maps[];                   // The mappings
+};
+
 #endif
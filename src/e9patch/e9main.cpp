@@ -0,0 +1,316 @@
+/*
+ * e9main.cpp
+ * Copyright (C) 2021 National University of Singapore
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "e9api.h"
+#include "e9json.h"
+#include "e9patch.h"
+#include "e9ring.h"
+
+/*
+ * Attach to the frontend's shared-memory ring.
+ */
+static void openRing(RingReader &reader)
+{
+    struct stat buf;
+    if (fstat(option_ring_memfd, &buf) < 0)
+        error("failed to stat ring (%d): %s", option_ring_memfd,
+            strerror(errno));
+    size_t size = (size_t)buf.st_size;
+    if (size < sizeof(RingHeader))
+        error("failed to open ring (%d); ring is too small (%zu bytes)",
+            option_ring_memfd, size);
+    void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+        option_ring_memfd, 0);
+    if (ptr == MAP_FAILED)
+        error("failed to map ring (%d): %s", option_ring_memfd,
+            strerror(errno));
+    close(option_ring_memfd);
+    RingHeader *ring = (RingHeader *)ptr;
+    if (ring->magic != RING_MAGIC || ring->size == 0 ||
+            (ring->size & (ring->size - 1)) != 0 ||
+            ring->size > size - sizeof(RingHeader))
+        error("failed to open ring (%d); invalid ring header",
+            option_ring_memfd);
+    reader.ring     = ring;
+    reader.data_fd  = STDIN_FILENO;
+    reader.space_fd = option_ring_fd;
+}
+
+/*
+ * Read the next message from the input.
+ */
+static bool readMessage(RingReader &reader, size_t lineno, Message &msg)
+{
+    if (reader.ring != nullptr)
+        return getMessage(&reader, lineno, msg);
+    return getMessage(stdin, lineno, msg);
+}
+
+/*
+ * Bounded single-producer/single-consumer message queue used by the
+ * pipeline.  The fast path is lock-free.  A side only blocks (using the
+ * condition variable) once the queue has been empty/full for a while.
+ */
+#define QUEUE_SIZE          4096        // Queue capacity (2^n)
+#define QUEUE_SPIN          64          // Spins before blocking
+struct MessageQueue
+{
+    Message msgs[QUEUE_SIZE];                       // Messages
+    alignas(64) std::atomic<size_t> head{0};        // Push position
+    alignas(64) std::atomic<size_t> tail{0};        // Pop position
+    alignas(64) std::atomic<bool> closed{false};    // Reader done?
+    std::atomic<bool> waiting{false};               // A side is blocked?
+    std::mutex mutex;
+    std::condition_variable cond;
+
+    /*
+     * Wait until `ready()' holds.
+     */
+    template <typename Pred>
+    void wait(Pred ready)
+    {
+        for (unsigned i = 0; i < QUEUE_SPIN; i++)
+        {
+            if (ready())
+                return;
+            std::this_thread::yield();
+        }
+        std::unique_lock<std::mutex> guard(mutex);
+        waiting.store(true);
+        cond.wait(guard, ready);
+        waiting.store(false);
+    }
+
+    /*
+     * Wake up the other side (if it is blocked).
+     */
+    void signal()
+    {
+        if (waiting.load())
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            cond.notify_all();
+        }
+    }
+
+    void push(const Message &msg)
+    {
+        size_t h = head.load(std::memory_order_relaxed);
+        wait([&] { return h - tail.load() < QUEUE_SIZE; });
+        msgs[h & (QUEUE_SIZE - 1)] = msg;
+        head.store(h + 1);
+        signal();
+    }
+
+    bool pop(Message &msg)
+    {
+        size_t t = tail.load(std::memory_order_relaxed);
+        wait([&] { return head.load() != t || closed.load(); });
+        if (head.load() == t)
+            return false;               // Closed & empty
+        msg = msgs[t & (QUEUE_SIZE - 1)];
+        tail.store(t + 1);
+        signal();
+        return true;
+    }
+
+    void close()
+    {
+        closed.store(true);
+        signal();
+    }
+};
+
+/*
+ * The pipeline reader thread.  Message parsing does not depend on the
+ * patching state, so can run ahead of the patching thread.
+ */
+static void readMessages(RingReader *reader, MessageQueue *Q)
+{
+    Message msg;
+    size_t lineno = 1;
+    while (readMessage(*reader, lineno, msg))
+    {
+        lineno = msg.lineno;
+        Q->push(msg);
+    }
+    Q->close();
+}
+
+/*
+ * The real entry point.
+ */
+extern "C"
+{
+    int realMain(int argc, char **argv);
+};
+int realMain(int argc, char **argv)
+{
+    clock_t c0 = clock();
+    stat_start_time = getWallTime();
+
+    option_is_tty = (isatty(STDERR_FILENO) != 0);
+    if (getenv("E9PATCH_TTY") != nullptr)
+        option_is_tty = true;
+    if (getenv("E9PATCH_DEBUG") != nullptr)
+        option_debug = true;
+
+    parseOptions(argc, argv);
+
+    if (option_input != "-")
+    {
+        FILE *input = freopen(option_input.c_str(), "r", stdin);
+        if (input == nullptr)
+            error("failed to open file \"%s\" for reading: %s",
+                option_input.c_str(), strerror(errno));
+    }
+    if (option_output != "-")
+    {
+        FILE *output = freopen(option_output.c_str(), "w", stdout);
+        if (output == nullptr)
+            error("failed to open file \"%s\" for writing: %s",
+                option_output.c_str(), strerror(errno));
+    }
+    RingReader reader;
+    if (option_ring_memfd >= 0)
+        openRing(reader);
+    else if (isatty(STDIN_FILENO))
+        warning("reading JSON-RPC from a terminal (this is probably not "
+            "what you want, please use an E9PATCH frontend instead!)");
+    
+    Binary *B = nullptr;
+    Message msg;
+    if (option_pipeline)
+    {
+        static MessageQueue Q;
+        std::thread reader_thread(readMessages, &reader, &Q);
+        while (Q.pop(msg))
+            B = parseMessage(B, msg);
+        reader_thread.join();
+    }
+    else
+    {
+        size_t lineno = 1;
+        while (readMessage(reader, lineno, msg))
+        {
+            B = parseMessage(B, msg);
+            lineno = msg.lineno;
+        }
+    }
+    if (B == nullptr)
+        exit(EXIT_SUCCESS);
+
+    printStats(B, clock() - c0);
+
+    exit(EXIT_SUCCESS);
+}
+
+/*
+ * The initial entry point.
+ *
+ * This includes a test-suite for e9test.sh.  The test suite includes some
+ * jumps that are calculated dynamically, which is no problem for e9patch.
+ */
+asm (
+    /*
+     * Test #2: the jrcxz instruction:
+     */
+    ".Ltest_2:\n"
+    "xor %ecx,%ecx\n"
+    "inc %ecx\n"
+    ".Ljrcx_loop:\n"
+    "jrcxz .Lrcx_is_zero\n"
+    "dec %ecx\n"
+    "jmp .Ljrcx_loop\n"
+    ".Lrcx_is_zero:\n"
+    "jmp .Ltest_3\n"
+
+    /*
+     * Test #1: indirect jump that depends on argc:
+     */
+    ".Ltest_1:\n"
+    "mov %rdi,%r11\n"
+    "sar $48,%r11\n"
+    "lea (.Ltest_2-777)(%rip),%r10\n"
+    "lea 777(%r10,%r11,8),%r10\n"
+    "push %r10\n"
+    "ret\n"
+    "ud2\n"
+
+    /*
+     * Entry point:
+     */
+    ".globl main\n"
+    ".type main,@function\n"
+    "main:\n"
+    "test %rsi,%rsi\n"
+    "jz .Lskip_123\n"
+    "cmp $0xFFFF,%rdi\n"
+    "jb .Lskip_123\n"
+    "jmp .Ltest_1\n"
+    ".Lskip_123:\n"
+
+    /*
+     * Test #4: a semi-obsfuscated indirect jump to realMain().
+     */
+    ".Ltest_4:\n"
+    "nop\n"
+    "nop\n"
+    "nop\n"
+    "nop\n"
+    "nop\n"
+    "nop\n"
+    "movabs $(realMain-main)-0x14159265, %rax\n"
+    "leaq main+0x6b1db77(%rip), %rbp\n"
+    "leaq 0xd63b6ee(%rbp, %rax), %rax\n"
+    "jmpq *%rax\n"
+
+    /*
+     * Test #3: Dynamically calculated jump target:
+     */
+    ".Ltest_3:\n"
+    "leaq .Ltest_3(%rip),%r10\n"
+    "mov $(.Ltest_3-.Ltest_4)*(.Ltest_3-.Ltest_4),%rax\n"
+    "pxor %xmm0,%xmm0\n"
+    "cvtsi2ss %rax,%xmm0\n"
+    "sqrtss %xmm0,%xmm1\n"
+    "comiss %xmm1,%xmm1\n"
+    "cvttss2si %xmm1,%rax\n"
+    "neg %rax\n"
+    "lea 4(%r10,%rax),%rax\n"
+    "cmp $255,%rax\n"
+    "jle .Lskip\n"
+    "jmp *%rax\n"
+    ".Lskip:\n"
+);
+
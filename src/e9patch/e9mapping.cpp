@@ -30,10 +30,13 @@
 #include <cstring>
 #include <ctime>
 
+#include <vector>
+
 #include <sys/mman.h>
 
 #include "e9alloc.h"
 #include "e9mapping.h"
+#include "e9parallel.h"
 #include "e9patch.h"
 #include "e9trampoline.h"
 
@@ -560,7 +563,8 @@ static Radix::Node<Key> *merge(Radix::Node<Key> *tree, Key key,
         // Add to existing node for key:
         mapping->next = node->leaf.mappings;
         node->leaf.mappings = mapping;
-        putchar('+');
+        if (option_trace_progress)
+            putchar('+');
         return tree;
     }
 
@@ -578,9 +582,10 @@ static Radix::Node<Key> *merge(Radix::Node<Key> *tree, Key key,
             // Leaf node is now empty, so remove it.
             tree = remove(tree, node->key);
         }
-        printf("\33[32mM\33[0m");
+        if (option_trace_progress)
+            printf("\33[32mM\33[0m");
     }
-    else
+    else if (option_trace_progress)
         putchar('+');
 
     // Insert a new node:
@@ -601,9 +606,12 @@ static void collectMappings(Radix::Node<Key> *node, MappingSet &mappings)
         for (auto mapping = node->leaf.mappings; mapping != nullptr;
             mapping = mapping->next)
         {
-            std::string str;
-            bitstring(node->key, str);
-            printf("[\33[33m%s\33[0m]", str.c_str());
+            if (option_trace_progress)
+            {
+                std::string str;
+                bitstring(node->key, str);
+                printf("[\33[33m%s\33[0m]", str.c_str());
+            }
             insertMapping(mapping, mappings);
             stat_num_physical_mappings++;
         }
@@ -659,17 +667,31 @@ template <typename Key>
 void optimizeMappings(const Allocator &allocator, const size_t MAPPING_SIZE,
     MappingSet &mappings)
 {
+    // The occupancy keys are independent, so are calculated in parallel.
+    // The (greedy) merging is order dependent, so remains sequential.
+    std::vector<Mapping *> list(mappings.begin(), mappings.end());
+    std::vector<Key> keys(list.size());
+    parallelFor(list.size(), getEmitThreads(),
+        [&](size_t lb, size_t ub)
+        {
+            for (size_t i = lb; i < ub; i++)
+                keys[i] = calculateKey<Key>(allocator, MAPPING_SIZE, list[i]);
+        });
+
     Radix::Node<Key> *tree = nullptr;
-    for (auto mapping: mappings)
+    for (size_t i = 0; i < list.size(); i++)
     {
-        Key key = calculateKey<Key>(allocator, MAPPING_SIZE, mapping);
-        tree = merge(tree, key, mapping);
+        tree = merge(tree, keys[i], list[i]);
+        progress("optimizing mappings", i+1, list.size());
     }
-    putchar('\n');
+    progressDone();
+    if (option_trace_progress)
+        putchar('\n');
 
     mappings.clear();
     collectMappings(tree, mappings);
-    putchar('\n');
+    if (option_trace_progress)
+        putchar('\n');
 
     for (auto mapping: mappings)
         shrinkMapping(mapping);
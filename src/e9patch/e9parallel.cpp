@@ -0,0 +1,335 @@
+/*
+ * e9parallel.cpp
+ * Copyright (C) 2020 National University of Singapore
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Parallel patching.
+ *
+ * A batch of queued patches (in reverse address order) is split into N
+ * address windows of roughly equal size.  Each tactic only reads/writes the
+ * bytes within a short distance of the patched instruction, so two patches
+ * that are sufficiently far from a window boundary never interact with
+ * another window.  Such patches are applied concurrently by one worker per
+ * window (phase 1).  Each worker allocates trampolines from its own
+ * allocator shard, which is restricted to a disjoint range (stripe) of the
+ * free trampoline address space, so workers never need to synchronize.
+ *
+ * The remaining patches, i.e., those near a window boundary, and those that
+ * failed in phase 1 (e.g., because a punned jump target lies outside of the
+ * worker's stripe), are retried in further rounds, with the stripes rotated
+ * between windows after each round.  Whatever is left after N rounds is
+ * applied by the main thread using the merged main allocator (phase 2).
+ *
+ * Since the remaining patches are applied after some lower-address patches,
+ * any patch whose $continue lookahead reaches a still-queued instruction is
+ * applied with -Ojump-elim disabled, so its trampoline layout does not
+ * depend on whether that instruction is patched later.
+ *
+ * The result depends only on the batch and N, and never on thread timing,
+ * so the output is deterministic for a given N.
+ */
+
+#include <cassert>
+#include <cstdint>
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+#include "e9alloc.h"
+#include "e9parallel.h"
+#include "e9patch.h"
+#include "e9tactics.h"
+#include "e9trampoline.h"
+
+#define WINDOW_MIN          4096        // Minimum patches per window.
+
+/*
+ * Worker state.
+ */
+struct Worker
+{
+    const PatchEntry *entries = nullptr;// Window entries.
+    size_t num_entries = 0;             // Number of window entries.
+    uint8_t *done = nullptr;            // Window entry done flags.
+    intptr_t lb = 0;                    // Window interior lower bound.
+    intptr_t ub = 0;                    // Window interior upper bound.
+    intptr_t stripe_lb = 0;             // Trampoline stripe lower bound.
+    intptr_t stripe_ub = 0;             // Trampoline stripe upper bound.
+    const Allocator *parent = nullptr;  // Main allocator.
+    Allocator allocator;                // Allocator shard.
+
+    size_t num_patched = 0;             // Statistics...
+    size_t num_B1 = 0;
+    size_t num_B2 = 0;
+    size_t num_T1 = 0;
+    size_t num_T2 = 0;
+    size_t num_T3 = 0;
+    size_t num_layout_hits = 0;
+    size_t num_layout_misses = 0;
+    size_t num_pun_skips = 0;
+    size_t num_attempts[NUM_TACTICS] = {0};
+    size_t num_alloc_nodes_peak = 0;
+    size_t alloc_peak_bytes = 0;
+};
+
+/*
+ * Set the state of all instruction bytes.
+ */
+static void setState(Instr *I, uint8_t old_state, uint8_t new_state)
+{
+    for (unsigned i = 0; i < I->size; i++)
+    {
+        assert(I->patched.state[i] == old_state);
+        I->patched.state[i] = new_state;
+    }
+}
+
+/*
+ * Patch all interior entries of a window (phase 1).
+ */
+static void patchWindow(Worker *W)
+{
+    shardAllocator(*W->parent, W->allocator, W->stripe_lb, W->stripe_ub);
+
+    for (size_t i = 0; i < W->num_entries; i++)
+    {
+        Instr *I = W->entries[i].I;
+        if (W->done[i])
+            continue;                   // Patched in an earlier round
+        if (I->addr < W->lb || I->addr >= W->ub)
+            continue;                   // Near boundary, leave for phase 2
+        setState(I, STATE_QUEUED, STATE_INSTRUCTION);
+
+        // Entries are normally patched in reverse address order, so that the
+        // $continue lookahead sees the final state of the following
+        // instructions.  If a following instruction is still queued (near a
+        // boundary, or failed earlier), then it may be patched later, so
+        // disable -Ojump-elim for I to keep its trampoline layout stable:
+        bool save = (bool)I->no_optimize;
+        if (isContinueQueued(I))
+            I->no_optimize = true;
+        if (patch(W->allocator, I, W->entries[i].T, /*retry=*/true))
+        {
+            W->done[i] = true;
+            W->num_patched++;
+        }
+        else
+        {
+            I->no_optimize = save;
+            setState(I, STATE_INSTRUCTION, STATE_QUEUED);
+        }
+    }
+
+    // Statistics are thread-local, so hand them back to the main thread:
+    W->num_B1            = stat_num_B1;
+    W->num_B2            = stat_num_B2;
+    W->num_T1            = stat_num_T1;
+    W->num_T2            = stat_num_T2;
+    W->num_T3            = stat_num_T3;
+    W->num_layout_hits   = stat_num_layout_hits;
+    W->num_layout_misses = stat_num_layout_misses;
+    W->num_pun_skips     = stat_num_pun_skips;
+    W->num_alloc_nodes_peak = stat_num_alloc_nodes_peak;
+    W->alloc_peak_bytes     = stat_alloc_peak_bytes;
+    std::copy(stat_num_attempts, stat_num_attempts + NUM_TACTICS,
+        W->num_attempts);
+}
+
+/*
+ * Split the free space of `allocator` within [lb..ub) into `n` stripes with
+ * (roughly) the same amount of free space.  The stripe bounds are stored in
+ * `bounds` (n+1 entries).
+ */
+static void splitFreeSpace(const Allocator &allocator, intptr_t lb,
+    intptr_t ub, unsigned n, std::vector<intptr_t> &bounds)
+{
+    std::vector<std::pair<intptr_t, intptr_t>> gaps;
+    intptr_t curr = lb;
+    for (auto i = allocator.begin(), iend = allocator.end(); i != iend; ++i)
+    {
+        const Alloc *A = *i;
+        if (A->ub <= curr)
+            continue;
+        if (A->lb >= ub)
+            break;
+        if (A->lb > curr)
+            gaps.push_back({curr, A->lb});
+        curr = A->ub;
+    }
+    if (curr < ub)
+        gaps.push_back({curr, ub});
+
+    size_t total = 0;
+    for (const auto &f: gaps)
+        total += (size_t)(f.second - f.first);
+
+    bounds.push_back(lb);
+    size_t sum = 0;
+    unsigned k = 1;
+    for (const auto &f: gaps)
+    {
+        size_t len = (size_t)(f.second - f.first);
+        for (; k < n && sum + len >= (total / n) * k; k++)
+        {
+            intptr_t cut = f.first + (intptr_t)((total / n) * k - sum);
+            cut -= cut % (intptr_t)PAGE_SIZE;
+            bounds.push_back(std::max(cut, bounds.back()));
+        }
+        sum += len;
+    }
+    for (; k < n; k++)
+        bounds.push_back(ub);
+    bounds.push_back(ub);
+}
+
+/*
+ * Patch a batch of entries (in reverse address order) using multiple
+ * threads.
+ */
+void patchParallel(Binary *B, const std::vector<PatchEntry> &batch)
+{
+    size_t n = batch.size();
+    if (n == 0)
+        return;
+    std::vector<uint8_t> done(n, false);
+
+    unsigned num_workers = (unsigned)std::min((size_t)option_threads,
+        n / WINDOW_MIN);
+    if (num_workers > 1)
+    {
+        // The guard distance must cover the furthest any tactic (including
+        // the $continue lookahead) reads or writes from a patch location.
+        const intptr_t guard = 2 * (/*max short jmp=*/INT8_MAX + 2 +
+            /*max instruction size=*/15 + /*a bit extra=*/32) +
+            (intptr_t)option_Ojump_elim_size;
+
+        // Step (1): Find the trampoline address space reachable from the
+        // entire batch:
+        intptr_t addr_lo = batch.back().I->addr;
+        intptr_t addr_hi = batch.front().I->addr;
+        intptr_t lb = std::max(option_mem_lb,
+            addr_hi + (intptr_t)PAGE_SIZE - (intptr_t)INT32_MAX);
+        intptr_t ub = std::min(option_mem_ub,
+            addr_lo + (intptr_t)INT32_MAX - TRAMPOLINE_MAX);
+        if (lb >= ub)
+        {
+            lb = option_mem_lb;
+            ub = option_mem_ub;
+        }
+
+        // Step (2): Split the batch into windows & patch concurrently.  This
+        // is repeated N times, rotating the stripes between windows, so
+        // that each window gets a chance at every part of the address space:
+        for (unsigned r = 0; r < num_workers; r++)
+        {
+            std::vector<intptr_t> stripes;
+            splitFreeSpace(B->allocator, lb, ub, num_workers, stripes);
+
+            std::vector<Worker> workers(num_workers);
+            std::vector<std::thread> threads;
+            for (unsigned k = 0; k < num_workers; k++)
+            {
+                size_t i = (n * k) / num_workers;
+                size_t j = (n * (k+1)) / num_workers;
+                unsigned s = (k + r) % num_workers;
+                Worker &W = workers[k];
+                W.entries     = batch.data() + i;
+                W.num_entries = j - i;
+                W.done        = done.data() + i;
+                W.ub          = (k == 0? INTPTR_MAX:
+                    batch[i-1].I->addr - guard);
+                W.lb          = (k == num_workers-1? INTPTR_MIN:
+                    batch[j-1].I->addr + guard);
+                W.stripe_lb   = stripes[s];
+                W.stripe_ub   = stripes[s+1];
+                W.parent      = &B->allocator;
+                threads.emplace_back(patchWindow, &W);
+            }
+            for (auto &thread: threads)
+                thread.join();
+
+            // Step (3): Merge the results.  The shard allocators exist at
+            // the same time (until the end of the round), so their peaks
+            // are summed:
+            size_t num_alloc_nodes = 0, alloc_bytes = 0;
+            for (auto &W: workers)
+            {
+                mergeAllocator(B->allocator, W.allocator);
+                stat_num_patched       += W.num_patched;
+                stat_num_B1            += W.num_B1;
+                stat_num_B2            += W.num_B2;
+                stat_num_T1            += W.num_T1;
+                stat_num_T2            += W.num_T2;
+                stat_num_T3            += W.num_T3;
+                stat_num_layout_hits   += W.num_layout_hits;
+                stat_num_layout_misses += W.num_layout_misses;
+                stat_num_pun_skips     += W.num_pun_skips;
+                for (unsigned k = 0; k < NUM_TACTICS; k++)
+                    stat_num_attempts[k] += W.num_attempts[k];
+                num_alloc_nodes += W.num_alloc_nodes_peak;
+                alloc_bytes     += W.alloc_peak_bytes;
+            }
+            stat_num_alloc_nodes_peak = std::max(stat_num_alloc_nodes_peak,
+                stat_num_alloc_nodes + num_alloc_nodes);
+            stat_alloc_parallel_peak_bytes =
+                std::max(stat_alloc_parallel_peak_bytes,
+                    stat_alloc_peak_bytes + alloc_bytes);
+            progress("patching", stat_num_patched + stat_num_failed, 0);
+        }
+    }
+
+    // Step (4): Patch the remaining entries (phase 2):
+    for (size_t i = 0; i < n; i++)
+    {
+        if (done[i])
+            continue;
+        Instr *I = batch[i].I;
+        setState(I, STATE_QUEUED, STATE_INSTRUCTION);
+        if (patch(B->allocator, I, batch[i].T))
+            stat_num_patched++;
+        else
+            stat_num_failed++;
+        progress("patching", stat_num_patched + stat_num_failed, 0);
+    }
+}
+
+/*
+ * Call func(lb, ub) for disjoint ranges [lb..ub) covering [0..n), using up
+ * to `num_threads' threads (including the calling thread).  The func must
+ * only write state that is private to its range.
+ */
+void parallelFor(size_t n, unsigned num_threads,
+    const std::function<void(size_t, size_t)> &func)
+{
+    size_t num_chunks = std::max((size_t)1, std::min((size_t)num_threads, n));
+    std::vector<std::thread> threads;
+    for (size_t k = 1; k < num_chunks; k++)
+        threads.emplace_back(func, (n * k) / num_chunks,
+            (n * (k+1)) / num_chunks);
+    func(0, n / num_chunks);
+    for (auto &thread: threads)
+        thread.join();
+}
+
+/*
+ * Get the number of threads used to emit the binary.
+ */
+unsigned getEmitThreads()
+{
+    return (option_emit_threads == 0? option_threads: option_emit_threads);
+}
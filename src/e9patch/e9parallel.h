@@ -0,0 +1,32 @@
+/*
+ * e9parallel.h
+ * Copyright (C) 2020 National University of Singapore
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __E9PARALLEL_H
+#define __E9PARALLEL_H
+
+#include <functional>
+#include <vector>
+
+#include "e9patch.h"
+
+void patchParallel(Binary *B, const std::vector<PatchEntry> &batch);
+void parallelFor(size_t n, unsigned num_threads,
+    const std::function<void(size_t, size_t)> &func);
+unsigned getEmitThreads();
+
+#endif
@@ -16,10 +16,15 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <cctype>
+#include <cerrno>
 #include <cstdio>
 #include <cstdlib>
 
+#include <algorithm>
+
 #include <getopt.h>
+#include <sys/resource.h>
 #include <unistd.h>
 
 #include "e9api.h"
@@ -49,34 +54,76 @@ intptr_t option_mem_loader      =  0x20e9e9000;
 size_t option_mem_mapping_size  = PAGE_SIZE;
 bool option_mem_multi_page      = true;
 bool option_static_loader       = false;
+bool option_lazy_loader         = false;
+unsigned option_static_trampolines = 0;
 std::set<intptr_t> option_trap;
+std::unordered_set<intptr_t> option_hot;
 bool option_trap_all            = false;
 bool option_trap_entry          = false;
-static std::string option_input("-");
-static std::string option_output("-");
+bool option_trace_progress      = false;
+bool option_progress            = false;
+unsigned option_threads         = 1;
+unsigned option_emit_threads    = 0;
+bool option_emit_mmap           = true;
+std::string option_input("-");
+std::string option_output("-");
+std::string option_stats_json;
+bool option_pipeline            = false;
+int option_ring_memfd           = -1;
+int option_ring_fd              = -1;
 
 /*
  * Global statistics.
  */
 size_t stat_num_patched = 0;
 size_t stat_num_failed  = 0;
-size_t stat_num_B1 = 0;
-size_t stat_num_B2 = 0;
-size_t stat_num_T1 = 0;
-size_t stat_num_T2 = 0;
-size_t stat_num_T3 = 0;
+thread_local size_t stat_num_B1 = 0;
+thread_local size_t stat_num_B2 = 0;
+thread_local size_t stat_num_T1 = 0;
+thread_local size_t stat_num_T2 = 0;
+thread_local size_t stat_num_T3 = 0;
+thread_local size_t stat_num_attempts[NUM_TACTICS] = {0};
+size_t stat_num_failed_disabled = 0;
+size_t stat_num_failed_jump     = 0;
+size_t stat_num_failed_short    = 0;
+thread_local size_t stat_num_layout_hits   = 0;
+thread_local size_t stat_num_layout_misses = 0;
+thread_local size_t stat_num_pun_skips     = 0;
+thread_local size_t stat_num_alloc_nodes      = 0;
+thread_local size_t stat_num_alloc_nodes_peak = 0;
+thread_local size_t stat_alloc_peak_bytes     = 0;
+size_t stat_alloc_parallel_peak_bytes         = 0;
 size_t stat_num_virtual_mappings  = 0;
 size_t stat_num_physical_mappings = 0;
 size_t stat_num_virtual_bytes  = 0;
 size_t stat_num_physical_bytes = 0;
 size_t stat_input_file_size  = 0;
 size_t stat_output_file_size = 0;
+size_t stat_num_loader_mmaps = 0;
+size_t stat_num_loader_mmaps_unplanned = 0;
+size_t stat_num_loader_lazy = 0;
+size_t stat_num_loader_segments = 0;
+PhaseTime stat_phase_time[PHASE_MAX];
+double stat_start_time = 0.0;
+
+/*
+ * The innermost phase timer.
+ */
+static thread_local PhaseTimer *phase_timer = nullptr;
+
+/*
+ * Progress line state.
+ */
+static size_t progress_calls  = 0;
+static double progress_time   = 0.0;
+static bool   progress_active = false;
 
 /*
  * Report an error and exit.
  */
 void NO_RETURN error(const char *msg, ...)
 {
+    progressDone();
     fprintf(stderr, "%serror%s: ",
         (option_is_tty? "\33[31m": ""),
         (option_is_tty? "\33[0m" : ""));
@@ -96,6 +143,7 @@ void NO_RETURN error(const char *msg, ...)
  */
 void warning(const char *msg, ...)
 {
+    progressDone();
     fprintf(stderr, "%swarning%s: ",
         (option_is_tty? "\33[33m": ""),
         (option_is_tty? "\33[0m" : ""));
@@ -125,6 +173,92 @@ void debugImpl(const char *msg, ...)
     putc('\n', stderr);
 }
 
+/*
+ * Redraw the progress line (at most every PROGRESS_INTERVAL seconds).
+ */
+void progressImpl(const char *what, size_t n, size_t total)
+{
+    const size_t PROGRESS_CALLS = 256;
+    const double PROGRESS_INTERVAL = 0.1;
+    if (progress_calls++ % PROGRESS_CALLS != 0 && n != total)
+        return;
+    double now = getWallTime();
+    if (now - progress_time < PROGRESS_INTERVAL && n != total)
+        return;
+    progress_time = now;
+    if (total == 0)
+        fprintf(stderr, "\r\33[K%s: %zu", what, n);
+    else
+        fprintf(stderr, "\r\33[K%s: %zu / %zu (%.0f%%)", what, n, total,
+            (double)n / (double)total * 100.0);
+    progress_active = true;
+}
+
+/*
+ * Clear the progress line (if any).
+ */
+void progressDone()
+{
+    if (!progress_active)
+        return;
+    fputs("\r\33[K", stderr);
+    progress_active = false;
+    progress_calls  = 0;
+    progress_time   = 0.0;
+}
+
+/*
+ * Get the wall-clock time (in seconds).
+ */
+double getWallTime()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1.0e9;
+}
+
+/*
+ * Get the CPU time of all threads (in seconds).
+ */
+double getCPUTime()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1.0e9;
+}
+
+/*
+ * Phase timer.
+ */
+PhaseTimer::PhaseTimer(Phase phase, bool cpu) :
+    phase(phase), cpu(cpu), parent(phase_timer)
+{
+    if (parent != nullptr)
+        parent->stop();
+    phase_timer = this;
+    start();
+}
+PhaseTimer::~PhaseTimer()
+{
+    stop();
+    phase_timer = parent;
+    if (parent != nullptr)
+        parent->start();
+}
+void PhaseTimer::start()
+{
+    wall0 = getWallTime();
+    cpu0  = (cpu? getCPUTime(): 0.0);
+}
+void PhaseTimer::stop()
+{
+    stat_phase_time[phase].wall += getWallTime() - wall0;
+    if (cpu)
+        stat_phase_time[phase].cpu += getCPUTime() - cpu0;
+    else
+        stat_phase_time[phase].partial = true;
+}
+
 /*
  * Parse an integer from an optarg.
  */
@@ -164,6 +298,78 @@ static bool parseBoolOptArg(const char *option, const char *optarg)
         "expected a Boolean [true, false]", option, optarg);
 }
 
+/*
+ * Load a hotness profile.  The profile is a plain text file where each line
+ * is of the form "ADDR COUNT", meaning that the instruction at (ELF virtual)
+ * address ADDR was executed COUNT times.  Blank lines and lines beginning
+ * with '#' are ignored.  The hottest instructions accounting for
+ * PROFILE_COVERAGE% of all executions are added to `option_hot'.
+ */
+#define PROFILE_COVERAGE    99
+static void loadProfile(const char *filename)
+{
+    FILE *stream = fopen(filename, "r");
+    if (stream == nullptr)
+        error("failed to open profile \"%s\" for reading: %s", filename,
+            strerror(errno));
+
+    std::vector<std::pair<size_t, intptr_t>> profile;
+    size_t total = 0, lineno = 0;
+    char line[BUFSIZ];
+    while (fgets(line, sizeof(line), stream) != nullptr)
+    {
+        lineno++;
+        char *s = line;
+        while (isspace(*s))
+            s++;
+        if (*s == '\0' || *s == '#')
+            continue;
+        char *end = nullptr;
+        errno = 0;
+        intptr_t addr = (intptr_t)strtoll(s, &end, 0);
+        if (errno != 0 || end == s || !isspace(*end))
+            error("failed to parse profile \"%s\" at line %zu; expected "
+                "an address", filename, lineno);
+        s = end;
+        errno = 0;
+        size_t count = (size_t)strtoull(s, &end, 10);
+        if (errno != 0 || end == s)
+            error("failed to parse profile \"%s\" at line %zu; expected "
+                "an execution count", filename, lineno);
+        while (isspace(*end))
+            end++;
+        if (*end != '\0')
+            error("failed to parse profile \"%s\" at line %zu; unexpected "
+                "trailing characters", filename, lineno);
+        if (count == 0)
+            continue;
+        profile.push_back({count, addr});
+        total += count;
+    }
+    fclose(stream);
+
+    std::sort(profile.begin(), profile.end(),
+        [](const std::pair<size_t, intptr_t> &a,
+           const std::pair<size_t, intptr_t> &b)
+        {
+            return (a.first != b.first? a.first > b.first:
+                a.second < b.second);
+        });
+    option_hot.clear();
+    size_t limit = (total / 100) * PROFILE_COVERAGE +
+        ((total % 100) * PROFILE_COVERAGE) / 100;
+    size_t sum = 0;
+    for (const auto &entry: profile)
+    {
+        if (sum >= limit)
+            break;
+        option_hot.insert(entry.second);
+        sum += entry.first;
+    }
+    debug("loaded profile \"%s\" (%zu instructions, %zu hot)", filename,
+        profile.size(), option_hot.size());
+}
+
 /*
  * Usage.
  */
@@ -192,6 +398,16 @@ static void usage(FILE *stream, const char *progname)
         "\t\tThis can boost -Ojump-peephole.\n"
         "\t\tDefault: false (disabled)\n"
         "\n"
+        "\t-Oprofile=FILE\n"
+        "\t\tUse the hotness profile FILE to guide trampoline placement.\n"
+        "\t\tEach line of FILE is of the form \"ADDR COUNT\", meaning the\n"
+        "\t\tinstruction at (ELF virtual) address ADDR was executed COUNT\n"
+        "\t\ttimes.  Trampolines for the hottest instructions (covering\n"
+        "\t\t99%% of all executions) are packed into a small contiguous\n"
+        "\t\tregion, and all other trampolines are placed elsewhere.  This\n"
+        "\t\tcan reduce iTLB and i-cache misses.\n"
+        "\t\tDefault: none (disabled)\n"
+        "\n"
         "\t-Oscratch-stack[=false]\n"
         "\t\tAllow the stack to be used as scratch space.  This allows\n"
         "\t\tfaster code to be emitted, but may break transparency.\n"
@@ -200,15 +416,60 @@ static void usage(FILE *stream, const char *progname)
         "\t--debug\n"
         "\t\tEnable debug log messages.\n"
         "\n"
+        "\t--emit-mmap[=false]\n"
+        "\t\tEnable [disable] writing the output binary through a memory\n"
+        "\t\tmapping of the output file.  If enabled, the trampolines are\n"
+        "\t\twritten directly into the output file, and the unmodified\n"
+        "\t\tparts of the input binary are copied using copy_file_range().\n"
+        "\t\tThis is only used for regular output files.\n"
+        "\t\tDefault: true (enabled)\n"
+        "\n"
+        "\t--emit-threads=N\n"
+        "\t\tFlatten the trampoline mappings into the output binary using\n"
+        "\t\tN threads.  N=0 means use the same number of threads as\n"
+        "\t\t--threads.  This does not affect the output.\n"
+        "\t\tDefault: 0\n"
+        "\n"
         "\t--help, -h\n"
         "\t\tPrint this help message.\n"
         "\n"
         "\t--input FILE, -i FILE\n"
         "\t\tRead input from FILE instead of stdin.\n"
         "\n"
+        "\t--lazy-loader[=false]\n"
+        "\t\tEnable [disable] the lazy loading of trampoline pages.  If\n"
+        "\t\tenabled, the loader only reserves the address ranges of the\n"
+        "\t\t(non-writable) trampoline mappings, and each mapping is\n"
+        "\t\tloaded on first access via a SIGSEGV handler.  This reduces\n"
+        "\t\tstartup time for large binaries where most trampolines are\n"
+        "\t\tnever executed.  Preloaded mappings, and mappings loaded by\n"
+        "\t\ta user mmap() function, are always loaded eagerly.  The\n"
+        "\t\tprogram must not replace the SIGSEGV handler without\n"
+        "\t\tchaining to the old handler, must not block SIGSEGV in\n"
+        "\t\tany thread (else the kernel kills the program on the first\n"
+        "\t\taccess to an unloaded page), and must not close the\n"
+        "\t\tloader's file descriptor for the binary (1000 or above if\n"
+        "\t\tpossible), e.g., by closing all file descriptors as some\n"
+        "\t\tdaemons do.  If there are too many\n"
+        "\t\tmappings (more than 16384), then all mappings are loaded\n"
+        "\t\teagerly.\n"
+        "\t\tDefault: false (disabled)\n"
+        "\n"
         "\t--output FILE, -o FILE\n"
         "\t\tWrite output to FILE instead of stdout.\n"
         "\n"
+        "\t--pipeline[=false]\n"
+        "\t\tEnable [disable] the message pipeline.  If enabled, messages\n"
+        "\t\tare read and parsed by a separate reader thread, concurrently\n"
+        "\t\twith patching.  The output is the same as without the\n"
+        "\t\tpipeline.\n"
+        "\t\tDefault: false (disabled)\n"
+        "\n"
+        "\t--ring MEMFD,FD\n"
+        "\t\tRead input from the shared-memory ring MEMFD, using stdin\n"
+        "\t\tas the data doorbell and FD as the space doorbell.  This\n"
+        "\t\toption is intended to be used by frontends.\n"
+        "\n"
         "\t--mem-granularity=SIZE\n"
         "\t\tSet SIZE to be the granularity used for the physical page\n"
         "\t\tgrouping memory optimization.  Higher values result in\n"
@@ -248,6 +509,25 @@ static void usage(FILE *stream, const char *progname)
         "\t\tHowever, this can also bloat patched binary size.\n"
         "\t\tDefault: false (disabled)\n"
         "\n"
+        "\t--static-trampolines=N\n"
+        "\t\tLoad up to N trampoline mappings as PT_LOAD segments, i.e.,\n"
+        "\t\tthe mappings are loaded by the kernel rather than by the\n"
+        "\t\tloader.  This requires a new program header table, which is\n"
+        "\t\tappended to the binary.  If all mappings are loaded this\n"
+        "\t\tway, and there are no initialization routines, then the\n"
+        "\t\tloader is omitted entirely.  Only mappings at non-negative\n"
+        "\t\taddresses that do not overlap the original segments are\n"
+        "\t\teligible.  This is only supported for executables.\n"
+        "\t\tDefault: 0 (disabled)\n"
+        "\n"
+        "\t--stats-json=FILE\n"
+        "\t\tAlso write the final statistics to FILE in JSON format.  This\n"
+        "\t\tincludes the wall-clock and CPU time of each phase, the peak\n"
+        "\t\tresident set size, and the per-tactic attempt counts.  The\n"
+        "\t\tCPU time of the patch and parse phases is omitted in\n"
+        "\t\tsequential mode (--threads=1), since patching is interleaved\n"
+        "\t\twith parsing.\n"
+        "\n"
         "\t--tactic-B1[=false]\n"
         "\t--tactic-B2[=false]\n"
         "\t--tactic-T1[=false]\n"
@@ -260,6 +540,26 @@ static void usage(FILE *stream, const char *progname)
         "\t\tEnable [disables] backward jumps for tactic T3.\n"
         "\t\tDefault: true (enabled)\n"
         "\n"
+        "\t--threads=N\n"
+        "\t\tPatch using N worker threads.  The patch set is split into\n"
+        "\t\tN address windows that are patched concurrently, each with\n"
+        "\t\tits own trampoline address range.  Patches near a window\n"
+        "\t\tboundary, or that cannot be placed within a worker's range,\n"
+        "\t\tare patched afterwards by the main thread.  The output is\n"
+        "\t\tdeterministic for a given N, but may differ from N=1.\n"
+        "\t\tSee also --emit-threads.\n"
+        "\t\tDefault: 1\n"
+        "\n"
+        "\t--trace-progress[=false]\n"
+        "\t\tEnable [disable] the per-instruction and per-mapping\n"
+        "\t\tprogress trace on stdout, i.e., one (colored) character per\n"
+        "\t\tpatched instruction ('.' success, 'X' failure) and per\n"
+        "\t\tmapping ('+' new, 'M' merged), and the occupancy bitstring\n"
+        "\t\tof each optimized mapping.  This is intended for debugging,\n"
+        "\t\tand is slow for large binaries.  Otherwise, a periodic\n"
+        "\t\tprogress line is shown on stderr (TTY only).\n"
+        "\t\tDefault: false (disabled)\n"
+        "\n"
         "\t--trap=ADDR\n"
         "\t\tInsert a trap (int3) instruction at the trampoline entry for\n"
         "\t\tthe instruction at address ADDR.  This can be used to debug\n"
@@ -284,8 +584,11 @@ static void usage(FILE *stream, const char *progname)
 enum Option
 {
     OPTION_DEBUG,
+    OPTION_EMIT_MMAP,
+    OPTION_EMIT_THREADS,
     OPTION_HELP,
     OPTION_INPUT,
+    OPTION_LAZY_LOADER,
     OPTION_MEM_GRANULARITY,
     OPTION_MEM_LB,
     OPTION_MEM_LOADER,
@@ -296,15 +599,22 @@ enum Option
     OPTION_OJUMP_ELIM_SIZE,
     OPTION_OJUMP_PEEPHOLE,
     OPTION_OORDER_TRAMPOLINES,
+    OPTION_OPROFILE,
     OPTION_OSCRATCH_STACK,
     OPTION_OUTPUT,
+    OPTION_PIPELINE,
+    OPTION_RING,
     OPTION_STATIC_LOADER,
+    OPTION_STATIC_TRAMPOLINES,
+    OPTION_STATS_JSON,
     OPTION_TACTIC_B1,
     OPTION_TACTIC_B2,
     OPTION_TACTIC_T1,
     OPTION_TACTIC_T2,
     OPTION_TACTIC_T3,
     OPTION_TACTIC_BACKWARD_T3,
+    OPTION_THREADS,
+    OPTION_TRACE_PROGRESS,
     OPTION_TRAP,
     OPTION_TRAP_ALL,
     OPTION_TRAP_ENTRY,
@@ -323,10 +633,14 @@ void parseOptions(int argc, char * const argv[], bool api)
         {"Ojump-elim-size",    req_arg, nullptr, OPTION_OJUMP_ELIM_SIZE},
         {"Ojump-peephole",     opt_arg, nullptr, OPTION_OJUMP_PEEPHOLE},
         {"Oorder-trampolines", opt_arg, nullptr, OPTION_OORDER_TRAMPOLINES},
+        {"Oprofile",           req_arg, nullptr, OPTION_OPROFILE},
         {"Oscratch-stack",     opt_arg, nullptr, OPTION_OSCRATCH_STACK},
         {"debug",              no_arg,  nullptr, OPTION_DEBUG},
+        {"emit-mmap",          opt_arg, nullptr, OPTION_EMIT_MMAP},
+        {"emit-threads",       req_arg, nullptr, OPTION_EMIT_THREADS},
         {"help",               no_arg,  nullptr, OPTION_HELP},
         {"input",              req_arg, nullptr, OPTION_INPUT},
+        {"lazy-loader",        opt_arg, nullptr, OPTION_LAZY_LOADER},
         {"mem-granularity",    req_arg, nullptr, OPTION_MEM_GRANULARITY},
         {"mem-lb",             req_arg, nullptr, OPTION_MEM_LB},
         {"mem-loader",         req_arg, nullptr, OPTION_MEM_LOADER},
@@ -334,13 +648,19 @@ void parseOptions(int argc, char * const argv[], bool api)
         {"mem-multi-page",     opt_arg, nullptr, OPTION_MEM_MULTI_PAGE},
         {"mem-ub",             req_arg, nullptr, OPTION_MEM_UB},
         {"output",             req_arg, nullptr, OPTION_OUTPUT},
+        {"pipeline",           opt_arg, nullptr, OPTION_PIPELINE},
+        {"ring",               req_arg, nullptr, OPTION_RING},
         {"static-loader",      no_arg,  nullptr, OPTION_STATIC_LOADER},
+        {"static-trampolines", req_arg, nullptr, OPTION_STATIC_TRAMPOLINES},
+        {"stats-json",         req_arg, nullptr, OPTION_STATS_JSON},
         {"tactic-B1",          opt_arg, nullptr, OPTION_TACTIC_B1},
         {"tactic-B2",          opt_arg, nullptr, OPTION_TACTIC_B2},
         {"tactic-T1",          opt_arg, nullptr, OPTION_TACTIC_T1},
         {"tactic-T2",          opt_arg, nullptr, OPTION_TACTIC_T2},
         {"tactic-T3",          opt_arg, nullptr, OPTION_TACTIC_T3},
         {"tactic-backward-T3", no_arg,  nullptr, OPTION_TACTIC_BACKWARD_T3},
+        {"threads",            req_arg, nullptr, OPTION_THREADS},
+        {"trace-progress",     opt_arg, nullptr, OPTION_TRACE_PROGRESS},
         {"trap",               req_arg, nullptr, OPTION_TRAP},
         {"trap-all",           opt_arg, nullptr, OPTION_TRAP_ALL},
         {"trap-entry",         opt_arg, nullptr, OPTION_TRAP_ENTRY},
@@ -357,6 +677,7 @@ void parseOptions(int argc, char * const argv[], bool api)
         switch (opt)
         {
             case OPTION_HELP: case OPTION_INPUT: case OPTION_OUTPUT:
+            case OPTION_PIPELINE: case OPTION_RING: case OPTION_STATS_JSON:
             case 'h': case 'i': case 'o':
                 if (api)
                     error("option `%s' cannot be invoked via the JSON-RPC API",
@@ -370,6 +691,13 @@ void parseOptions(int argc, char * const argv[], bool api)
             case OPTION_DEBUG:
                 option_debug = true;
                 break;
+            case OPTION_EMIT_MMAP:
+                option_emit_mmap = parseBoolOptArg("--emit-mmap", optarg);
+                break;
+            case OPTION_EMIT_THREADS:
+                option_emit_threads = (unsigned)parseIntOptArg(
+                    "--emit-threads", optarg, 0, 256);
+                break;
             case 'h':
             case OPTION_HELP:
                 usage(stdout, argv[0]);
@@ -378,6 +706,9 @@ void parseOptions(int argc, char * const argv[], bool api)
             case OPTION_INPUT:
                 option_input = optarg;
                 break;
+            case OPTION_LAZY_LOADER:
+                option_lazy_loader = parseBoolOptArg("--lazy-loader", optarg);
+                break;
             case OPTION_OJUMP_ELIM:
                 option_Ojump_elim =
                     (unsigned)parseIntOptArg("-Ojump-elim", optarg, 0, 64);
@@ -395,6 +726,9 @@ void parseOptions(int argc, char * const argv[], bool api)
                 option_Oorder_trampolines =
                     parseBoolOptArg("-Oorder-trampolines", optarg);
                 break;
+            case OPTION_OPROFILE:
+                loadProfile(optarg);
+                break;
             case OPTION_OSCRATCH_STACK:
                 option_Oscratch_stack =
                     parseBoolOptArg("-Oscratch-stack", optarg);
@@ -403,6 +737,16 @@ void parseOptions(int argc, char * const argv[], bool api)
             case OPTION_OUTPUT:
                 option_output = optarg;
                 break;
+            case OPTION_PIPELINE:
+                option_pipeline = parseBoolOptArg("--pipeline", optarg);
+                break;
+            case OPTION_RING:
+                if (sscanf(optarg, "%d,%d", &option_ring_memfd,
+                        &option_ring_fd) != 2 || option_ring_memfd < 0 ||
+                        option_ring_fd < 0)
+                    error("failed to parse argument \"%s\" for the `--ring' "
+                        "option; expected \"MEMFD,FD\"", optarg);
+                break;
             case OPTION_TACTIC_B1:
                 option_tactic_B1 =
                     parseBoolOptArg("--tactic-B1", optarg);
@@ -427,6 +771,14 @@ void parseOptions(int argc, char * const argv[], bool api)
                 option_tactic_backward_T3 =
                     parseBoolOptArg("--tactic-backward-T3", optarg);
                 break;
+            case OPTION_THREADS:
+                option_threads =
+                    (unsigned)parseIntOptArg("--threads", optarg, 1, 256);
+                break;
+            case OPTION_TRACE_PROGRESS:
+                option_trace_progress =
+                    parseBoolOptArg("--trace-progress", optarg);
+                break;
             case OPTION_TRAP:
                 option_trap.insert(parseIntOptArg("--trap", optarg, 0,
                     INTPTR_MAX));
@@ -441,6 +793,13 @@ void parseOptions(int argc, char * const argv[], bool api)
                 option_static_loader =
                     parseBoolOptArg("--static-loader", optarg);
                 break;
+            case OPTION_STATIC_TRAMPOLINES:
+                option_static_trampolines = (unsigned)parseIntOptArg(
+                    "--static-trampolines", optarg, 0, 1024);
+                break;
+            case OPTION_STATS_JSON:
+                option_stats_json = optarg;
+                break;
             case OPTION_MEM_GRANULARITY:
                 option_mem_granularity = parseIntOptArg("--mem-granularity",
                     optarg, INTPTR_MIN, INTPTR_MAX);
@@ -497,60 +856,139 @@ void parseOptions(int argc, char * const argv[], bool api)
         error("failed to set `--mem-loader' to address 0x%lx; the address "
             "value must be >= the `--mem-ub' bound (0x%lx)",
             option_mem_loader, option_mem_ub);
+    option_progress = (option_is_tty && !option_debug &&
+        !option_trace_progress);
 }
 
 /*
- * The real entry point.
+ * Write a JSON string.
  */
-extern "C"
-{
-    int realMain(int argc, char **argv);
-};
-int realMain(int argc, char **argv)
+static void writeJSONString(FILE *stream, const char *str)
 {
-    clock_t c0 = clock();
-
-    option_is_tty = (isatty(STDERR_FILENO) != 0);
-    if (getenv("E9PATCH_TTY") != nullptr)
-        option_is_tty = true;
-    if (getenv("E9PATCH_DEBUG") != nullptr)
-        option_debug = true;
+    putc('"', stream);
+    for (; *str != '\0'; str++)
+    {
+        char c = *str;
+        switch (c)
+        {
+            case '"': case '\\':
+                fprintf(stream, "\\%c", c);
+                break;
+            default:
+                if ((unsigned char)c < ' ')
+                    fprintf(stream, "\\u%.4x", (unsigned)c);
+                else
+                    putc(c, stream);
+                break;
+        }
+    }
+    putc('"', stream);
+}
 
-    parseOptions(argc, argv);
+/*
+ * Write the final statistics in JSON format (see `--stats-json').
+ */
+static void writeStatsJSON(const Binary *B, double cpu)
+{
+    FILE *stream = fopen(option_stats_json.c_str(), "w");
+    if (stream == nullptr)
+        error("failed to open file \"%s\" for writing: %s",
+            option_stats_json.c_str(), strerror(errno));
 
-    if (option_input != "-")
+    // The parse phase is everything not covered by the other phases:
+    double wall = getWallTime() - stat_start_time;
+    PhaseTime times[PHASE_MAX];
+    std::copy(stat_phase_time, stat_phase_time + PHASE_MAX, times);
+    times[PHASE_PARSE] = {wall, cpu, false};
+    for (unsigned i = PHASE_PARSE + 1; i < PHASE_MAX; i++)
     {
-        FILE *input = freopen(option_input.c_str(), "r", stdin);
-        if (input == nullptr)
-            error("failed to open file \"%s\" for reading: %s",
-                option_input.c_str(), strerror(errno));
+        times[PHASE_PARSE].wall    -= times[i].wall;
+        times[PHASE_PARSE].cpu     -= times[i].cpu;
+        times[PHASE_PARSE].partial |= times[i].partial;
     }
-    if (option_output != "-")
+    times[PHASE_PARSE].wall = std::max(times[PHASE_PARSE].wall, 0.0);
+    times[PHASE_PARSE].cpu  = std::max(times[PHASE_PARSE].cpu, 0.0);
+    static const char * const phases[PHASE_MAX] =
     {
-        FILE *output = freopen(option_output.c_str(), "w", stdout);
-        if (output == nullptr)
-            error("failed to open file \"%s\" for writing: %s",
-                option_output.c_str(), strerror(errno));
-    }
-    if (isatty(STDIN_FILENO))
-        warning("reading JSON-RPC from a terminal (this is probably not "
-            "what you want, please use an E9PATCH frontend instead!)");
-    
-    Binary *B = nullptr;
-    Message msg;
-    size_t lineno = 1;
-    while (getMessage(stdin, lineno, msg))
+        "parse", "patch", "build_mappings", "optimize_mappings", "flatten",
+        "loader", "write"
+    };
+    struct rusage usage;
+    size_t peak_rss = 0;
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+        peak_rss = (size_t)usage.ru_maxrss * 1024;
+
+    fputs("{\n  \"input_binary\": ", stream);
+    writeJSONString(stream, B->filename);
+    fprintf(stream, ",\n  \"input_mode\": \"%s\",\n",
+        (B->mode == MODE_EXECUTABLE?  "executable": "shared_object"));
+    fprintf(stream, "  \"wall_ms\": %.3f,\n", wall * 1000.0);
+    fprintf(stream, "  \"cpu_ms\": %.3f,\n", cpu * 1000.0);
+    fputs("  \"phases\": {\n", stream);
+    for (unsigned i = 0; i < PHASE_MAX; i++)
     {
-        B = parseMessage(B, msg);
-        lineno = msg.lineno;
+        // The CPU time is omitted if it was not always measured (e.g., the
+        // per-message patching in sequential mode).  This also affects the
+        // parse phase, which is the remainder.
+        fprintf(stream, "    \"%s\": {\"wall_ms\": %.3f", phases[i],
+            times[i].wall * 1000.0);
+        if (!times[i].partial)
+            fprintf(stream, ", \"cpu_ms\": %.3f", times[i].cpu * 1000.0);
+        fprintf(stream, "}%s\n", (i+1 < PHASE_MAX? ",": ""));
     }
-    if (B == nullptr)
-        exit(EXIT_SUCCESS);
+    fputs("  },\n", stream);
+    fprintf(stream, "  \"peak_rss_bytes\": %zu,\n", peak_rss);
+    fprintf(stream, "  \"num_patched\": %zu,\n", stat_num_patched);
+    fprintf(stream, "  \"num_failed\": %zu,\n", stat_num_failed);
+    const size_t num_patched[NUM_TACTICS] =
+        {stat_num_B1, stat_num_B2, stat_num_T1, stat_num_T2, stat_num_T3};
+    static const char * const tactics[NUM_TACTICS] =
+        {"B1", "B2", "T1", "T2", "T3"};
+    fputs("  \"tactics\": {\n", stream);
+    for (unsigned i = 0; i < NUM_TACTICS; i++)
+        fprintf(stream, "    \"%s\": {\"attempts\": %zu, \"patched\": %zu}%s\n",
+            tactics[i], stat_num_attempts[i], num_patched[i],
+            (i+1 < NUM_TACTICS? ",": ""));
+    fputs("  },\n", stream);
+    fprintf(stream, "  \"failures\": {\"disabled\": %zu, \"jump\": %zu, "
+        "\"short\": %zu},\n", stat_num_failed_disabled, stat_num_failed_jump,
+        stat_num_failed_short);
+    fprintf(stream, "  \"layout_cache_hits\": %zu,\n", stat_num_layout_hits);
+    fprintf(stream, "  \"layout_cache_misses\": %zu,\n",
+        stat_num_layout_misses);
+    fprintf(stream, "  \"num_pun_site_skips\": %zu,\n", stat_num_pun_skips);
+    fprintf(stream, "  \"num_alloc_nodes\": %zu,\n", stat_num_alloc_nodes);
+    fprintf(stream, "  \"num_alloc_nodes_peak\": %zu,\n",
+        stat_num_alloc_nodes_peak);
+    fprintf(stream, "  \"alloc_peak_bytes\": %zu,\n",
+        std::max(stat_alloc_peak_bytes, stat_alloc_parallel_peak_bytes));
+    fprintf(stream, "  \"num_virtual_mappings\": %zu,\n",
+        stat_num_virtual_mappings);
+    fprintf(stream, "  \"num_physical_mappings\": %zu,\n",
+        stat_num_physical_mappings);
+    fprintf(stream, "  \"num_virtual_bytes\": %zu,\n",
+        stat_num_virtual_bytes);
+    fprintf(stream, "  \"num_physical_bytes\": %zu,\n",
+        stat_num_physical_bytes);
+    fprintf(stream, "  \"num_loader_mmaps\": %zu,\n", stat_num_loader_mmaps);
+    fprintf(stream, "  \"num_loader_lazy\": %zu,\n", stat_num_loader_lazy);
+    fprintf(stream, "  \"num_loader_segments\": %zu,\n",
+        stat_num_loader_segments);
+    fprintf(stream, "  \"input_file_size\": %zu,\n", stat_input_file_size);
+    fprintf(stream, "  \"output_file_size\": %zu\n", stat_output_file_size);
+    fputs("}\n", stream);
 
-    clock_t c1 = clock();
+    if (fclose(stream) != 0)
+        error("failed to close file \"%s\": %s", option_stats_json.c_str(),
+            strerror(errno));
+}
 
+/*
+ * Print the final statistics.
+ */
+void printStats(const Binary *B, clock_t time)
+{
     size_t stat_num_total = stat_num_patched + stat_num_failed;
-    clock_t stat_time = c1 - c0;
 
     ssize_t MAX_MAPPINGS = 65530;
     const ssize_t MAX_MAPPINGS_DELTA = 128;
@@ -590,6 +1028,34 @@ int realMain(int argc, char **argv)
     printf("num_patched_T3        = %zu / %zu (%.2f%%)\n",
         stat_num_T3, stat_num_total,
         (double)stat_num_T3 / (double)stat_num_total * 100.0);
+    size_t stat_num_layouts = stat_num_layout_hits + stat_num_layout_misses;
+    printf("layout_cache_hits     = %zu / %zu (%.2f%%)\n",
+        stat_num_layout_hits, stat_num_layouts,
+        (double)stat_num_layout_hits / (double)stat_num_layouts * 100.0);
+    printf("num_pun_site_skips    = %zu\n", stat_num_pun_skips);
+    if (!option_hot.empty())
+    {
+        size_t num_hot = 0;
+        std::set<intptr_t> hot_pages;
+        for (auto i = B->allocator.begin(), iend = B->allocator.end();
+                i != iend; ++i)
+        {
+            const Alloc *A = *i;
+            if (A->T == nullptr || A->I == nullptr ||
+                    option_hot.find(A->I->addr) == option_hot.end())
+                continue;
+            num_hot++;
+            for (intptr_t page = A->lb / (intptr_t)PAGE_SIZE;
+                    page <= (A->ub - 1) / (intptr_t)PAGE_SIZE; page++)
+                hot_pages.insert(page);
+        }
+        printf("num_hot_trampolines   = %zu (%zu pages)\n", num_hot,
+            hot_pages.size());
+    }
+    printf("num_alloc_nodes       = %zu (peak %zu)\n",
+        stat_num_alloc_nodes, stat_num_alloc_nodes_peak);
+    printf("alloc_peak_bytes      = %zu\n",
+        std::max(stat_alloc_peak_bytes, stat_alloc_parallel_peak_bytes));
     printf("num_virtual_mappings  = %s%zu%s\n",
         (option_is_tty &&
             (ssize_t)stat_num_virtual_mappings >=
@@ -608,12 +1074,18 @@ int realMain(int argc, char **argv)
     printf("num_physical_bytes    = %zu (%.2f%%)\n", stat_num_physical_bytes,
         (double)stat_num_physical_bytes /
             (double)stat_num_virtual_bytes * 100.0);
+    printf("num_loader_mmaps      = %zu (%zu before coalescing)\n",
+        stat_num_loader_mmaps, stat_num_loader_mmaps_unplanned);
+    if (option_lazy_loader)
+        printf("num_loader_lazy       = %zu\n", stat_num_loader_lazy);
+    if (option_static_trampolines > 0)
+        printf("num_loader_segments   = %zu\n", stat_num_loader_segments);
     printf("input_file_size       = %zu\n", stat_input_file_size);
     printf("output_file_size      = %zu (%.2f%%)\n",
         stat_output_file_size,
         (double)stat_output_file_size / (double)stat_input_file_size * 100.0);
     printf("time_elapsed          = %zdms\n",
-        stat_time * 1000 / CLOCKS_PER_SEC);
+        time * 1000 / CLOCKS_PER_SEC);
     printf("-----------------------------------------------\n");
 
     if ((ssize_t)stat_num_virtual_mappings >= MAX_MAPPINGS - MAX_MAPPINGS_DELTA)
@@ -629,85 +1101,6 @@ int realMain(int argc, char **argv)
                 MAX_MAPPINGS, stat_num_virtual_mappings + 1000,
                 option_mem_mapping_size);
 
-    exit(EXIT_SUCCESS);
+    if (option_stats_json != "")
+        writeStatsJSON(B, (double)time / CLOCKS_PER_SEC);
 }
-
-/*
- * The initial entry point.
- *
- * This includes a test-suite for e9test.sh.  The test suite includes some
- * jumps that are calculated dynamically, which is no problem for e9patch.
- */
-asm (
-    /*
-     * Test #2: the jrcxz instruction:
-     */
-    ".Ltest_2:\n"
-    "xor %ecx,%ecx\n"
-    "inc %ecx\n"
-    ".Ljrcx_loop:\n"
-    "jrcxz .Lrcx_is_zero\n"
-    "dec %ecx\n"
-    "jmp .Ljrcx_loop\n"
-    ".Lrcx_is_zero:\n"
-    "jmp .Ltest_3\n"
-
-    /*
-     * Test #1: indirect jump that depends on argc:
-     */
-    ".Ltest_1:\n"
-    "mov %rdi,%r11\n"
-    "sar $48,%r11\n"
-    "lea (.Ltest_2-777)(%rip),%r10\n"
-    "lea 777(%r10,%r11,8),%r10\n"
-    "push %r10\n"
-    "ret\n"
-    "ud2\n"
-
-    /*
-     * Entry point:
-     */
-    ".globl main\n"
-    ".type main,@function\n"
-    "main:\n"
-    "test %rsi,%rsi\n"
-    "jz .Lskip_123\n"
-    "cmp $0xFFFF,%rdi\n"
-    "jb .Lskip_123\n"
-    "jmp .Ltest_1\n"
-    ".Lskip_123:\n"
-
-    /*
-     * Test #4: a semi-obsfuscated indirect jump to realMain().
-     */
-    ".Ltest_4:\n"
-    "nop\n"
-    "nop\n"
-    "nop\n"
-    "nop\n"
-    "nop\n"
-    "nop\n"
-    "movabs $(realMain-main)-0x14159265, %rax\n"
-    "leaq main+0x6b1db77(%rip), %rbp\n"
-    "leaq 0xd63b6ee(%rbp, %rax), %rax\n"
-    "jmpq *%rax\n"
-
-    /*
-     * Test #3: Dynamically calculated jump target:
-     */
-    ".Ltest_3:\n"
-    "leaq .Ltest_3(%rip),%r10\n"
-    "mov $(.Ltest_3-.Ltest_4)*(.Ltest_3-.Ltest_4),%rax\n"
-    "pxor %xmm0,%xmm0\n"
-    "cvtsi2ss %rax,%xmm0\n"
-    "sqrtss %xmm0,%xmm1\n"
-    "comiss %xmm1,%xmm1\n"
-    "cvttss2si %xmm1,%rax\n"
-    "neg %rax\n"
-    "lea 4(%r10,%rax),%rax\n"
-    "cmp $255,%rax\n"
-    "jle .Lskip\n"
-    "jmp *%rax\n"
-    ".Lskip:\n"
-);
-
@@ -23,12 +23,17 @@
 #include <cstdarg>
 #include <cstdint>
 #include <cstring>
+#include <ctime>
 
 #include <elf.h>
 
+#include <algorithm>
+#include <atomic>
 #include <deque>
 #include <map>
 #include <set>
+#include <string>
+#include <unordered_set>
 #include <vector>
 
 #define NO_RETURN               __attribute__((__noreturn__))
@@ -36,6 +41,8 @@
 
 #define PAGE_SIZE               ((size_t)4096)
 
+#define NUM_TACTICS             5       // B1/B2/T1/T2/T3
+
 /*
  * States of each virtual memory byte.
  */
@@ -255,6 +262,10 @@ struct Tree
 struct Allocator
 {
     Tree tree;                  // Interval tree
+    Node *free = nullptr;       // Node free-list
+    std::vector<void *> slabs;  // Node slabs
+    size_t slab_used = 0;       // Nodes used in the last slab
+    std::set<intptr_t> hot;     // Pages containing hot trampolines
 
     /*
      * Iterators.
@@ -301,6 +312,8 @@ struct Allocator
     {
         tree.root = nullptr;
     }
+    Allocator(const Allocator &) = delete;
+    ~Allocator();
 };
 
 /*
@@ -323,6 +336,48 @@ enum Mode
     MODE_SHARED_OBJECT                  // Binary is a shared object.
 };
 
+/*
+ * Instruction index.  Instructions are stored in chunked arena storage, and
+ * indexed by a flat array sorted by offset.  Instructions usually arrive in
+ * (near) monotone order (descending for e9tool), so the index keeps spare
+ * room at both ends, making insertion near either end cheap.
+ */
+struct InstrSet
+{
+    Instr **index = nullptr;            // Instructions sorted by offset.
+    size_t lo = 0;                      // Index lower bound.
+    size_t hi = 0;                      // Index upper bound.
+    size_t cap = 0;                     // Index capacity.
+    std::vector<void *> chunks;         // Instruction arena chunks.
+    size_t chunk_used = 0;              // Instructions used in last chunk.
+
+    void *alloc();
+    ssize_t insert(Instr *I);
+    Instr *find(off_t offset) const;
+    Instr *lower_bound(off_t offset) const;
+
+    size_t size() const
+    {
+        return hi - lo;
+    }
+    Instr *operator[](size_t i) const
+    {
+        return index[lo + i];
+    }
+    Instr * const *begin() const
+    {
+        return index + lo;
+    }
+    Instr * const *end() const
+    {
+        return index + hi;
+    }
+
+    InstrSet() = default;
+    InstrSet(const InstrSet &) = delete;
+    ~InstrSet();
+};
+
 /*
  * Patch Queue entry.
  */
@@ -350,10 +405,56 @@ struct PatchEntry
     }
 };
 
+/*
+ * Dirty page map.  One bit per page of the input binary, which is set
+ * whenever a tactic modifies a byte of the page.  Bits are never cleared
+ * (an undone patch may leave a page marked but unmodified), so the map is
+ * a superset of the modified pages.  Bits may be set concurrently by the
+ * worker threads (see e9parallel.cpp).
+ */
+struct DirtyMap
+{
+    std::atomic<uint64_t> *words = nullptr; // Bitmap words.
+    size_t num_pages = 0;                   // Number of pages.
+
+    void init(size_t size)
+    {
+        num_pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+        words = new std::atomic<uint64_t>[(num_pages + 63) / 64]();
+    }
+
+    /*
+     * Mark the page containing the given file offset as dirty.
+     */
+    void mark(size_t offset)
+    {
+        size_t page = offset / PAGE_SIZE;
+        uint64_t bit = 1ull << (page % 64);
+        std::atomic<uint64_t> &word = words[page / 64];
+        if ((word.load(std::memory_order_relaxed) & bit) == 0)
+            word.fetch_or(bit, std::memory_order_relaxed);
+    }
+
+    /*
+     * Get the first dirty page >= page, else num_pages.
+     */
+    size_t next(size_t page) const
+    {
+        while (page < num_pages)
+        {
+            uint64_t word = words[page / 64].load(std::memory_order_relaxed);
+            word >>= page % 64;
+            if (word != 0)
+                return std::min(page + __builtin_ctzll(word), num_pages);
+            page = (page / 64 + 1) * 64;
+        }
+        return num_pages;
+    }
+};
+
 /*
  * Binary representation.
  */
-typedef std::map<off_t, Instr *> InstrSet;
 typedef std::deque<PatchEntry> PatchQueue;
 typedef std::map<const char *, Trampoline *, CStrCmp> TrampolineSet;
 typedef std::vector<intptr_t> InitSet;
@@ -375,6 +476,7 @@ struct Binary
         uint8_t *state;                 // The patched binary state.
         size_t size;                    // The patched binary size.
     } patched;
+    DirtyMap dirty;                     // The patched (input) pages.
 
     intptr_t cursor;                    // Patching cursor.
     PatchQueue Q;                       // Instructions queued for patching.
@@ -405,37 +507,122 @@ extern bool option_tactic_T2;
 extern bool option_tactic_T3;
 extern bool option_tactic_backward_T3;
 extern bool option_static_loader;
+extern bool option_lazy_loader;
+extern unsigned option_static_trampolines;
 extern std::set<intptr_t> option_trap;
+extern std::unordered_set<intptr_t> option_hot;
 extern bool option_trap_all;
 extern bool option_trap_entry;
+extern bool option_trace_progress;
+extern bool option_progress;
 extern size_t option_mem_granularity;
 extern intptr_t option_mem_loader;
 extern size_t option_mem_mapping_size;
 extern bool option_mem_multi_page;
 extern intptr_t option_mem_lb;
 extern intptr_t option_mem_ub;
+extern unsigned option_threads;
+extern unsigned option_emit_threads;
+extern bool option_emit_mmap;
+extern std::string option_input;
+extern std::string option_output;
+extern std::string option_stats_json;
+extern bool option_pipeline;
+extern int option_ring_memfd;
+extern int option_ring_fd;
 
 /*
- * Global statistics.
+ * Global statistics.  Statistics updated during patching are thread-local,
+ * and are accumulated into the main thread by the worker threads' owner.
  */
 extern size_t stat_num_patched;
 extern size_t stat_num_failed;
-extern size_t stat_num_B1;
-extern size_t stat_num_B2;
-extern size_t stat_num_T1;
-extern size_t stat_num_T2;
-extern size_t stat_num_T3;
+extern thread_local size_t stat_num_B1;
+extern thread_local size_t stat_num_B2;
+extern thread_local size_t stat_num_T1;
+extern thread_local size_t stat_num_T2;
+extern thread_local size_t stat_num_T3;
+extern thread_local size_t stat_num_attempts[NUM_TACTICS];
+extern size_t stat_num_failed_disabled;
+extern size_t stat_num_failed_jump;
+extern size_t stat_num_failed_short;
+extern thread_local size_t stat_num_layout_hits;
+extern thread_local size_t stat_num_layout_misses;
+extern thread_local size_t stat_num_pun_skips;
+extern thread_local size_t stat_num_alloc_nodes;
+extern thread_local size_t stat_num_alloc_nodes_peak;
+extern thread_local size_t stat_alloc_peak_bytes;
+extern size_t stat_alloc_parallel_peak_bytes;
 extern size_t stat_num_virtual_mappings;
 extern size_t stat_num_physical_mappings;
 extern size_t stat_num_virtual_bytes;
 extern size_t stat_num_physical_bytes;
 extern size_t stat_input_file_size;
 extern size_t stat_output_file_size;
+extern size_t stat_num_loader_mmaps;
+extern size_t stat_num_loader_mmaps_unplanned;
+extern size_t stat_num_loader_lazy;
+extern size_t stat_num_loader_segments;
+
+/*
+ * Phases (for the statistics).  The parse phase is everything not covered
+ * by the other phases.
+ */
+enum Phase
+{
+    PHASE_PARSE,                        // Message parsing.
+    PHASE_PATCH,                        // Queue flush & patching.
+    PHASE_BUILD_MAPPINGS,               // buildMappings().
+    PHASE_OPTIMIZE_MAPPINGS,            // optimizeMappings().
+    PHASE_FLATTEN,                      // flattenMappings().
+    PHASE_LOADER,                       // emitElf() & the loader.
+    PHASE_WRITE,                        // Output file writing.
+    PHASE_MAX
+};
+
+/*
+ * Phase times (in seconds).
+ */
+struct PhaseTime
+{
+    double wall;                        // Wall-clock time.
+    double cpu;                         // CPU time (all threads).
+    bool partial;                       // CPU time not always measured?
+};
+extern PhaseTime stat_phase_time[PHASE_MAX];
+extern double stat_start_time;
+
+extern double getWallTime();
+extern double getCPUTime();
+
+/*
+ * Scoped phase timer.  A nested timer pauses the enclosing timer, so the
+ * phase times are exclusive.  Getting the CPU time is a system call, so
+ * timers for frequent short phases may opt out, in which case the phase's
+ * CPU time is not reported.
+ */
+struct PhaseTimer
+{
+    const Phase phase;                  // Timed phase.
+    const bool cpu;                     // Also time the CPU?
+    PhaseTimer * const parent;          // Enclosing timer (or nullptr).
+    double wall0;                       // Wall-clock start time.
+    double cpu0;                        // CPU start time.
+
+    PhaseTimer(Phase phase, bool cpu = true);
+    ~PhaseTimer();
+
+    void start();
+    void stop();
+};
 
 extern void parseOptions(int argc, char * const argv[], bool api = false);
+extern void printStats(const Binary *B, clock_t time);
 extern void NO_RETURN error(const char *msg, ...);
 extern void warning(const char *msg, ...);
 extern void debugImpl(const char *msg, ...);
+extern void progressImpl(const char *what, size_t n, size_t total);
+extern void progressDone();
 
 #define debug(msg, ...)                                                 \
     do {                                                                \
@@ -443,6 +630,16 @@ extern void debugImpl(const char *msg, ...);
             debugImpl((msg), ##__VA_ARGS__);                            \
     } while (false)
 
+/*
+ * Report progress (n of total, or total=0 if unknown).  The progress line
+ * is only shown on a TTY, and is rate-limited.
+ */
+#define progress(what, n, total)                                        \
+    do {                                                                \
+        if (__builtin_expect(option_progress, false))                   \
+            progressImpl((what), (n), (total));                         \
+    } while (false)
+
 #define ADDRESS_FORMAT              "%s%s0x%lx"
 #define ADDRESS(p)                                                      \
     (IS_ABSOLUTE(p)? "[absolute] ": ""),                                \
@@ -0,0 +1,204 @@
+/*
+ * e9ring.h
+ * Copyright (C) 2021 National University of Singapore
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __E9RING_H
+#define __E9RING_H
+
+/*
+ * Shared-memory ring transport.
+ *
+ * The frontend (producer) and the backend (consumer) share a memfd-backed
+ * single-producer/single-consumer byte ring.  The ring carries the usual
+ * message stream (JSON-RPC text and/or binary frames), so the records are
+ * framed by the messages themselves.  Pipes are only used as doorbells:
+ * the producer writes a byte to the data pipe (the backend's stdin) only
+ * if the consumer is waiting for data, and the consumer writes a byte to
+ * the space pipe only if the producer is waiting for space.  In the
+ * steady state no system calls are needed to transfer messages.
+ *
+ * This header is shared by the frontend and the backend, and is
+ * self-contained.
+ */
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include <algorithm>
+#include <atomic>
+
+#include <unistd.h>
+
+#define RING_MAGIC          0x474E4952E9E9E9E9ull
+#define RING_SIZE           (1ul << 22)     // Ring data size
+#define RING_BLOCK          (1ul << 16)     // Maximum consumer block size
+
+/*
+ * Ring header.  The data follows the header.  The head/tail counters
+ * are never wrapped, and each is only ever advanced by one side.
+ */
+struct RingHeader
+{
+    uint64_t magic;                                 // RING_MAGIC
+    uint64_t size;                                  // Data size (2^n)
+    alignas(64) std::atomic<uint64_t> head;         // Write position
+    alignas(64) std::atomic<uint64_t> tail;         // Read position
+    alignas(64) std::atomic<uint32_t> reader_waiting;// Consumer waiting?
+    std::atomic<uint32_t> writer_waiting;           // Producer waiting?
+    std::atomic<uint32_t> closed;                   // Producer closed?
+
+    uint8_t *data()
+    {
+        return (uint8_t *)this + sizeof(RingHeader);
+    }
+};
+
+static_assert(sizeof(RingHeader) % 64 == 0, "bad ring header size");
+
+/*
+ * Wait for a doorbell.  Returns `false' if the other side has gone.
+ */
+static inline bool ringWait(int fd)
+{
+    char buf[64];
+    while (true)
+    {
+        ssize_t r = read(fd, buf, sizeof(buf));
+        if (r < 0 && errno == EINTR)
+            continue;
+        return (r > 0);
+    }
+}
+
+/*
+ * Ring a doorbell.
+ */
+static inline void ringSignal(int fd)
+{
+    char c = '\0';
+    while (write(fd, &c, sizeof(c)) < 0 && errno == EINTR)
+        ;
+}
+
+/*
+ * Ring producer.
+ */
+struct RingWriter
+{
+    RingHeader *ring = nullptr;         // Shared ring
+    int data_fd  = -1;                  // Data doorbell (write end)
+    int space_fd = -1;                  // Space doorbell (read end)
+
+    /*
+     * Write buf[0..len) into the ring.  Returns `false' if the consumer
+     * has gone.
+     */
+    bool write(const uint8_t *buf, size_t len)
+    {
+        const uint64_t size = ring->size;
+        while (len > 0)
+        {
+            uint64_t head = ring->head.load(std::memory_order_relaxed);
+            uint64_t tail = ring->tail.load(std::memory_order_acquire);
+            uint64_t space = size - (head - tail);
+            if (space == 0)
+            {
+                ring->writer_waiting.store(1);
+                if (ring->tail.load() == tail && !ringWait(space_fd))
+                    return false;
+                ring->writer_waiting.store(0, std::memory_order_relaxed);
+                continue;
+            }
+            uint64_t offset = head & (size - 1);
+            size_t n = (size_t)std::min(std::min((uint64_t)len, space),
+                size - offset);
+            memcpy(ring->data() + offset, buf, n);
+            ring->head.store(head + n);
+            if (ring->reader_waiting.exchange(0) != 0)
+                ringSignal(data_fd);
+            buf += n;
+            len -= n;
+        }
+        return true;
+    }
+
+    /*
+     * Close the ring.
+     */
+    void close()
+    {
+        ring->closed.store(1);
+        ::close(data_fd);
+        ::close(space_fd);
+    }
+};
+
+/*
+ * Ring consumer.
+ */
+struct RingReader
+{
+    RingHeader *ring = nullptr;         // Shared ring
+    int data_fd  = -1;                  // Data doorbell (read end)
+    int space_fd = -1;                  // Space doorbell (write end)
+    size_t pending = 0;                 // Size of the current block
+
+    /*
+     * Release the current block, and get the next block of data.  Blocks
+     * are contiguous and at most RING_BLOCK bytes.  Returns `false' on
+     * end-of-stream.
+     */
+    bool next(const uint8_t **buf, size_t *len)
+    {
+        const uint64_t size = ring->size;
+        uint64_t tail = ring->tail.load(std::memory_order_relaxed) + pending;
+        pending = 0;
+        ring->tail.store(tail);
+        if (ring->writer_waiting.exchange(0) != 0)
+            ringSignal(space_fd);
+        while (true)
+        {
+            bool closed = (ring->closed.load() != 0);
+            uint64_t head = ring->head.load(std::memory_order_acquire);
+            if (head != tail)
+            {
+                uint64_t offset = tail & (size - 1);
+                pending = (size_t)std::min(std::min(head - tail,
+                    size - offset), (uint64_t)RING_BLOCK);
+                *buf = ring->data() + offset;
+                *len = pending;
+                return true;
+            }
+            if (closed)
+                return false;
+            ring->reader_waiting.store(1);
+            if (ring->head.load() != tail || ring->closed.load() != 0)
+            {
+                ring->reader_waiting.store(0, std::memory_order_relaxed);
+                continue;
+            }
+            bool alive = ringWait(data_fd);
+            ring->reader_waiting.store(0, std::memory_order_relaxed);
+            if (!alive && ring->head.load() == tail)
+                return false;
+        }
+    }
+};
+
+#endif
@@ -21,6 +21,8 @@
 #include <cstdlib>
 #include <cstring>
 
+#include <vector>
+
 #include "e9alloc.h"
 #include "e9patch.h"
 #include "e9tactics.h"
@@ -38,7 +40,6 @@
  * This code uses short variable names.  See here for the key:
  *
  * A     = a virtual address space allocation (Alloc)
- * B     = the input binary to be rewritten (Binary)
  * I,J,K = instructions (Instr)
  * P,Q   = patches (Patch)
  * T,U   = trampoline (Trampoline)
@@ -52,39 +53,119 @@ enum Tactic
     TACTIC_T2,                          // Successor eviction.
     TACTIC_T3                           // Neighbour eviction.
 };
+static_assert(TACTIC_T3 + 1 == NUM_TACTICS, "invalid number of tactics");
+
+/*
+ * Failure reasons (for the statistics).
+ */
+enum Failure
+{
+    FAILURE_DISABLED,                   // No enabled tactic applies.
+    FAILURE_JUMP,                       // No trampoline in jump range.
+    FAILURE_SHORT                       // No space for a (punned) jump.
+};
 
 /*
  * Representation of a patch.
  */
 struct Patch
 {
-    const Alloc * const A;              // Virtual address space allocation.
-    Instr * const I;                    // Instruction.
+    const Alloc *A;                     // Virtual address space allocation.
+    Instr *I;                           // Instruction.
     Tactic tactic;                      // Tactic used.
-    uint32_t version = 0;               // Tactic version (mutation).
-    const struct Original
-    {
-        intptr_t trampoline;            // Original trampoline address.
-        uint8_t state[PATCH_MAX];       // Original state bytes.
-        uint8_t bytes[PATCH_MAX];       // Original data bytes.
+    intptr_t trampoline;                // Original trampoline address.
+    size_t log;                         // Undo log position.
+    Patch *next;                        // Next dependent patch.
+};
 
-        Original(const uint8_t *state0, const uint8_t *bytes0,
-            intptr_t trampoline) : trampoline(trampoline)
-        {
-            memcpy(state, state0, PATCH_MAX);
-            memcpy(bytes, bytes0, PATCH_MAX);
-        }
-    } original;
-    Patch *next = nullptr;             // Next dependent patch.
+/*
+ * Undo log entry (the original state/data byte at I[i]).
+ */
+struct Undo
+{
+    Instr *I;                           // Instruction.
+    uint8_t i;                          // Byte index.
+    uint8_t state;                      // Original state byte.
+    uint8_t byte;                       // Original data byte.
+};
+
+/*
+ * Patches and the undo log are bump-allocated.  Patches are always undone
+ * or committed in reverse order of creation, so both are simply rewound to
+ * the oldest patch in the chain.
+ */
+#define PATCH_POOL_MAX      16
+static thread_local Patch patch_pool[PATCH_POOL_MAX];
+static thread_local unsigned patch_pool_used = 0;
+static thread_local std::vector<Undo> undo_log;
+static thread_local Failure failure = FAILURE_DISABLED;
+
+/*
+ * Record why the current tactic failed.  The reason of the last failing
+ * tactic is reported (see patch()).
+ */
+static Patch *fail(Failure reason)
+{
+    failure = reason;
+    return nullptr;
+}
+static DirtyMap *dirty_map = nullptr;
+
+/*
+ * Create a new patch.
+ */
+static Patch *makePatch(Instr *I, Tactic tactic, const Alloc *A = nullptr)
+{
+    if (patch_pool_used >= PATCH_POOL_MAX)
+        error("failed to allocate patch; maximum number of pending patches "
+            "(%u) exceeded", PATCH_POOL_MAX);
+    Patch *P = patch_pool + patch_pool_used++;
+    P->A          = A;
+    P->I          = I;
+    P->tactic     = tactic;
+    P->trampoline = I->trampoline;
+    P->log        = undo_log.size();
+    P->next       = nullptr;
+    if (A != nullptr && A->T == evicteeTrampoline)
+        I->evicted = true;
+    return P;
+}
+
+/*
+ * Set the dirty page map.
+ */
+void setDirtyMap(DirtyMap *dirty)
+{
+    dirty_map = dirty;
+}
 
-    Patch(Instr *I, Tactic t, const Alloc *A = nullptr) :
-        A(A), I(I), tactic(t),
-        original(I->patched.state, I->patched.bytes, I->trampoline)
+/*
+ * Record the original state/data bytes at I[i..i+n) before they are
+ * modified.  All modified bytes are logged, so this also marks the dirty
+ * pages.
+ */
+static void logBytes(Instr *I, unsigned i, unsigned n)
+{
+    assert(i + n <= PATCH_MAX);
+    for (; n > 0; i++, n--)
     {
-        if (A != nullptr && A->T == evicteeTrampoline)
-            I->evicted = true;
+        undo_log.push_back({I, (uint8_t)i, I->patched.state[i],
+            I->patched.bytes[i]});
+        dirty_map->mark((size_t)I->offset + i);
     }
-};
+}
+
+/*
+ * Release a chain of patches.
+ */
+static void release(Patch *P)
+{
+    Patch *Q = P;
+    for (; Q->next != nullptr; Q = Q->next)
+        ;
+    undo_log.resize(Q->log);
+    patch_pool_used = (unsigned)(Q - patch_pool);
+}
 
 /*
  * Convert a tactic to a string.
@@ -143,34 +224,29 @@ static void commit(Patch *P)
             break;
     }
 
-    while (P != nullptr)
-    {
-        // Delete the P (we do not need it anymore)
-        Patch *Q = P;
-        P = P->next;
-        delete Q;
-    }
+    release(P);
 }
 
 /*
  * Undo the application of a patch.
  */
-static void undo(Binary &B, Patch *P)
+static void undo(Allocator &allocator, Patch *P)
 {
-    while (P != nullptr)
+    size_t log = P->log;
+    for (Patch *Q = P; Q != nullptr; Q = Q->next)
     {
-        P->I->evicted    = false;
-        P->I->trampoline = P->original.trampoline;
-        for (unsigned i = 0; i < PATCH_MAX; i++)
-        {
-            P->I->patched.state[i] = P->original.state[i];
-            P->I->patched.bytes[i] = P->original.bytes[i];
-        }
-        deallocate(B.allocator, P->A);
-        Patch *Q = P;
-        P = P->next;
-        delete Q;
+        Q->I->evicted    = false;
+        Q->I->trampoline = Q->trampoline;
+        deallocate(allocator, Q->A);
+        log = Q->log;
     }
+    for (size_t i = undo_log.size(); i > log; i--)
+    {
+        const Undo &U = undo_log[i-1];
+        U.I->patched.state[U.i] = U.state;
+        U.I->patched.bytes[U.i] = U.byte;
+    }
+    release(P);
 }
 
 /*
@@ -256,26 +332,73 @@ static Bounds makeBounds(const Trampoline *T, const Instr *I, const Instr *J,
     return {lo, hi};
 }
 
+/*
+ * Index of infeasible pun sites.  Each entry records a punned jump site (the
+ * address of the jmpq opcode), the trampoline address range implied by the
+ * site's rel32 bytes, and the trampoline size, for which allocation failed.
+ *
+ * Allocations are never released except when undoing a tentative patch, so
+ * the free space of an allocator only ever shrinks between calls to patch().
+ * Thus, if no tentative patch was pending when allocation failed, it will
+ * fail again for any sub-range and any larger size.  This lets the tactics
+ * (especially T3, which retries the same neighbour sites for many different
+ * instructions) skip known dead sites without searching the allocator.
+ */
+#define PUN_INDEX_SIZE      4096
+struct PunSite
+{
+    intptr_t addr;                      // Site address.
+    const Allocator *allocator;         // Allocator.
+    intptr_t lb;                        // Failed range lower bound.
+    intptr_t ub;                        // Failed range upper bound.
+    int size;                           // Failed trampoline size.
+    bool same_page;                     // Failed same-page allocation?
+};
+static thread_local PunSite pun_index[PUN_INDEX_SIZE];
+
 /*
  * Allocate virtual address space for a punned jump.
  */
-static const Alloc *allocatePunnedJump(Binary &B, const Instr *I,
+static const Alloc *allocatePunnedJump(Allocator &allocator, const Instr *I,
     unsigned prefix, const Instr *J, const Trampoline *T)
 {
     for (unsigned i = 0; i <= /*sizeof(jmpq)=*/5; i++)
         if (I->patched.state[prefix + i] == STATE_QUEUED)
             return nullptr;
     auto b = makeBounds(T, I, J, prefix);
-    return allocate(B.allocator, b.lb, b.ub, T, J, !option_mem_multi_page);
+    bool same_page = !option_mem_multi_page;
+    int size = getTrampolineSize(T, J);
+
+    intptr_t addr = I->addr + prefix;
+    PunSite &site = pun_index[(uintptr_t)addr % PUN_INDEX_SIZE];
+    if (site.addr == addr && site.allocator == &allocator &&
+            site.same_page == same_page && b.lb >= site.lb &&
+            b.ub <= site.ub && size >= site.size)
+    {
+        stat_num_pun_skips++;
+        return nullptr;
+    }
+
+    const Alloc *A = allocate(allocator, b.lb, b.ub, T, J, same_page);
+    if (A == nullptr && size >= 0 && patch_pool_used == 0)
+    {
+        site.addr      = addr;
+        site.allocator = &allocator;
+        site.lb        = b.lb;
+        site.ub        = b.ub;
+        site.size      = size;
+        site.same_page = same_page;
+    }
+    return A;
 }
 
 /*
  * Allocate virtual address space for a non-punned jump.
  */
-static const Alloc *allocateJump(Binary &B, const Instr *I,
+static const Alloc *allocateJump(Allocator &allocator, const Instr *I,
     const Trampoline *T)
 {
-    return allocatePunnedJump(B, I, /*prefix=*/0, I, T);
+    return allocatePunnedJump(allocator, I, /*prefix=*/0, I, T);
 }
 
 /*
@@ -287,6 +410,7 @@ static void patchJumpPrefix(Patch *P, unsigned prefix)
     const uint8_t prefixes[] = {0x48, 0x26, 0x36, 0x3E};
     assert(prefix < P->I->size && prefix <= sizeof(prefixes));
 
+    logBytes(P->I, 0, prefix);
     uint8_t *bytes = P->I->patched.bytes, *state = P->I->patched.state;
     for (unsigned i = 0; i < prefix; i++)
     {
@@ -309,6 +433,7 @@ static void patchJump(Patch *P, unsigned offset)
     assert(diff >= INT32_MIN && diff <= INT32_MAX);
     int32_t rel32 = (int32_t)diff;
     
+    logBytes(P->I, offset, JMP_SIZE);
     uint8_t *bytes = P->I->patched.bytes + offset,
             *state = P->I->patched.state + offset;
     assert(*state == STATE_INSTRUCTION || *state == STATE_FREE);
@@ -342,6 +467,7 @@ static void patchShortJump(Patch *P, intptr_t addr)
     assert(diff >= INT8_MIN && diff <= INT8_MAX);
     int8_t rel8 = (int8_t)diff;
 
+    logBytes(P->I, 0, /*sizeof(short jmp)=*/2);
     uint8_t *bytes = P->I->patched.bytes,
             *state = P->I->patched.state;
 
@@ -364,6 +490,7 @@ static void patchUnused(Patch *P, unsigned offset)
     {
         if (P->I->patched.state[i] == STATE_INSTRUCTION)
         {
+            logBytes(P->I, i, 1);
             P->I->patched.bytes[i] = /*int3=*/0xcc;
             P->I->patched.state[i] = STATE_FREE;
         }
@@ -381,15 +508,16 @@ static bool canInstrument(const Instr *I)
 /*
  * Tactic B1: replace the instruction with a jump.
  */
-static Patch *tactic_B1(Binary &B, Instr *I, const Trampoline *T,
+static Patch *tactic_B1(Allocator &allocator, Instr *I, const Trampoline *T,
     Tactic tactic = TACTIC_B1)
 {
     if (I->size < JMP_SIZE || !option_tactic_B1 || !canInstrument(I))
         return nullptr;
-    const Alloc *A = allocateJump(B, I, T);
+    stat_num_attempts[TACTIC_B1] += (tactic == TACTIC_B1);
+    const Alloc *A = allocateJump(allocator, I, T);
     if (A == nullptr)
-        return nullptr;
-    Patch *P = new Patch(I, tactic, A);
+        return fail(FAILURE_JUMP);
+    Patch *P = makePatch(I, tactic, A);
     I->trampoline = A->lb;
     patchJump(P, /*offset=*/0);
     patchUnused(P, /*offset=sizeof(jmpq)=*/5);
@@ -399,15 +527,16 @@ static Patch *tactic_B1(Binary &B, Instr *I, const Trampoline *T,
 /*
  * Tactic B2: replace the instruction with a punned jump.
  */
-static Patch *tactic_B2(Binary &B, Instr *I, const Trampoline *T,
+static Patch *tactic_B2(Allocator &allocator, Instr *I, const Trampoline *T,
     Tactic tactic = TACTIC_B2)
 {
     if (I->size >= JMP_SIZE || !option_tactic_B2 || !canInstrument(I))
         return nullptr;
-    const Alloc *A = allocatePunnedJump(B, I, /*offset=*/0, I, T);
+    stat_num_attempts[TACTIC_B2] += (tactic == TACTIC_B2);
+    const Alloc *A = allocatePunnedJump(allocator, I, /*offset=*/0, I, T);
     if (A == nullptr)
-        return nullptr;
-    Patch *P = new Patch(I, tactic, A);
+        return fail(FAILURE_JUMP);
+    Patch *P = makePatch(I, tactic, A);
     I->trampoline = A->lb;
     patchJump(P, /*offset=*/0);
     return P;
@@ -416,57 +545,61 @@ static Patch *tactic_B2(Binary &B, Instr *I, const Trampoline *T,
 /*
  * Tactic T1: replace the instruction with a prefixed punned jump.
  */
-static Patch *tactic_T1(Binary &B, Instr *I, const Trampoline *T,
+static Patch *tactic_T1(Allocator &allocator, Instr *I, const Trampoline *T,
     Tactic tactic = TACTIC_T1)
 {
     if (I->size >= JMP_SIZE || !option_tactic_T1 || !canInstrument(I))
         return nullptr;
+    stat_num_attempts[TACTIC_T1] += (tactic == TACTIC_T1);
+    Failure reason = FAILURE_SHORT;     // No usable prefix.
     for (unsigned prefix = 1;
             prefix < I->size && prefix < JMP_REL32_SIZE && 
                 (I->patched.state[prefix] == STATE_INSTRUCTION ||
                  I->patched.state[prefix] == STATE_FREE);
             prefix++)
     {
-        const Alloc *A = allocatePunnedJump(B, I, prefix, I, T);
+        const Alloc *A = allocatePunnedJump(allocator, I, prefix, I, T);
         if (A != nullptr)
         {
-            Patch *P = new Patch(I, tactic, A);
+            Patch *P = makePatch(I, tactic, A);
             I->trampoline = A->lb;
             patchJumpPrefix(P, prefix);
             patchJump(P, prefix);
             return P;
         }
+        reason = FAILURE_JUMP;
     }
-    return nullptr;
+    return fail(reason);
 }
 
 /*
  * Tactic T2: evict the successor instruction.
  */
-static Patch *tactic_T2(Binary &B, Instr *I, const Trampoline *T)
+static Patch *tactic_T2(Allocator &allocator, Instr *I, const Trampoline *T)
 {
     if (I->size >= JMP_SIZE || !option_tactic_T2 || !canInstrument(I))
         return nullptr;
+    stat_num_attempts[TACTIC_T2]++;
 
     // Step (1): Evict the successor instruction:
     Instr *J = successor(I);
     if (J == nullptr || !canInstrument(J))
-        return nullptr;
+        return fail(FAILURE_SHORT);
     const Trampoline *U = evicteeTrampoline;
     Patch *Q = nullptr;
-    Q = (Q == nullptr? tactic_B2(B, J, U, TACTIC_T2): Q);
-    Q = (Q == nullptr? tactic_T1(B, J, U, TACTIC_T2): Q);
+    Q = (Q == nullptr? tactic_B2(allocator, J, U, TACTIC_T2): Q);
+    Q = (Q == nullptr? tactic_T1(allocator, J, U, TACTIC_T2): Q);
     if (Q == nullptr)
         return nullptr;
 
     // Step (2): Patch the instruction:
     Patch *P = nullptr;
-    P = (P == nullptr? tactic_B2(B, I, T, TACTIC_T2): P);
-    P = (P == nullptr? tactic_T1(B, I, T, TACTIC_T2): P);
+    P = (P == nullptr? tactic_B2(allocator, I, T, TACTIC_T2): P);
+    P = (P == nullptr? tactic_T1(allocator, I, T, TACTIC_T2): P);
 
     if (P == nullptr)
     {
-        undo(B, Q);
+        undo(allocator, Q);
         return nullptr;
     }
     P->tactic = TACTIC_T2;
@@ -478,7 +611,7 @@ static Patch *tactic_T2(Binary &B, Instr *I, const Trampoline *T)
 /*
  * Tactic T3 (single-byte instruction): evict a neighbour instruction.
  */
-static Patch *tactic_T3b(Binary &B, Instr *I, const Trampoline *T)
+static Patch *tactic_T3b(Allocator &allocator, Instr *I, const Trampoline *T)
 {
     // We can still use T3 on single-byte instructions, only if the next
     // byte interpreted as a short jmp rel8 happens to land in a suitable
@@ -486,20 +619,23 @@ static Patch *tactic_T3b(Binary &B, Instr *I, const Trampoline *T)
 
     if (I->size != 1 || !option_tactic_T3 || !canInstrument(I))
         return nullptr;
+    stat_num_attempts[TACTIC_T3]++;
     Instr *J = I->next;
     if (J == nullptr)
-        return nullptr;
+        return fail(FAILURE_SHORT);
     switch (J->patched.state[0])
     {
         case STATE_INSTRUCTION:
             break;
         default:
-            return nullptr;
+            return fail(FAILURE_SHORT);
     }
     int8_t rel8 = (int8_t)J->patched.bytes[0];
     if (!option_tactic_backward_T3 && rel8 < 1)
-        return nullptr;
+        return fail(FAILURE_SHORT);
     intptr_t target = I->addr + /*sizeof(short jmp)=*/2 + (intptr_t)rel8;
+    if (target < I->addr && I->addr - target < /*sizeof(jmpq)=*/5)
+        return fail(FAILURE_SHORT); // Cannot overlap with short jump.
     if (target >= I->addr)
     {
         for (; J != nullptr && J->addr + J->size <= target; J = J->next)
@@ -512,27 +648,21 @@ static Patch *tactic_T3b(Binary &B, Instr *I, const Trampoline *T)
     }
     if (J == nullptr || target <= J->addr ||
             (J->addr < I->addr && J->addr + J->size > I->addr))
-        return nullptr;
+        return fail(FAILURE_SHORT);
     unsigned i = target - J->addr;
     uint8_t state = J->patched.state[i];
     Patch *P = nullptr;
     const Alloc *A = nullptr;
-    bool save = (bool)J->no_optimize;
-    if (target < I->addr)
-        J->no_optimize = true;
     switch (state)
     {
         case STATE_INSTRUCTION:
         case STATE_FREE:
         {
             // TODO: factor this code out...
-            A = allocatePunnedJump(B, J, i, I, T);
+            A = allocatePunnedJump(allocator, J, i, I, T);
             if (A == nullptr)
-            {
-                J->no_optimize = save;
-                return nullptr;
-            }
-            P = new Patch(J, TACTIC_T3, A);
+                return fail(FAILURE_JUMP);
+            P = makePatch(J, TACTIC_T3, A);
             patchJump(P, i);
             if (state == STATE_FREE)
             {
@@ -540,16 +670,20 @@ static Patch *tactic_T3b(Binary &B, Instr *I, const Trampoline *T)
                 break;
             }
             
-            // Step (2b): Attempt to evict J
+            // Step (2b): Attempt to evict J.  If J precedes I, then J is
+            // patched out-of-order, so disable -Ojump-elim for J:
+            bool save = (bool)J->no_optimize;
+            if (target < I->addr)
+                J->no_optimize = true;
             const Trampoline *U = evicteeTrampoline;
             Patch *Q = nullptr;
-            Q = (Q == nullptr? tactic_B1(B, J, U, TACTIC_T3): Q);
-            Q = (Q == nullptr? tactic_B2(B, J, U, TACTIC_T3): Q);
-            Q = (Q == nullptr? tactic_T1(B, J, U, TACTIC_T3): Q);
+            Q = (Q == nullptr? tactic_B1(allocator, J, U, TACTIC_T3): Q);
+            Q = (Q == nullptr? tactic_B2(allocator, J, U, TACTIC_T3): Q);
+            Q = (Q == nullptr? tactic_T1(allocator, J, U, TACTIC_T3): Q);
             if (Q == nullptr)
             {
                 // Eviction failed...
-                undo(B, P);
+                undo(allocator, P);
                 J->no_optimize = save;
                 return nullptr;
             }
@@ -558,18 +692,17 @@ static Patch *tactic_T3b(Binary &B, Instr *I, const Trampoline *T)
             break;
         }
         default:
-            return nullptr;
+            return fail(FAILURE_SHORT);
     }
     if (P == nullptr)
-    {
-        J->no_optimize = save;
         return nullptr;
-    }
 
     assert(A != nullptr);
-    Patch *Q = new Patch(I, TACTIC_T3);
+    Patch *Q = makePatch(I, TACTIC_T3);
     I->trampoline = A->lb;
     assert(I->patched.state[0] == STATE_INSTRUCTION);
+    logBytes(I, 0, 1);
+    logBytes(I->next, 0, 1);
     I->patched.state[0] = STATE_PATCHED;
     I->patched.bytes[0] = /*short jmp opcode=*/0xEB;
     I->next->patched.state[0] |= STATE_LOCKED;
@@ -580,12 +713,14 @@ static Patch *tactic_T3b(Binary &B, Instr *I, const Trampoline *T)
 /*
  * Tactic T3: evict a neighbour instruction.
  */
-static Patch *tactic_T3(Binary &B, Instr *I, const Trampoline *T)
+static Patch *tactic_T3(Allocator &allocator, Instr *I, const Trampoline *T)
 {
     if (I->size == 1)
-        return tactic_T3b(B, I, T);
+        return tactic_T3b(allocator, I, T);
     if (I->size >= JMP_SIZE || !option_tactic_T3 || !canInstrument(I))
         return nullptr;
+    stat_num_attempts[TACTIC_T3]++;
+    failure = FAILURE_SHORT;            // Until a jump is attempted.
 
     // Step (1): find nearest instruction at +SHORT_JMP_MAX (or
     // -SHORT_JMP_MIN) bytes ahead.
@@ -604,7 +739,6 @@ static Patch *tactic_T3(Binary &B, Instr *I, const Trampoline *T)
     Patch *P = nullptr;
     const Alloc *A = nullptr;
     intptr_t addr = 0;
-    bool save = (bool)J->no_optimize;
     for (; P == nullptr; J = J->prev)
     {
         if (J == I)
@@ -613,8 +747,6 @@ static Patch *tactic_T3(Binary &B, Instr *I, const Trampoline *T)
             break;
         if (!option_tactic_backward_T3 && J->addr < I->addr)
             break;
-        if (J->addr < I->addr)
-            J->no_optimize = true;
         if ((I->addr + /*sizeof(short jmp)=*/2) - (J->addr + J->size -1) >
                 -SHORT_JMP_MIN)
         {
@@ -667,11 +799,14 @@ static Patch *tactic_T3(Binary &B, Instr *I, const Trampoline *T)
                 case STATE_INSTRUCTION:
                 {
                     // Step (2a): Attempt to insert a jump here:
-                    A = allocatePunnedJump(B, J, i, I, T);
+                    A = allocatePunnedJump(allocator, J, i, I, T);
                     if (A == nullptr)
+                    {
+                        failure = FAILURE_JUMP;
                         continue;
+                    }
                     addr = J->addr + i;
-                    P = new Patch(J, TACTIC_T3, A);
+                    P = makePatch(J, TACTIC_T3, A);
                     patchJump(P, i);
                     if (state == STATE_FREE)
                     {
@@ -679,16 +814,25 @@ static Patch *tactic_T3(Binary &B, Instr *I, const Trampoline *T)
                         continue;
                     }
                     
-                    // Step (2b): Attempt to evict J
+                    // Step (2b): Attempt to evict J.  If J precedes I,
+                    // then J is patched out-of-order, so disable
+                    // -Ojump-elim for J:
+                    bool save = (bool)J->no_optimize;
+                    if (J->addr < I->addr)
+                        J->no_optimize = true;
                     const Trampoline *U = evicteeTrampoline;
                     Patch *Q = nullptr;
-                    Q = (Q == nullptr? tactic_B1(B, J, U, TACTIC_T3): Q);
-                    Q = (Q == nullptr? tactic_B2(B, J, U, TACTIC_T3): Q);
-                    Q = (Q == nullptr? tactic_T1(B, J, U, TACTIC_T3): Q);
+                    Q = (Q == nullptr?
+                        tactic_B1(allocator, J, U, TACTIC_T3): Q);
+                    Q = (Q == nullptr?
+                        tactic_B2(allocator, J, U, TACTIC_T3): Q);
+                    Q = (Q == nullptr?
+                        tactic_T1(allocator, J, U, TACTIC_T3): Q);
                     if (Q == nullptr)
                     {
                         // Eviction failed...
-                        undo(B, P);
+                        J->no_optimize = save;
+                        undo(allocator, P);
                         P = nullptr;
                         continue;
                     }
@@ -702,15 +846,11 @@ static Patch *tactic_T3(Binary &B, Instr *I, const Trampoline *T)
         }
     }
     if (P == nullptr)
-    {
-        if (J != nullptr)
-            J->no_optimize = save;
         return nullptr;             // T3 failed
-    }
 
     // Step (3): Insert a short jump to the trampoline jump:
     assert(A != nullptr);
-    Patch *Q = new Patch(I, TACTIC_T3);
+    Patch *Q = makePatch(I, TACTIC_T3);
     I->trampoline = A->lb;
     patchShortJump(Q, addr);
     patchUnused(Q, /*sizeof(short jmp)=*/2);
@@ -719,9 +859,11 @@ static Patch *tactic_T3(Binary &B, Instr *I, const Trampoline *T)
 }
 
 /*
- * Patch the instruction at the given offset.
+ * Patch the instruction at the given offset, allocating trampolines from
+ * `allocator`.  If `retry` is set, failures are not reported since the
+ * caller will retry the patch later.
  */
-bool patch(Binary &B, Instr *I, const Trampoline *T)
+bool patch(Allocator &allocator, Instr *I, const Trampoline *T, bool retry)
 {
     switch (I->patched.state[0])
     {
@@ -735,23 +877,39 @@ bool patch(Binary &B, Instr *I, const Trampoline *T)
     }
 
     // Try all patching tactics in order B1/B2/T1/T2/T3:
+    failure = FAILURE_DISABLED;
     Patch *P = nullptr;
     if (P == nullptr)
-        P = tactic_B1(B, I, T);
+        P = tactic_B1(allocator, I, T);
     if (P == nullptr)
-        P = tactic_B2(B, I, T);
+        P = tactic_B2(allocator, I, T);
     if (P == nullptr)
-        P = tactic_T1(B, I, T);
+        P = tactic_T1(allocator, I, T);
     if (P == nullptr)
-        P = tactic_T2(B, I, T);
+        P = tactic_T2(allocator, I, T);
     if (P == nullptr)
-        P = tactic_T3(B, I, T);
+        P = tactic_T3(allocator, I, T);
 
+    if (P == nullptr && retry)
+        return false;
     if (P == nullptr)
     {
         debug("failed to patch instruction at address 0x%lx (%zu)", I->addr,
             I->size);
-        printf("\33[31mX\33[0m");
+        switch (failure)
+        {
+            case FAILURE_JUMP:
+                stat_num_failed_jump++;
+                break;
+            case FAILURE_SHORT:
+                stat_num_failed_short++;
+                break;
+            default:
+                stat_num_failed_disabled++;
+                break;
+        }
+        if (option_trace_progress)
+            printf("\33[31mX\33[0m");
         return false;       // Failed :(
     }
 
@@ -759,7 +917,8 @@ bool patch(Binary &B, Instr *I, const Trampoline *T)
         "trampoline=" ADDRESS_FORMAT ".." ADDRESS_FORMAT "]",
         I->addr, I->size, getTacticName(P->tactic), ADDRESS(I->trampoline),
             ADDRESS(I->trampoline + getTrampolineSize(T, I)));
-    printf("\33[32m.\33[0m");
+    if (option_trace_progress)
+        printf("\33[32m.\33[0m");
     commit(P);
     return true;            // Success!
 }
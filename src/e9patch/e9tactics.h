@@ -21,6 +21,8 @@
 
 #include "e9patch.h"
 
-bool patch(Binary &B, Instr *I, const Trampoline *T);
+bool patch(Allocator &allocator, Instr *I, const Trampoline *T,
+    bool retry = false);
+void setDirtyMap(DirtyMap *dirty);
 
 #endif
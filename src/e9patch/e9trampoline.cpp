@@ -127,21 +127,20 @@ static int buildJump(off_t offset, const Instr *J, Buffer *buf)
 }
 
 /*
- * Build a $continue operation from a trampoline back to the main code.
- *
- * Note this is heavily optimized.  The Naive way would be to simply use a
- * single jmpq to the next instruction (as per the paper).  However, a far
- * better approach is to clone the succeeding instruction sequence up to and
- * including the next control-flow-transfer (CFT) instruction (including
- * other jumps to unrelated trampolines).  This saves a jump and a lot of
- * overhead (since CPUs like locality).
+ * Get the number of instructions that $continue may clone, and whether the
+ * clone sequence ends with a control-flow-transfer (CFT) instruction.  If
+ * `queued' is non-NULL, it is set to whether any of the lookahead
+ * instructions is still queued for patching.  If `jump' is non-NULL, it is
+ * set to the trampoline address of the terminating instruction if it is a
+ * jump to another trampoline, else INTPTR_MIN.
  */
-static int buildContinue(const Instr *I, int32_t offset32, Buffer *buf)
+static unsigned getContinueLookahead(const Instr *I, bool &cft,
+    bool *queued = nullptr, intptr_t *jump = nullptr)
 {
     // Lookahead to find the next unconditional CFT instruction.
     const Instr *J = I;
     unsigned i = 0;
-    bool cft = false;
+    cft = false;
     unsigned size = 0;
     while (!cft && !I->no_optimize && i < option_Ojump_elim &&
         size < option_Ojump_elim_size)
@@ -155,7 +154,41 @@ static int buildContinue(const Instr *I, int32_t offset32, Buffer *buf)
         cft = cft ||
             isUnconditionalControlFlowTransfer(J->original.bytes, J->size);
         size += J->size;
+        if (queued != nullptr && J->patched.state[0] == STATE_QUEUED)
+            *queued = true;
     }
+    if (jump != nullptr)
+        *jump = (cft && J->trampoline != INTPTR_MIN && !J->evicted?
+            J->trampoline: INTPTR_MIN);
+    return i;
+}
+
+/*
+ * Determine if the $continue lookahead of I reaches an instruction that is
+ * still queued for patching.  If so, the trampoline layout of I may change
+ * once that instruction is patched.
+ */
+bool isContinueQueued(const Instr *I)
+{
+    bool cft, queued = false;
+    getContinueLookahead(I, cft, &queued);
+    return queued;
+}
+
+/*
+ * Build a $continue operation from a trampoline back to the main code.
+ *
+ * Note this is heavily optimized.  The Naive way would be to simply use a
+ * single jmpq to the next instruction (as per the paper).  However, a far
+ * better approach is to clone the succeeding instruction sequence up to and
+ * including the next control-flow-transfer (CFT) instruction (including
+ * other jumps to unrelated trampolines).  This saves a jump and a lot of
+ * overhead (since CPUs like locality).
+ */
+static int buildContinue(const Instr *I, int32_t offset32, Buffer *buf)
+{
+    bool cft;
+    unsigned i = getContinueLookahead(I, cft);
 
     const Instr *K = I->next;
     K = (K != nullptr && I->addr + I->size != K->addr? nullptr: K);
@@ -166,7 +199,7 @@ static int buildContinue(const Instr *I, int32_t offset32, Buffer *buf)
     }
 
     // Relocate all instructions up-to-and-including the CFT
-    J = I->next;
+    const Instr *J = I->next;
     int s = I->size, r = 0;
     unsigned save = (buf == nullptr? 0: buf->i);
     bool ok = true;
@@ -209,99 +242,14 @@ static int buildContinue(const Instr *I, int32_t offset32, Buffer *buf)
 }
 
 /*
- * Calculate trampoline size.
- * Returns (-1) if the trampoline cannot be constructed.
- */
-static int getTrampolineSize(const Trampoline *T, const Instr *I,
-    unsigned depth)
-{
-    if (depth > MACRO_DEPTH_MAX)
-        error("failed to get trampoline size; maximum macro expansion depth "
-            "(%u) exceeded", MACRO_DEPTH_MAX);
-    unsigned size = 0;
-    for (unsigned i = 0; i < T->num_entries; i++)
-    {
-        const Entry &entry = T->entries[i];
-        switch (entry.kind)
-        {
-            case ENTRY_DEBUG:
-                size += (I != nullptr && I->debug? /*sizeof(int3)=*/1: 0);
-                continue;
-            case ENTRY_BYTES:
-            case ENTRY_ZEROES:
-                size += entry.length;
-                continue;
-            case ENTRY_INT8:
-                size += sizeof(uint8_t);
-                continue;
-            case ENTRY_INT16:
-                size += sizeof(uint16_t);
-                continue;
-            case ENTRY_INT32:
-                size += sizeof(uint32_t);
-                continue;
-            case ENTRY_INT64:
-                size += sizeof(uint64_t);
-                continue;
-            case ENTRY_LABEL:
-                continue;
-            case ENTRY_MACRO:
-            {
-                Trampoline *U = expandMacro(I->metadata, entry.macro);
-                if (U == nullptr)
-                    error("failed to get trampoline size; metadata for macro "
-                        "\"%s\" is missing", entry.macro);
-                int r = getTrampolineSize(U, I, depth+1);
-                if (size < 0)
-                    return -1;
-                size += r;
-                continue;
-            }
-            case ENTRY_REL8:
-                size += sizeof(int8_t);
-                continue;
-            case ENTRY_REL32:
-                size += sizeof(int32_t);
-                continue;
-            case ENTRY_INSTRUCTION:
-            {
-                int r = relocateInstr(I->addr, /*offset=*/0, I->original.bytes,
-                    I->size, I->pic, nullptr);
-                if (r < 0)
-                    return -1;
-                size += r;
-                continue;
-            }
-            case ENTRY_INSTRUCTION_BYTES:
-                size += I->size;
-                continue;
-            case ENTRY_CONTINUE:
-                size += buildContinue(I, /*offset=*/0, nullptr);
-                continue;
-            case ENTRY_TAKEN:
-                size += /*sizeof(jmpq)=*/5;
-                continue;
-        }
-    }
-    return size;
-}
-
-/*
- * Calculate trampoline size.
- */
-int getTrampolineSize(const Trampoline *T, const Instr *I)
-{
-    return getTrampolineSize(T, I, /*depth=*/0);
-}
-
-/*
- * Calculate trampoline bounds.
+ * Calculate the trampoline layout, i.e., the size and bounds.
+ * Returns `false' if the trampoline cannot be constructed.
  */
-static size_t getTrampolineBounds(const Trampoline *T, const Instr *I,
-    unsigned depth, size_t size, Bounds &b)
+static bool getTrampolineLayout(const Trampoline *T, const Instr *I,
+    unsigned depth, size_t &size, Bounds &b)
 {
     if (depth > MACRO_DEPTH_MAX)
-        error("failed to get trampoline bounds; maximum macro expansion "
+        error("failed to get trampoline layout; maximum macro expansion "
             "depth (%u) exceeded", MACRO_DEPTH_MAX);
     for (unsigned i = 0; i < T->num_entries; i++)
     {
@@ -333,9 +281,10 @@ static size_t getTrampolineBounds(const Trampoline *T, const Instr *I,
             {
                 Trampoline *U = expandMacro(I->metadata, entry.macro);
                 if (U == nullptr)
-                    error("failed to get trampoline bounds; metadata for "
+                    error("failed to get trampoline layout; metadata for "
                         "macro \"%s\" is missing", entry.macro);
-                size = getTrampolineBounds(U, I, depth+1, size, b);
+                if (!getTrampolineLayout(U, I, depth+1, size, b))
+                    return false;
                 continue;
             }
             case ENTRY_REL8:
@@ -370,7 +319,9 @@ static size_t getTrampolineBounds(const Trampoline *T, const Instr *I,
             {
                 int r = relocateInstr(I->addr, /*offset=*/0, I->original.bytes,
                     I->size, I->pic, nullptr);
-                size += (r < 0? 0: r);
+                if (r < 0)
+                    return false;
+                size += r;
                 continue;
             }
             case ENTRY_INSTRUCTION_BYTES:
@@ -384,7 +335,93 @@ static size_t getTrampolineBounds(const Trampoline *T, const Instr *I,
                 continue;
         }
     }
-    return size;
+    return true;
+}
+
+/*
+ * Trampoline layout cache.  The tactics repeatedly query the same (T, I)
+ * layout, e.g., once per prefix for T1 and once per neighbour offset for
+ * T3, so the layout is memoized in a small direct-mapped cache.
+ *
+ * The layout depends on (T, I) and (via $continue) on the lookahead state of
+ * the instructions following I, which changes as neighbours are patched or
+ * evicted.  The lookahead result (and I->debug) is therefore part of the
+ * cache key, including whether the lookahead ends with a jump to another
+ * trampoline (and its address) or with a relocated CFT instruction.  All
+ * other inputs are immutable, except for the options, which invalidate the
+ * whole cache (see flushTrampolineLayouts()).
+ *
+ * The cache is thread-local.  Worker threads (see e9parallel.cpp) only live
+ * for a single batch of patches, so never observe an options change.
+ */
+#define LAYOUT_CACHE_SIZE           1024
+struct Layout
+{
+    const Trampoline *T;                // Trampoline
+    const Instr *I;                     // Instruction
+    unsigned lookahead;                 // $continue lookahead + debug
+    intptr_t jump;                      // $continue terminating jump
+    int size;                           // Size (or -1)
+    Bounds bounds;                      // Bounds
+};
+static thread_local Layout layout_cache[LAYOUT_CACHE_SIZE];
+
+/*
+ * Get the (cached) trampoline layout.
+ */
+static const Layout &getTrampolineLayout(const Trampoline *T,
+    const Instr *I)
+{
+    bool cft;
+    intptr_t jump;
+    unsigned lookahead = getContinueLookahead(I, cft, nullptr, &jump);
+    lookahead = (lookahead << 2) | (cft? 2: 0) | (I->debug? 1: 0);
+
+    uintptr_t hash = ((uintptr_t)T ^ ((uintptr_t)I * 0x9E3779B97F4A7C15ull));
+    hash ^= (hash >> 29);
+    Layout &layout = layout_cache[hash % LAYOUT_CACHE_SIZE];
+    if (layout.T == T && layout.I == I && layout.lookahead == lookahead &&
+            layout.jump == jump)
+    {
+        stat_num_layout_hits++;
+        return layout;
+    }
+    stat_num_layout_misses++;
+
+    size_t size = 0;
+    Bounds b = {INTPTR_MIN, INTPTR_MAX};
+    bool ok = getTrampolineLayout(T, I, /*depth=*/0, size, b);
+    layout.T         = T;
+    layout.I         = I;
+    layout.lookahead = lookahead;
+    layout.jump      = jump;
+    layout.size      = (ok? (int)size: -1);
+    layout.bounds    = b;
+    return layout;
+}
+
+/*
+ * Invalidate all cached trampoline layouts (for the calling thread).
+ */
+void flushTrampolineLayouts(void)
+{
+    memset(layout_cache, 0, sizeof(layout_cache));
+}
+
+/*
+ * Calculate trampoline size.
+ * Returns (-1) if the trampoline cannot be constructed.
+ */
+int getTrampolineSize(const Trampoline *T, const Instr *I)
+{
+    if (I == nullptr)
+    {
+        size_t size = 0;
+        Bounds b = {INTPTR_MIN, INTPTR_MAX};
+        bool ok = getTrampolineLayout(T, I, /*depth=*/0, size, b);
+        return (ok? (int)size: -1);
+    }
+    return getTrampolineLayout(T, I).size;
 }
 
 /*
@@ -395,8 +432,7 @@ Bounds getTrampolineBounds(const Trampoline *T, const Instr *I)
     Bounds b = {INTPTR_MIN, INTPTR_MAX};
     if (T == evicteeTrampoline)
         return b;
-    getTrampolineBounds(T, I, /*depth=*/0, /*size=*/0, b);
-    return b;
+    return getTrampolineLayout(T, I).bounds;
 }
 
 /*
@@ -25,6 +25,8 @@
 
 int getTrampolineSize(const Trampoline *T, const Instr *I);
 Bounds getTrampolineBounds(const Trampoline *T, const Instr *I);
+void flushTrampolineLayouts(void);
+bool isContinueQueued(const Instr *I);
 void flattenTrampoline(uint8_t *buf, size_t, int32_t offset32,
     const Trampoline *T, const Instr *I);
 
@@ -42,6 +42,8 @@
 #include <elf.h>
 
 #include "e9frontend.h"
+#include "e9lib.h"
+#include "e9ring.h"
 
 using namespace e9frontend;
 
@@ -67,6 +69,12 @@ using namespace e9frontend;
 #define RSP_IDX         16
 #define RMAX_IDX        17
 
+/*
+ * Register liveness masks (one bit per register index).
+ */
+#define LIVE_NONE       0x0
+#define LIVE_ALL        ((1u << RMAX_IDX) - 1)
+
 /*
  * Prototypes.
  */
@@ -93,6 +101,9 @@ static void sendMovFromI64ToR64(FILE *out, intptr_t value, int regno);
 static void sendLeaFromPCRelToR64(FILE *out, const char *offset, int regno);
 static void sendLeaFromPCRelToR64(FILE *out, int32_t offset, int regno);
 static void sendLeaFromStackToR64(FILE *out, int32_t offset, int regno);
+static unsigned sendCallTrampolineMessage(FILE *out, const char *name,
+    const std::vector<Argument> &args, bool clean, CallKind call,
+    uint32_t live);
 
 /*
  * Symbols.
@@ -845,6 +856,30 @@ static const int *getCallerSaveRegs(bool clean, bool state, bool conditional,
     }
 }
 
+/*
+ * Get the mask of caller-save registers that must actually be saved, given
+ * the mask of `live' registers at the patch location.
+ */
+static uint32_t getCallerSaveMask(bool clean, bool state, bool conditional,
+    size_t num_args, uint32_t live)
+{
+    const int *rsave = getCallerSaveRegs(clean, state, conditional, num_args);
+    uint32_t mask = LIVE_NONE, all = LIVE_NONE;
+    for (unsigned i = 0; rsave[i] >= 0; i++)
+    {
+        uint32_t reg = (1u << rsave[i]);
+        all |= reg;
+        // If conditional, the first register holds the result, so is
+        // always saved:
+        if (state || (conditional && i == 0) || (live & reg) != 0)
+            mask |= reg;
+    }
+    // Saving %rflags clobbers %rax:
+    if ((mask & (1u << RFLAGS_IDX)) != 0)
+        mask |= (all & (1u << RAX_IDX));
+    return mask;
+}
+
 /*
  * Call state helper class.
  */
@@ -862,10 +897,11 @@ struct CallInfo
         uint32_t clobbered:1;                   // Register clobbered?
         uint32_t used:1;                        // Register in use?
         uint32_t caller_save:1;                 // Register caller save?
+        uint32_t dead:1;                        // Register dead?
 
         RegInfo(int32_t offset, int32_t size, int push) :
             offset(offset), size(size), push(push), saved(0), clobbered(0),
-                used(0), caller_save(0)
+                used(0), caller_save(0), dead(0)
         {
             ;
         }
@@ -905,7 +941,7 @@ struct CallInfo
     int32_t getOffset(Register reg) const
     {
         const RegInfo *rinfo = getInfo(reg);
-        assert(rinfo != nullptr);
+        assert(rinfo != nullptr && !rinfo->dead);
         return rsp_offset - rinfo->offset;
     }
 
@@ -1083,6 +1119,23 @@ struct CallInfo
         pushed.push_back(reg);
     }
 
+    /*
+     * Emulate a dead caller-save register.  The register is never pushed,
+     * and is free to be clobbered.
+     */
+    void kill(Register reg)
+    {
+        reg = getCanonicalReg(reg);
+        assert(getInfo(reg) == nullptr);
+
+        RegInfo rinfo(0, getRegSize(reg), -1);
+        rinfo.saved       = true;
+        rinfo.clobbered   = true;
+        rinfo.caller_save = true;
+        rinfo.dead        = true;
+        info.insert({reg, rinfo});
+    }
+
     /*
      * Emulate the call.
      */
@@ -1147,13 +1200,20 @@ struct CallInfo
      * Constructor.
      */
     CallInfo(bool clean, bool state,  bool conditional, size_t num_args,
-             bool before) :
+             bool before, uint32_t live = LIVE_ALL) :
         rsave(getCallerSaveRegs(clean, state, conditional, num_args)),
         before(before)
     {
+        uint32_t mask = getCallerSaveMask(clean, state, conditional,
+            num_args, live);
         for (unsigned i = 0; rsave[i] >= 0; i++)
-            push(getReg(rsave[i]), /*caller_save=*/true);
-        if (clean)
+        {
+            if ((mask & (1u << rsave[i])) != 0)
+                push(getReg(rsave[i]), /*caller_save=*/true);
+            else
+                kill(getReg(rsave[i]));
+        }
+        if (clean && (mask & (1u << RFLAGS_IDX)) != 0)
         {
             // For clean calls, %rax will be clobbered when %rflags in pushed.
             clobber(REGISTER_RAX);
@@ -1215,6 +1275,8 @@ namespace e9frontend
 static bool option_is_tty      = false;
 static bool option_no_warnings = false;
 static bool option_debug       = false;
+static bool option_binary_rpc  = false;
+static bool option_ring        = false;
 
 /*
  * Backend info.
@@ -1310,14 +1372,21 @@ void e9frontend::sendMessageHeader(FILE *out, const char *method)
         method);
 }
 
+/*
+ * Get the next message ID.
+ */
+static unsigned getMessageId(void)
+{
+    static unsigned next_id = 0;
+    return next_id++;
+}
+
 /*
  * Send message footer.
  */
 unsigned e9frontend::sendMessageFooter(FILE *out, bool sync)
 {
-    static unsigned next_id = 0;
-    unsigned id = next_id;
-    next_id++;
+    unsigned id = getMessageId();
     fprintf(out, "},\"id\":%u}\n", id);
     if (sync)
         fflush(out);
@@ -1421,32 +1490,188 @@ void e9frontend::sendString(FILE *out, const char *s)
 }
 
 /*
- * Send code/data.
+ * Get the length of code/data, excluding any trailing whitespace and comma.
  */
-void e9frontend::sendCode(FILE *out, const char *code)
+static size_t getCodeLength(const char *code)
 {
-     fputc('[', out);
      size_t len = strlen(code);
      while (len > 0 && isspace(code[len-1]))
          len--;
      if (len > 0 && code[len-1] == ',')
          len--;
-     fwrite(code, sizeof(char), len, out);
+     return len;
+}
+
+/*
+ * Send code/data.
+ */
+void e9frontend::sendCode(FILE *out, const char *code)
+{
+     fputc('[', out);
+     fwrite(code, sizeof(char), getCodeLength(code), out);
      fputc(']', out);
 }
 
+/*
+ * Binary RPC encoding.  This is a compact alternative to JSON for the
+ * high-volume messages ("instruction" and "patch").  Each message is sent
+ * as a frame:
+ *
+ *      0xE9 SIZE ID METHOD NUM_PARAMS (NAME VALUE)*
+ *
+ * See e9json.cpp in the backend for the full description.  Strings are
+ * interned, so repeated method/parameter/trampoline names cost only a
+ * 32-bit index.  All other messages (including those sent by plugins)
+ * remain JSON.
+ */
+#define WIRE_MAGIC          0xE9
+#define WIRE_INTEGER        'I'
+#define WIRE_STRING         'S'
+#define WIRE_STRING_REF     'R'
+#define WIRE_JSON           'J'
+
+/*
+ * Binary RPC frame.
+ */
+struct WireFrame
+{
+    std::string buf;                // Frame contents
+
+    WireFrame(const char *method, unsigned num_params)
+    {
+        buf.push_back((char)WIRE_MAGIC);
+        putU32(0);                  // Size (filled in by sendWireFrame())
+        putU32(0);                  // ID   (filled in by sendWireFrame())
+        putString(method);
+        buf.push_back((char)num_params);
+    }
+
+    void putU32(uint32_t x)
+    {
+        for (unsigned i = 0; i < sizeof(uint32_t); i++)
+            buf.push_back((char)(x >> (8 * i)));
+    }
+
+    void putI64(int64_t x)
+    {
+        for (unsigned i = 0; i < sizeof(uint64_t); i++)
+            buf.push_back((char)((uint64_t)x >> (8 * i)));
+    }
+
+    void putString(const char *str)
+    {
+        static std::map<std::string, uint32_t> strings;
+        auto i = strings.find(str);
+        if (i != strings.end())
+        {
+            buf.push_back(WIRE_STRING_REF);
+            putU32(i->second);
+            return;
+        }
+        uint32_t idx = (uint32_t)strings.size();
+        strings.insert({str, idx});
+        size_t len = strlen(str);
+        buf.push_back(WIRE_STRING);
+        putU32((uint32_t)len);
+        buf.append(str, len);
+    }
+
+    void putInteger(const char *name, intptr_t x)
+    {
+        putString(name);
+        buf.push_back(WIRE_INTEGER);
+        putI64((int64_t)x);
+    }
+
+    void putString(const char *name, const char *str)
+    {
+        putString(name);
+        putString(str);
+    }
+
+    void putJSON(const char *name, const std::string &json)
+    {
+        putString(name);
+        buf.push_back(WIRE_JSON);
+        putU32((uint32_t)json.size());
+        buf.append(json);
+    }
+};
+
+/*
+ * Send a binary RPC frame.
+ */
+static unsigned sendWireFrame(FILE *out, WireFrame &frame, bool sync = false)
+{
+    unsigned id = getMessageId();
+    uint32_t size = (uint32_t)(frame.buf.size() - 1 - sizeof(uint32_t));
+    for (unsigned i = 0; i < sizeof(uint32_t); i++)
+    {
+        frame.buf[1 + i] = (char)(size >> (8 * i));
+        frame.buf[1 + sizeof(uint32_t) + i] = (char)(id >> (8 * i));
+    }
+    fwrite(frame.buf.data(), sizeof(char), frame.buf.size(), out);
+    if (sync)
+        fflush(out);
+    return id;
+}
+
+/*
+ * In-process backend.  The high-volume messages are passed to libe9patch
+ * directly as structs.  All other messages (including those sent by
+ * plugins) are written as JSON-RPC to the backend stream as usual, which
+ * buffers the text in memory.  The buffered text is passed to the library
+ * before each direct message, so the message order is preserved.
+ */
+static FILE *inproc_out = nullptr;
+static std::string inproc_buf;
+
+/*
+ * In-process backend stream write.
+ */
+static ssize_t inprocWrite(void *cookie, const char *buf, size_t size)
+{
+    inproc_buf.append(buf, size);
+    return (ssize_t)size;
+}
+
+/*
+ * Pass any buffered messages to the in-process backend.
+ */
+static void inprocFlush(void)
+{
+    fflush(inproc_out);
+    if (inproc_buf.empty())
+        return;
+    e9lib::messages(inproc_buf.data(), inproc_buf.size());
+    inproc_buf.clear();
+}
+
 /*
  * Send a "binary" message.
  */
 static unsigned sendBinaryMessage(FILE *out, const char *mode,
     const char *filename)
 {
+    if (out == inproc_out)
+    {
+        inprocFlush();
+        e9lib::binary({filename, mode});
+        return getMessageId();
+    }
+
     sendMessageHeader(out, "binary");
     sendParamHeader(out, "filename");
     sendString(out, filename);
     sendSeparator(out);
     sendParamHeader(out, "mode");
     sendString(out, mode);
+    if (option_binary_rpc)
+    {
+        sendSeparator(out);
+        sendParamHeader(out, "encoding");
+        sendString(out, "binary");
+    }
     sendSeparator(out, /*last=*/true);
     return sendMessageFooter(out, /*sync=*/true);
 }
@@ -1457,6 +1682,15 @@ static unsigned sendBinaryMessage(FILE *out, const char *mode,
 unsigned e9frontend::sendOptionsMessage(FILE *out,
     std::vector<const char *> &argv)
 {
+    if (out == inproc_out)
+    {
+        inprocFlush();
+        std::vector<const char *> args(argv);
+        args.push_back(nullptr);
+        e9lib::options((char * const *)args.data());
+        return getMessageId();
+    }
+
     sendMessageHeader(out, "options");
     sendParamHeader(out, "argv");
     fputc('[', out);
@@ -1479,6 +1713,22 @@ unsigned e9frontend::sendOptionsMessage(FILE *out,
 static unsigned sendInstructionMessage(FILE *out, intptr_t addr,
     size_t size, off_t offset)
 {
+    if (out == inproc_out)
+    {
+        inprocFlush();
+        e9lib::instruction({addr, size, offset});
+        return getMessageId();
+    }
+
+    if (option_binary_rpc)
+    {
+        WireFrame frame("instruction", 3);
+        frame.putInteger("address", addr);
+        frame.putInteger("length", (intptr_t)size);
+        frame.putInteger("offset", (intptr_t)offset);
+        return sendWireFrame(out, frame);
+    }
+
     sendMessageHeader(out, "instruction");
     sendParamHeader(out, "address");
     sendInteger(out, addr);
@@ -1498,6 +1748,42 @@ static unsigned sendInstructionMessage(FILE *out, intptr_t addr,
 unsigned e9frontend::sendPatchMessage(FILE *out, const char *trampoline,
     off_t offset, const Metadata *metadata)
 {
+    if (out == inproc_out)
+    {
+        inprocFlush();
+        std::vector<e9lib::MetadataEntry> meta;
+        for (unsigned i = 0; metadata != nullptr &&
+                metadata[i].name != nullptr; i++)
+            meta.push_back({metadata[i].name, metadata[i].data});
+        meta.push_back({nullptr, nullptr});
+        e9lib::patch({trampoline, offset,
+            (metadata != nullptr? meta.data(): nullptr)});
+        return getMessageId();
+    }
+
+    if (option_binary_rpc)
+    {
+        WireFrame frame("patch", (metadata != nullptr? 3: 2));
+        frame.putString("trampoline", trampoline);
+        if (metadata != nullptr)
+        {
+            std::string json("{");
+            for (unsigned i = 0; metadata[i].name != nullptr; i++)
+            {
+                json += (i > 0? ",\"$": "\"$");
+                json += metadata[i].name;
+                json += "\":[";
+                json.append(metadata[i].data,
+                    getCodeLength(metadata[i].data));
+                json += ']';
+            }
+            json += '}';
+            frame.putJSON("metadata", json);
+        }
+        frame.putInteger("offset", (intptr_t)offset);
+        return sendWireFrame(out, frame, /*sync=*/true);
+    }
+
     sendMessageHeader(out, "patch");
     sendParamHeader(out, "trampoline");
     sendString(out, trampoline);
@@ -1527,6 +1813,13 @@ unsigned e9frontend::sendPatchMessage(FILE *out, const char *trampoline,
 static unsigned sendEmitMessage(FILE *out, const char *filename,
     const char *format)
 {
+    if (out == inproc_out)
+    {
+        inprocFlush();
+        e9lib::emit({filename, format});
+        return getMessageId();
+    }
+
     sendMessageHeader(out, "emit");
     sendParamHeader(out, "filename");
     sendString(out, filename);
@@ -1543,6 +1836,13 @@ static unsigned sendEmitMessage(FILE *out, const char *filename,
 unsigned e9frontend::sendReserveMessage(FILE *out, intptr_t addr, size_t len,
     bool absolute)
 {
+    if (out == inproc_out)
+    {
+        inprocFlush();
+        e9lib::reserve({addr, absolute, nullptr, len, nullptr, 0x0, 0x0});
+        return getMessageId();
+    }
+
     sendMessageHeader(out, "reserve");
     sendParamHeader(out, "address");
     sendInteger(out, addr);
@@ -1566,6 +1866,20 @@ unsigned e9frontend::sendReserveMessage(FILE *out, intptr_t addr,
     const uint8_t *data, size_t len, int prot, intptr_t init, intptr_t mmap,
     bool absolute)
 {
+    if (out == inproc_out)
+    {
+        inprocFlush();
+        char protection[] =
+        {
+            (prot & PROT_READ?  'r': '-'),
+            (prot & PROT_WRITE? 'w': '-'),
+            (prot & PROT_EXEC?  'x': '-'),
+            '\0'
+        };
+        e9lib::reserve({addr, absolute, data, len, protection, init, mmap});
+        return getMessageId();
+    }
+
     sendMessageHeader(out, "reserve");
     sendParamHeader(out, "address");
     sendInteger(out, addr);
@@ -2283,6 +2597,69 @@ intptr_t e9frontend::getSymbol(const ELF *elf, const char *symbol)
     return ::lookupSymbol(elf, symbol, TYPESIG_UNTYPED);
 }
 
+/*
+ * Get the flags that are guaranteed to be overwritten by an instruction.
+ */
+static uint8_t getFlagsKilled(const InstrInfo *I)
+{
+    switch (I->mnemonic)
+    {
+        case MNEMONIC_SHL: case MNEMONIC_SHR: case MNEMONIC_SAR:
+        case MNEMONIC_SHLD: case MNEMONIC_SHRD: case MNEMONIC_ROL:
+        case MNEMONIC_ROR: case MNEMONIC_RCL: case MNEMONIC_RCR:
+            // The flags are unmodified if the shift count is zero:
+            for (unsigned i = 0; i < I->count.op; i++)
+            {
+                if (I->op[i].type == OPTYPE_IMM && (I->op[i].imm & 0x1f) != 0)
+                    return I->flags.write;
+            }
+            return 0x0;
+        default:
+            return I->flags.write;
+    }
+}
+
+/*
+ * Determine if any of the flags (OF,SF,ZF,AF,PF,CF) may be read before
+ * being overwritten, starting from Is[idx].  Only the fallthrough path is
+ * followed, so any other control-flow conservatively assumes the flags are
+ * live.  If false, trampolines inserted before Is[idx] need not preserve
+ * the flags.
+ */
+bool e9frontend::isFlagsLive(const ELF *elf, const Instr *Is, size_t size,
+    size_t idx)
+{
+    const size_t FLAGS_LIVE_MAX = 64;
+    uint8_t flags = FLAG_ALL;
+    for (size_t i = idx; i < size && i - idx < FLAGS_LIVE_MAX; i++)
+    {
+        if (i > idx && Is[i].address != Is[i-1].address + Is[i-1].size)
+            return true;
+        InstrInfo I;
+        getInstrInfo(elf, &Is[i], &I);
+        if ((I.flags.read & flags) != 0)
+            return true;
+        flags &= ~getFlagsKilled(&I);
+        if (flags == 0x0)
+            return false;
+        switch (I.mnemonic)
+        {
+            case MNEMONIC_RET:
+                return false;           // Flags are not preserved by calls.
+            case MNEMONIC_JMP: case MNEMONIC_CALL: case MNEMONIC_SYSCALL:
+            case MNEMONIC_SYSENTER: case MNEMONIC_HLT: case MNEMONIC_INT:
+            case MNEMONIC_INT1: case MNEMONIC_INT3: case MNEMONIC_INTO:
+            case MNEMONIC_UD0: case MNEMONIC_UD1: case MNEMONIC_UD2:
+                return true;
+            default:
+                if (I.relative)
+                    return true;        // Other branch
+                break;
+        }
+    }
+    return true;
+}
+
 /*
  * Embed an ELF file.
  */
@@ -3178,6 +3555,18 @@ static void sendLeaFromStackToR64(FILE *out, int32_t offset, int regno)
  */
 unsigned e9frontend::sendCallTrampolineMessage(FILE *out, const char *name,
     const std::vector<Argument> &args, bool clean, CallKind call)
+{
+    return ::sendCallTrampolineMessage(out, name, args, clean, call,
+        LIVE_ALL);
+}
+
+/*
+ * Send a call ELF trampoline that only saves the `live' caller-save
+ * registers.
+ */
+static unsigned sendCallTrampolineMessage(FILE *out, const char *name,
+    const std::vector<Argument> &args, bool clean, CallKind call,
+    uint32_t live)
 {
     bool state = false;
     for (const auto &arg: args)
@@ -3211,10 +3600,16 @@ unsigned e9frontend::sendCallTrampolineMessage(FILE *out, const char *name,
     bool conditional = (call == CALL_CONDITIONAL ||
                         call == CALL_CONDITIONAL_JUMP);
     const int *rsave = getCallerSaveRegs(clean, state, conditional, args.size());
+    uint32_t mask = getCallerSaveMask(clean, state, conditional, args.size(),
+        live);
     int num_rsave = 0;
     Register rscratch = (clean || state? REGISTER_RAX: REGISTER_INVALID);
     for (int i = 0; rsave[i] >= 0; i++, num_rsave++)
-        sendPush(out, 0, (call != CALL_AFTER), getReg(rsave[i]), rscratch);
+    {
+        if ((mask & (1u << rsave[i])) != 0)
+            sendPush(out, 0, (call != CALL_AFTER), getReg(rsave[i]),
+                rscratch);
+    }
 
     // Load the arguments:
     fputs("\"$loadArgs\",", out);
@@ -3239,7 +3634,10 @@ unsigned e9frontend::sendCallTrampolineMessage(FILE *out, const char *name,
     // Pop all callee-save registers:
     int rmin = (conditional? 1: 0);
     for (int i = num_rsave-1; i >= rmin; i--)
-        sendPop(out, preserve_rax, getReg(rsave[i]));
+    {
+        if ((mask & (1u << rsave[i])) != 0)
+            sendPop(out, preserve_rax, getReg(rsave[i]));
+    }
 
     // If conditional, jump to $instruction if %rax is zero:
     if (conditional)
@@ -3384,15 +3782,93 @@ static const char *findBinary(const char *filename, bool exe = true,
 }
 
 /*
- * Spawn e9patch backend instance.
+ * Shared-memory ring backend stream write.
+ */
+static ssize_t ringWrite(void *cookie, const char *buf, size_t size)
+{
+    RingWriter *writer = (RingWriter *)cookie;
+    if (!writer->write((const uint8_t *)buf, size))
+    {
+        errno = EPIPE;
+        return -1;
+    }
+    return (ssize_t)size;
+}
+
+/*
+ * Shared-memory ring backend stream close.
+ */
+static int ringClose(void *cookie)
+{
+    RingWriter *writer = (RingWriter *)cookie;
+    writer->close();
+    delete writer;
+    return 0;
+}
+
+/*
+ * Create the shared-memory ring for the backend.  Returns the memfd.
+ */
+static int createRing(RingWriter *writer)
+{
+    int fd = memfd_create("e9patch-ring", MFD_CLOEXEC);
+    if (fd < 0)
+        error("failed to create backend ring: %s", strerror(errno));
+    size_t size = sizeof(RingHeader) + RING_SIZE;
+    if (ftruncate(fd, (off_t)size) < 0)
+        error("failed to resize backend ring: %s", strerror(errno));
+    void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+        0);
+    if (ptr == MAP_FAILED)
+        error("failed to map backend ring: %s", strerror(errno));
+    RingHeader *ring = (RingHeader *)ptr;
+    ring->magic = RING_MAGIC;
+    ring->size  = RING_SIZE;
+    writer->ring = ring;
+    return fd;
+}
+
+/*
+ * Spawn e9patch backend instance.  The special backend "inproc" runs the
+ * backend in-process using libe9patch.
  */
 static void spawnBackend(const char *prog,
     const std::vector<const char *> &options, Backend &backend)
 {
+    if (strcmp(prog, "inproc") == 0)
+    {
+        const char *argv[options.size() + 2];
+        argv[0] = "e9patch";
+        unsigned i = 1;
+        for (const char *option: options)
+            argv[i++] = option;
+        argv[i] = nullptr;
+        e9lib::init((int)i, (char * const *)argv);
+        cookie_io_functions_t funcs = {nullptr, inprocWrite, nullptr,
+            nullptr};
+        inproc_out = fopencookie(nullptr, "w", funcs);
+        if (inproc_out == nullptr)
+            error("failed to open in-process backend stream: %s",
+                strerror(errno));
+        backend.out = inproc_out;
+        backend.pid = 0;
+        return;
+    }
+
     int fds[2];
     if (pipe(fds) != 0)
         error("failed to open pipe to backend process: %s",
             strerror(errno));
+    RingWriter *writer = nullptr;
+    int ring_fd = -1, space_fds[2] = {-1, -1};
+    if (option_ring)
+    {
+        writer = new RingWriter;
+        ring_fd = createRing(writer);
+        if (pipe(space_fds) != 0)
+            error("failed to open pipe to backend process: %s",
+                strerror(errno));
+    }
     pid_t pid = fork();
     if (pid == 0)
     {
@@ -3401,10 +3877,21 @@ static void spawnBackend(const char *prog,
             error("failed to dup backend process pipe file descriptor "
                 "(%d): %s", fds[0], strerror(errno));
         close(fds[0]);
-        const char *argv[options.size() + 2];
+        char ring_arg[64];
+        if (option_ring)
+        {
+            close(space_fds[0]);
+            if (fcntl(ring_fd, F_SETFD, 0) < 0)
+                error("failed to share backend ring: %s", strerror(errno));
+            snprintf(ring_arg, sizeof(ring_arg), "--ring=%d,%d", ring_fd,
+                space_fds[1]);
+        }
+        const char *argv[options.size() + 3];
         prog = findBinary(prog, /*exe=*/true, /*dot=*/true);
         argv[0] = "e9patch";
         unsigned i = 1;
+        if (option_ring)
+            argv[i++] = ring_arg;
         for (const char *option: options)
             argv[i++] = option;
         argv[i] = nullptr;
@@ -3416,7 +3903,19 @@ static void spawnBackend(const char *prog,
         error("failed to fork backend process: %s", strerror(errno));
     
     close(fds[0]);
-    FILE *out = fdopen(fds[1], "w");
+    FILE *out = nullptr;
+    if (option_ring)
+    {
+        close(ring_fd);
+        close(space_fds[1]);
+        writer->data_fd  = fds[1];
+        writer->space_fd = space_fds[0];
+        cookie_io_functions_t funcs = {nullptr, ringWrite, nullptr,
+            ringClose};
+        out = fopencookie(writer, "w", funcs);
+    }
+    else
+        out = fdopen(fds[1], "w");
     if (out == nullptr)
         error("failed to open backend process stream: %s",
             strerror(errno));
@@ -3430,6 +3929,13 @@ static void spawnBackend(const char *prog,
  */
 static void waitBackend(const Backend &backend)
 {
+    if (backend.out == inproc_out)
+    {
+        inprocFlush();
+        fclose(backend.out);
+        e9lib::fini();
+        return;
+    }
     fclose(backend.out);
     
     if (backend.pid == 0)
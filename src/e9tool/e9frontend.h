@@ -2023,8 +2023,9 @@ struct OpInfo
 #define FLAG_AF                 0x04
 #define FLAG_ZF                 0x08
 #define FLAG_SF                 0x10
+#define FLAG_OF                 0x20
 #define FLAG_ALL                \
-    (FLAG_CF | FLAG_PF | FLAG_AF | FLAG_ZF | FLAG_SF)
+    (FLAG_CF | FLAG_PF | FLAG_AF | FLAG_ZF | FLAG_SF | FLAG_OF)
 
 /*
  * Compressed instruction representation.
@@ -2322,6 +2323,8 @@ extern const PLTInfo &getELFPLTInfo(const ELF *elf);
 extern void getInstrInfo(const ELF *elf, const Instr *I, InstrInfo *info,
     void *raw = nullptr);
 extern intptr_t getSymbol(const ELF *elf, const char *symbol);
+extern bool isFlagsLive(const ELF *elf, const Instr *Is, size_t size,
+    size_t idx);
 extern void NO_RETURN error(const char *msg, ...);
 extern void warning(const char *msg, ...);
 extern void debug(const char *msg, ...);
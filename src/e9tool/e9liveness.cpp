@@ -0,0 +1,372 @@
+/*
+ *        ___  _              _
+ *   ___ / _ \| |_ ___   ___ | |
+ *  / _ \ (_) | __/ _ \ / _ \| |
+ * |  __/\__, | || (_) | (_) | |
+ *  \___|  /_/ \__\___/ \___/|_|
+ *
+ * Copyright (C) 2020 National University of Singapore
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Register liveness analysis.
+ *
+ * This is a simple backward dataflow analysis over the disassembled
+ * instructions that computes the GPRs and the individual flags that may be
+ * read before being overwritten.  The control-flow graph is implicit: each
+ * instruction falls through to the next, and/or jumps to a direct target.
+ * Anything that cannot be resolved (indirect jumps, targets outside the
+ * disassembly, traps, etc.) conservatively treats all registers as live.
+ * Calls are assumed to read the argument registers and to preserve
+ * everything else, and returns follow the SysV ABI.
+ *
+ * Call trampolines use the result to avoid saving/restoring dead caller-save
+ * registers.
+ */
+
+#include <algorithm>
+#include <vector>
+
+/*
+ * Successor kinds.
+ */
+#define SUCC_NEXT           0x01        // Fallthrough to the next instruction
+#define SUCC_TARGET         0x02        // Jump to a known target
+#define SUCC_UNKNOWN        0x04        // Unknown successor
+#define SUCC_RETURN         0x08        // Return to caller
+
+/*
+ * Liveness masks.  Bits 0..RMAX_IDX-1 are registers, and the individual
+ * flags (FLAG_*) are tracked separately in the upper bits.  The RFLAGS_IDX
+ * bit is only used in the final result.
+ */
+#define LIVE_REG(idx)       (1u << (idx))
+#define LIVE_FLAG(flag)     ((uint32_t)(flag) << 24)
+#define LIVE_FLAGS          LIVE_FLAG(FLAG_ALL)
+#define LIVE_ANY            ((LIVE_ALL & ~LIVE_REG(RFLAGS_IDX)) | LIVE_FLAGS)
+
+/*
+ * Registers live at function calls/returns.
+ */
+#define LIVE_CALL                                                       \
+    (LIVE_REG(RDI_IDX) | LIVE_REG(RSI_IDX) | LIVE_REG(RDX_IDX) |        \
+     LIVE_REG(RCX_IDX) | LIVE_REG(R8_IDX) | LIVE_REG(R9_IDX) |          \
+     LIVE_REG(RAX_IDX) | LIVE_REG(R10_IDX) | LIVE_REG(RSP_IDX))
+#define LIVE_RETURN                                                     \
+    (LIVE_REG(RAX_IDX) | LIVE_REG(RDX_IDX) | LIVE_REG(RBX_IDX) |        \
+     LIVE_REG(RBP_IDX) | LIVE_REG(R12_IDX) | LIVE_REG(R13_IDX) |        \
+     LIVE_REG(R14_IDX) | LIVE_REG(R15_IDX) | LIVE_REG(RSP_IDX))
+
+/*
+ * Per-instruction liveness information.
+ */
+struct LiveInfo
+{
+    uint32_t use;                       // Registers read.
+    uint32_t def;                       // Registers (fully) overwritten.
+    uint32_t in;                        // Registers live-in.
+    uint32_t succ;                      // Successor kinds.
+    size_t target;                      // Jump target index.
+};
+
+/*
+ * Convert a register into a liveness mask.
+ */
+static uint32_t getRegLive(Register reg)
+{
+    if (reg == REGISTER_EFLAGS)
+        return LIVE_FLAGS;
+    int regno = getRegIdx(reg);
+    return (regno < 0? LIVE_NONE: LIVE_REG(regno));
+}
+
+/*
+ * Find the index of the instruction at the given address.
+ */
+static bool findInstr(const Instr *Is, size_t count, intptr_t addr,
+    size_t *idx)
+{
+    const Instr *I = std::lower_bound(Is, Is + count, addr,
+        [](const Instr &I, intptr_t addr)
+        {
+            return ((intptr_t)I.address < addr);
+        });
+    if (I == Is + count || (intptr_t)I->address != addr)
+        return false;
+    *idx = I - Is;
+    return true;
+}
+
+/*
+ * Check if the instruction only conditionally writes its destination.
+ */
+static bool isConditionalWrite(const InstrInfo *I)
+{
+    switch (I->mnemonic)
+    {
+        case MNEMONIC_CMOVB: case MNEMONIC_CMOVBE: case MNEMONIC_CMOVL:
+        case MNEMONIC_CMOVLE: case MNEMONIC_CMOVNB: case MNEMONIC_CMOVNBE:
+        case MNEMONIC_CMOVNL: case MNEMONIC_CMOVNLE: case MNEMONIC_CMOVNO:
+        case MNEMONIC_CMOVNP: case MNEMONIC_CMOVNS: case MNEMONIC_CMOVNZ:
+        case MNEMONIC_CMOVO: case MNEMONIC_CMOVP: case MNEMONIC_CMOVS:
+        case MNEMONIC_CMOVZ:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/*
+ * Check if the instruction is a zeroing idiom (e.g., xor %eax,%eax), which
+ * does not depend on the old register value.
+ */
+static bool isZeroIdiom(const InstrInfo *I)
+{
+    switch (I->mnemonic)
+    {
+        case MNEMONIC_XOR: case MNEMONIC_SUB:
+            return (I->count.op == 2 &&
+                I->op[0].type == OPTYPE_REG && I->op[1].type == OPTYPE_REG &&
+                I->op[0].reg == I->op[1].reg &&
+                getRegSize(I->op[0].reg) >= (int32_t)sizeof(int32_t));
+        default:
+            return false;
+    }
+}
+
+/*
+ * Build the liveness information for instruction Is[i].
+ */
+static void getLiveInfo(const Instr *Is, size_t count, size_t i,
+    const InstrInfo *I, LiveInfo *L)
+{
+    L->use    = LIVE_NONE;
+    L->def    = LIVE_NONE;
+    L->in     = LIVE_NONE;
+    L->succ   = SUCC_NEXT;
+    L->target = 0;
+
+    bool zero = isZeroIdiom(I);
+    for (unsigned j = 0; I->regs.read[j] != REGISTER_INVALID; j++)
+    {
+        Register reg = I->regs.read[j];
+        if (reg == REGISTER_EFLAGS)
+            continue;
+        if (zero && getCanonicalReg(reg) == getCanonicalReg(I->op[0].reg))
+            continue;
+        L->use |= getRegLive(reg);
+    }
+    L->use |= LIVE_FLAG(I->flags.read);
+    bool cond = isConditionalWrite(I);
+    for (unsigned j = 0; !cond && I->regs.write[j] != REGISTER_INVALID; j++)
+    {
+        // Only 32/64-bit writes overwrite the whole register:
+        Register reg = I->regs.write[j];
+        if (reg != REGISTER_EFLAGS &&
+                getRegSize(reg) >= (int32_t)sizeof(int32_t))
+            L->def |= getRegLive(reg);
+    }
+    L->def |= LIVE_FLAG(getFlagsKilled(I));
+
+    bool direct = (I->relative && I->count.op >= 1 &&
+        I->op[0].type == OPTYPE_IMM);
+    switch (I->mnemonic)
+    {
+        case MNEMONIC_RET:
+            L->succ = SUCC_RETURN;
+            break;
+        case MNEMONIC_CALL:
+            L->use |= LIVE_CALL;
+            break;
+        case MNEMONIC_JMP:
+            L->succ = (direct? SUCC_TARGET: SUCC_UNKNOWN);
+            break;
+        case MNEMONIC_JO: case MNEMONIC_JNO: case MNEMONIC_JB:
+        case MNEMONIC_JAE: case MNEMONIC_JE: case MNEMONIC_JNE:
+        case MNEMONIC_JBE: case MNEMONIC_JA: case MNEMONIC_JS:
+        case MNEMONIC_JNS: case MNEMONIC_JP: case MNEMONIC_JNP:
+        case MNEMONIC_JL: case MNEMONIC_JGE: case MNEMONIC_JLE:
+        case MNEMONIC_JG: case MNEMONIC_JCXZ: case MNEMONIC_JECXZ:
+        case MNEMONIC_JRCXZ: case MNEMONIC_LOOP: case MNEMONIC_LOOPE:
+        case MNEMONIC_LOOPNE: case MNEMONIC_XBEGIN:
+            L->succ |= (direct? SUCC_TARGET: SUCC_UNKNOWN);
+            break;
+        case MNEMONIC_SYSCALL: case MNEMONIC_SYSENTER:
+            L->use |= LIVE_ANY;
+            break;
+        case MNEMONIC_HLT: case MNEMONIC_INT: case MNEMONIC_INT1:
+        case MNEMONIC_INT3: case MNEMONIC_INTO: case MNEMONIC_UD0:
+        case MNEMONIC_UD1: case MNEMONIC_UD2:
+            L->succ = SUCC_UNKNOWN;
+            break;
+        default:
+            break;
+    }
+
+    if ((L->succ & SUCC_TARGET) != 0)
+    {
+        intptr_t target = (intptr_t)I->address + (intptr_t)I->size +
+            (intptr_t)I->op[0].imm;
+        if (!findInstr(Is, count, target, &L->target))
+        {
+            L->succ &= ~SUCC_TARGET;
+            L->succ |= SUCC_UNKNOWN;
+        }
+    }
+    if ((L->succ & SUCC_NEXT) != 0 && (i + 1 >= count ||
+            Is[i+1].address != Is[i].address + Is[i].size))
+    {
+        L->succ &= ~SUCC_NEXT;
+        L->succ |= SUCC_UNKNOWN;
+    }
+}
+
+/*
+ * Get the registers live-out of instruction i.
+ */
+static uint32_t getLiveOut(const std::vector<LiveInfo> &live, size_t i)
+{
+    const LiveInfo &L = live[i];
+    uint32_t out = LIVE_NONE;
+    if ((L.succ & SUCC_NEXT) != 0)
+        out |= live[i+1].in;
+    if ((L.succ & SUCC_TARGET) != 0)
+        out |= live[L.target].in;
+    if ((L.succ & SUCC_RETURN) != 0)
+        out |= LIVE_RETURN;
+    if ((L.succ & SUCC_UNKNOWN) != 0)
+        out |= LIVE_ANY;
+    return out;
+}
+
+/*
+ * Solve the liveness dataflow equations.  The sets only ever grow, and
+ * iterating in reverse propagates along forward edges within a single pass,
+ * so only loops require extra passes.
+ */
+static void analyzeLiveness(std::vector<LiveInfo> &live)
+{
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+        for (size_t i = live.size(); i-- > 0; )
+        {
+            LiveInfo &L = live[i];
+            uint32_t in = L.use | (getLiveOut(live, i) & ~L.def);
+            if (in != L.in)
+            {
+                L.in    = in;
+                changed = true;
+            }
+        }
+    }
+}
+
+/*
+ * Get the registers that must be preserved by the call trampoline for
+ * the given action at instruction i.
+ */
+static uint32_t getLiveRegs(const std::vector<LiveInfo> &live, size_t i,
+    const Action *action, const InstrInfo *I)
+{
+    if (live.empty())
+        return LIVE_ALL;
+
+    uint32_t regs = LIVE_NONE;
+    switch (action->call)
+    {
+        case CALL_BEFORE:
+            regs = live[i].in;
+            break;
+        case CALL_AFTER: case CALL_REPLACE:
+            regs = getLiveOut(live, i);
+            break;
+        case CALL_CONDITIONAL:
+            // The instruction may or may not be skipped:
+            regs = live[i].in | getLiveOut(live, i);
+            break;
+        default:
+            // The jump target is unknown:
+            return LIVE_ALL;
+    }
+
+    // Registers accessed by the arguments must also be preserved:
+    for (const auto &arg: action->args)
+    {
+        switch (arg.kind)
+        {
+            case ARGUMENT_STATE:
+                return LIVE_ALL;
+            case ARGUMENT_REGISTER:
+                regs |= getRegLive((Register)arg.value);
+                break;
+            case ARGUMENT_MEMOP:
+                regs |= getRegLive(arg.memop.base);
+                regs |= getRegLive(arg.memop.index);
+                break;
+            case ARGUMENT_NEXT: case ARGUMENT_TARGET:
+            case ARGUMENT_OP: case ARGUMENT_SRC: case ARGUMENT_DST:
+            case ARGUMENT_IMM: case ARGUMENT_REG: case ARGUMENT_MEM:
+                for (unsigned j = 0; I->regs.read[j] != REGISTER_INVALID; j++)
+                    regs |= getRegLive(I->regs.read[j]);
+                for (unsigned j = 0; I->regs.write[j] != REGISTER_INVALID;
+                        j++)
+                    regs |= getRegLive(I->regs.write[j]);
+                break;
+            default:
+                break;
+        }
+    }
+
+    // %rflags must be preserved if any individual flag is live:
+    if ((regs & LIVE_FLAGS) != 0)
+        regs |= LIVE_REG(RFLAGS_IDX);
+    return (regs & LIVE_ALL);
+}
+
+/*
+ * Get the name of the call trampoline for the given action that saves only
+ * the `live' registers.  The trampoline is sent if it does not exist yet.
+ */
+static const char *getCallTrampolineName(FILE *out, const Action *action,
+    uint32_t live, std::set<const char *, CStrCmp> &have_call)
+{
+    bool state = false;
+    for (const auto &arg: action->args)
+        state = state || (arg.kind == ARGUMENT_STATE);
+    bool conditional = (action->call == CALL_CONDITIONAL ||
+                        action->call == CALL_CONDITIONAL_JUMP);
+    size_t num_args = action->args.size();
+    uint32_t mask = getCallerSaveMask(action->clean, state, conditional,
+        num_args, live);
+    if (mask == getCallerSaveMask(action->clean, state, conditional,
+            num_args, LIVE_ALL))
+        return action->name;
+
+    std::string name(action->name);
+    char buf[32];
+    snprintf(buf, sizeof(buf), "_live_%x", mask);
+    name += buf;
+    auto i = have_call.find(name.c_str());
+    if (i != have_call.end())
+        return *i;
+    const char *live_name = strDup(name.c_str());
+    sendCallTrampolineMessage(out, live_name, action->args, action->clean,
+        action->call, mask);
+    have_call.insert(live_name);
+    return live_name;
+}
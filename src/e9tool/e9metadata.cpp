@@ -1358,7 +1358,7 @@ static void sendArgumentDataMetadata(FILE *out, const Argument &arg,
  */
 static Metadata *buildMetadata(const ELF *elf, const Action *action,
     const InstrInfo *I, intptr_t id, Metadata *metadata, char *buf,
-    size_t size)
+    size_t size, uint32_t live = LIVE_ALL)
 {
     if (action == nullptr)
         return nullptr;
@@ -1414,7 +1414,7 @@ static Metadata *buildMetadata(const ELF *elf, const Action *action,
             bool conditional = (action->call == CALL_CONDITIONAL ||
                                 action->call == CALL_CONDITIONAL_JUMP);
             CallInfo info(action->clean, state, conditional,
-                action->args.size(), before);
+                action->args.size(), before, live);
             TypeSig sig = TYPESIG_EMPTY;
             for (const auto &arg: action->args)
             {
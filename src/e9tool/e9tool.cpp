@@ -52,6 +52,7 @@ static bool option_detail       = false;
 static bool option_intel_syntax = false;
 static std::string option_format("binary");
 static std::string option_output("a.out");
+static std::string option_emit("a.out");
 
 #include "e9plugin.h"
 #include "e9frontend.cpp"
@@ -354,6 +355,11 @@ typedef std::map<size_t, Action *> Actions;
  */
 #include "e9metadata.cpp"
 
+/*
+ * Liveness analysis implementation.
+ */
+#include "e9liveness.cpp"
+
 /*
  * Open a new plugin object.
  */
@@ -2025,7 +2031,9 @@ static void usage(FILE *stream, const char *progname)
         "=============\n"
         "\n"
         "\t--backend PROG\n"
-        "\t\tUse PROG as the backend.  The default is \"e9patch\".\n"
+        "\t\tUse PROG as the backend.  The default is \"e9patch\".  The\n"
+        "\t\tspecial value \"inproc\" runs the backend in-process (using\n"
+        "\t\tlibe9patch), avoiding the pipe and message serialization.\n"
         "\n"
         "\t--compression N, -c N\n"
         "\t\tSet the compression level to be N, where N is a number within\n"
@@ -2036,6 +2044,20 @@ static void usage(FILE *stream, const char *progname)
         "\t--debug\n"
         "\t\tEnable debug output.\n"
         "\n"
+        "\t--emit FILE\n"
+        "\t\tFor `--format json', set the output filename of the final\n"
+        "\t\t\"emit\" message in the message stream to FILE.  The\n"
+        "\t\tdefault filename is \"a.out\".\n"
+        "\n"
+        "\t--encoding ENCODING\n"
+        "\t\tSet the encoding of the message stream sent to the backend\n"
+        "\t\tto ENCODING which is one of {json, binary}.  The \"binary\"\n"
+        "\t\tencoding is more compact and faster to parse, and is used\n"
+        "\t\tfor instruction and patch messages.  The default encoding\n"
+        "\t\tis \"json\".  For `--format json', a \"binary\" encoded\n"
+        "\t\tstream is written with a \".rpc\" (rather than \".json\")\n"
+        "\t\tfilename suffix.\n"
+        "\n"
         "\t--exclude RANGE\n"
         "\t\tExclude the address RANGE from disassembly and rewriting.\n"
         "\t\tHere, RANGE has the format `LB .. UB', where LB/UB are\n"
@@ -2050,13 +2072,16 @@ static void usage(FILE *stream, const char *progname)
         "\n"
         "\t--format FORMAT\n"
         "\t\tSet the output format to FORMAT which is one of {binary,\n"
-        "\t\tjson, patch, patch.gz, patch,bz2, patch.xz}.  Here:\n"
+        "\t\tjson, patch, patch.gz, patch,bz2, patch.xz, patch.e9d}.\n"
+        "\t\tHere:\n"
         "\n"
         "\t\t\t- \"binary\" is a modified ELF executable file;\n"
         "\t\t\t- \"json\" is the raw JSON RPC stream for the e9patch\n"
-        "\t\t\t  backend; or\n"
+        "\t\t\t  backend;\n"
         "\t\t\t- \"patch\" \"patch.gz\" \"patch.bz2\" and \"patch.xz\"\n"
-        "\t\t\t  are (compressed) binary diffs in xxd format.\n"
+        "\t\t\t  are (compressed) binary diffs in xxd format; or\n"
+        "\t\t\t- \"patch.e9d\" is a native binary delta that can be\n"
+        "\t\t\t  applied with the e9apply tool.\n"
         "\n"
         "\t\tThe default format is \"binary\".\n"
         "\n"
@@ -2075,6 +2100,9 @@ static void usage(FILE *stream, const char *progname)
         "\t\t\t-O3 aggressively optimizes for performance, and \n"
         "\t\t\t-Os optimizes for space.\n"
         "\n"
+        "\t\tLevels -O2 and above also use register liveness analysis to\n"
+        "\t\tavoid saving/restoring dead registers in call trampolines.\n"
+        "\n"
         "\t\tThe default is -O1.\n"
         "\n"
         "\t--option OPTION\n"
@@ -2111,6 +2139,14 @@ static void usage(FILE *stream, const char *progname)
         "\n"
         "\t\tThe default syntax is \"ATT\".\n"
         "\n"
+        "\t--transport TRANSPORT\n"
+        "\t\tSet the transport used to send messages to the backend to\n"
+        "\t\tTRANSPORT which is one of {pipe, ring}.  The \"ring\"\n"
+        "\t\ttransport uses a shared-memory ring, and only uses the pipe\n"
+        "\t\tas a doorbell.  This avoids most read()/write() system\n"
+        "\t\tcalls and pipe buffer stalls.  The default transport is\n"
+        "\t\t\"pipe\".\n"
+        "\n"
         "\t--trap=ADDR, --trap-all\n"
         "\t\tInsert a trap (int3) instruction at the corresponding\n"
         "\t\ttrampoline entry.  This can be used for debugging with gdb.\n"
@@ -2126,6 +2162,8 @@ enum Option
     OPTION_BACKEND,
     OPTION_COMPRESSION,
     OPTION_DEBUG,
+    OPTION_EMIT,
+    OPTION_ENCODING,
     OPTION_EXCLUDE,
     OPTION_EXECUTABLE,
     OPTION_FORMAT,
@@ -2138,6 +2176,7 @@ enum Option
     OPTION_STATIC_LOADER,
     OPTION_SYNC,
     OPTION_SYNTAX,
+    OPTION_TRANSPORT,
     OPTION_TRAP,
     OPTION_TRAP_ALL,
 };
@@ -2163,6 +2202,8 @@ int main(int argc, char **argv)
         {"backend",       req_arg, nullptr, OPTION_BACKEND},
         {"compression",   req_arg, nullptr, OPTION_COMPRESSION},
         {"debug",         no_arg,  nullptr, OPTION_DEBUG},
+        {"emit",          req_arg, nullptr, OPTION_EMIT},
+        {"encoding",      req_arg, nullptr, OPTION_ENCODING},
         {"exclude",       req_arg, nullptr, OPTION_EXCLUDE},
         {"executable",    no_arg,  nullptr, OPTION_EXECUTABLE},
         {"format",        req_arg, nullptr, OPTION_FORMAT},
@@ -2175,6 +2216,7 @@ int main(int argc, char **argv)
         {"static-loader", no_arg,  nullptr, OPTION_STATIC_LOADER},
         {"sync",          req_arg, nullptr, OPTION_SYNC},
         {"syntax",        req_arg, nullptr, OPTION_SYNTAX},
+        {"transport",     req_arg, nullptr, OPTION_TRANSPORT},
         {"trap",          req_arg, nullptr, OPTION_TRAP},
         {"trap-all",      no_arg,  nullptr, OPTION_TRAP_ALL},
         {nullptr,         no_arg,  nullptr, 0}
@@ -2222,6 +2264,18 @@ int main(int argc, char **argv)
             case OPTION_DEBUG:
                 option_debug = true;
                 break;
+            case OPTION_EMIT:
+                option_emit = optarg;
+                break;
+            case OPTION_ENCODING:
+                if (strcmp(optarg, "json") == 0)
+                    option_binary_rpc = false;
+                else if (strcmp(optarg, "binary") == 0)
+                    option_binary_rpc = true;
+                else
+                    error("bad value \"%s\" for `--encoding' option; "
+                        "expected \"json\" or \"binary\"", optarg);
+                break;
             case OPTION_EXCLUDE:
             case 'E':
                 option_exclude.push_back(optarg);
@@ -2236,11 +2290,12 @@ int main(int argc, char **argv)
                         option_format != "patch" &&
                         option_format != "patch.gz" &&
                         option_format != "patch.bz2" &&
-                        option_format != "patch.xz")
+                        option_format != "patch.xz" &&
+                        option_format != "patch.e9d")
                     error("bad value \"%s\" for `--format' option; "
                         "expected one of \"binary\", \"json\", \"patch\", "
-                        "\"patch.gz\", \"patch.bz2\", or \"patch.xz\"",
-                        optarg);
+                        "\"patch.gz\", \"patch.bz2\", \"patch.xz\", or "
+                        "\"patch.e9d\"", optarg);
                 break;
             case OPTION_HELP:
             case 'h':
@@ -2304,6 +2359,15 @@ int main(int argc, char **argv)
                     error("bad value \"%s\" for `--syntax' option; "
                         "expected \"ATT\" or \"intel\"", optarg);
                 break;
+            case OPTION_TRANSPORT:
+                if (strcmp(optarg, "pipe") == 0)
+                    option_ring = false;
+                else if (strcmp(optarg, "ring") == 0)
+                    option_ring = true;
+                else
+                    error("bad value \"%s\" for `--transport' option; "
+                        "expected \"pipe\" or \"ring\"", optarg);
+                break;
             case OPTION_TRAP:
             {
                 errno = 0;
@@ -2422,9 +2486,11 @@ int main(int argc, char **argv)
             backend.out = stdout;
         else
         {
+            // A binary encoded stream is not JSON:
+            const char *suffix = (option_binary_rpc? ".rpc": ".json");
             std::string filename(option_output);
-            if (!hasSuffix(option_output, ".json"))
-                filename += ".json";
+            if (!hasSuffix(option_output, suffix))
+                filename += suffix;
             backend.out = fopen(filename.c_str(), "w");
             if (backend.out == nullptr)
                 error("failed to open output file \"%s\": %s",
@@ -2661,12 +2727,24 @@ int main(int argc, char **argv)
     notifyPlugins(backend.out, &elf, Is.data(), Is.size(),
         EVENT_DISASSEMBLY_COMPLETE);
     size_t count = Is.size();
+    std::vector<LiveInfo> live;
+    switch (option_optimization_level)
+    {
+        case '2': case '3': case 's':
+            if (have_call.size() > 0)
+                live.resize(count);
+            break;
+        default:
+            break;
+    }
     // Step (2): Find all matching instructions:
     for (size_t i = 0; i < count; i++)
     {
         RawInstr raw;
         InstrInfo I;
         getInstrInfo(&elf, &Is[i], &I, &raw);
+        if (live.size() > 0)
+            getLiveInfo(Is.data(), count, i, &I, &live[i]);
         matchPlugins(backend.out, &elf, Is.data(), Is.size(), i, &I);
         int idx = match(actions, &I);
         bool matched = (idx >= 0);
@@ -2686,6 +2764,8 @@ int main(int argc, char **argv)
     }
     notifyPlugins(backend.out, &elf, Is.data(), Is.size(),
         EVENT_MATCHING_COMPLETE);
+    // Step (3): Find all live registers:
+    analyzeLiveness(live);
 
     /*
      * Send instructions & patches.  Note: this MUST be done in reverse!
@@ -2721,11 +2801,19 @@ int main(int argc, char **argv)
         else
         {
             // Builtin actions:
+            const char *name = action->name;
+            uint32_t regs = LIVE_ALL;
+            if (action->kind == ACTION_CALL)
+            {
+                regs = getLiveRegs(live, i, action, &I);
+                name = getCallTrampolineName(backend.out, action, regs,
+                    have_call);
+            }
             char buf[BUFSIZ];
             Metadata metadata_buf[MAX_ARGNO+1];
             Metadata *metadata = buildMetadata(&elf, action, &I, id,
-                metadata_buf, buf, sizeof(buf)-1);
-            sendPatchMessage(backend.out, action->name, I.offset,  metadata);
+                metadata_buf, buf, sizeof(buf)-1, regs);
+            sendPatchMessage(backend.out, name, I.offset,  metadata);
         }
     }
     notifyPlugins(backend.out, &elf, Is.data(), Is.size(),
@@ -2746,9 +2834,12 @@ int main(int argc, char **argv)
     else if (option_format == "patch.xz" &&
             !hasSuffix(option_output, ".patch.xz"))
         option_output += ".patch.xz";
+    else if (option_format == "patch.e9d" &&
+            !hasSuffix(option_output, ".patch.e9d"))
+        option_output += ".patch.e9d";
     else if (option_format == "json")
     {
-        option_output = "a.out";
+        option_output = option_emit;
         option_format = "binary";
     }
     sendEmitMessage(backend.out, option_output.c_str(), option_format.c_str());
@@ -187,6 +187,8 @@ void e9frontend::getInstrInfo(const ELF *elf, const Instr *I, InstrInfo *info,
             info->flags.read |= FLAG_ZF;
         if (D->cpu_flags_read & ZYDIS_CPUFLAG_SF)
             info->flags.read |= FLAG_SF;
+        if (D->cpu_flags_read & ZYDIS_CPUFLAG_OF)
+            info->flags.read |= FLAG_OF;
         info->flags.write = 0x0;
         if (D->cpu_flags_written & ZYDIS_CPUFLAG_CF)
             info->flags.write |= FLAG_CF;
@@ -198,6 +200,8 @@ void e9frontend::getInstrInfo(const ELF *elf, const Instr *I, InstrInfo *info,
             info->flags.write |= FLAG_ZF;
         if (D->cpu_flags_written & ZYDIS_CPUFLAG_SF)
             info->flags.write |= FLAG_SF;
+        if (D->cpu_flags_written & ZYDIS_CPUFLAG_OF)
+            info->flags.write |= FLAG_OF;
 
         unsigned j = 0, k = 0, l = 0;
         if (D->cpu_flags_read != 0x0)
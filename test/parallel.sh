@@ -0,0 +1,62 @@
+#!/bin/bash
+#
+# Regression test for parallel patching (--threads) with -Ojump-elim.
+#
+# usage: test/parallel.sh [E9PATCH]
+#
+# Synthetic binaries (see bench/e9synth.cpp) are patched with E9PATCH
+# (default ./e9patch) for several thread counts and -Ojump-elim settings.
+# Patching must succeed, and each patched binary must run successfully.
+#
+
+if [ -t 1 ]
+then
+    RED="\033[31m"
+    GREEN="\033[32m"
+    YELLOW="\033[33m"
+    OFF="\033[0m"
+else
+    RED=
+    GREEN=
+    YELLOW=
+    OFF=
+fi
+
+E9PATCH=${1:-./e9patch}
+
+if [ ! -x ./e9synth ]
+then
+    make synth >/dev/null || exit 1
+fi
+
+mkdir -p tmp/test
+
+PASSED=0
+FAILED=0
+for CONFIG in "" "--short=80" "--pic" "--pic --short=80"
+do
+    NAME=tmp/test/parallel$(echo "$CONFIG" | tr -d ' =-')
+    ./e9synth --size=1M $CONFIG "$NAME" || exit 1
+    for THREADS in 1 2 4 8
+    do
+        for OPTIMIZE in "-Ojump-elim=32 -Ojump-elim-size=64" \
+                        "-Ojump-elim=64 -Ojump-elim-size=512"
+        do
+            DESC="$NAME --threads=$THREADS $OPTIMIZE"
+            if "$E9PATCH" --threads=$THREADS $OPTIMIZE -i "$NAME.json" \
+                    >tmp/test/parallel.log 2>&1 &&
+                "./$NAME.out" >>tmp/test/parallel.log 2>&1
+            then
+                echo -e "${GREEN}PASSED${OFF}: $DESC"
+                PASSED=$((PASSED + 1))
+            else
+                echo -e "${RED}FAILED${OFF}: $DESC"
+                tail -n 1 tmp/test/parallel.log
+                FAILED=$((FAILED + 1))
+            fi
+        done
+    done
+done
+
+echo -e "${YELLOW}passed${OFF}: $PASSED, ${YELLOW}failed${OFF}: $FAILED"
+[ $FAILED -eq 0 ]